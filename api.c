@@ -25,6 +25,13 @@
 #include <unistd.h>
 #include <sys/types.h>
 
+#ifdef USE_LIBEVENT
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <event2/listener.h>
+#endif
+
 #include "compat.h"
 #include "deviceapi.h"
 #ifdef USE_LIBMICROHTTPD
@@ -136,6 +143,7 @@ static const char *OSINFO =
 #define _MINECOIN	"COIN"
 #define _DEBUGSET	"DEBUG"
 #define _SETCONFIG	"SETCONFIG"
+#define _LATENCY	"LATENCY"
 
 static const char ISJSON = '{';
 #define JSON0		"{"
@@ -177,12 +185,18 @@ static const char ISJSON = '{';
 #define JSON_MINECOIN	JSON1 _MINECOIN JSON2
 #define JSON_DEBUGSET	JSON1 _DEBUGSET JSON2
 #define JSON_SETCONFIG	JSON1 _SETCONFIG JSON2
+#define JSON_LATENCY	JSON1 _LATENCY JSON2
 #define JSON_END	JSON4 JSON5
 #define JSON_END_TRUNCATED	JSON4_TRUNCATED JSON5
 #define JSON_BETWEEN_JOIN	","
 
 static const char *JSON_COMMAND = "command";
 static const char *JSON_PARAMETER = "parameter";
+static const char *JSON_KEEPALIVE = "keepalive";
+static const char *JSON_ENCODING = "encoding";
+
+// Bumped whenever a CBOR reply would change shape for existing decoders
+#define API_CBOR_SCHEMA 1
 
 #define MSG_INVGPU 1
 #define MSG_ALRENA 2
@@ -308,6 +322,12 @@ static const char *JSON_PARAMETER = "parameter";
 
 #define MSG_INVNEG 121
 #define MSG_SETQUOTA 122
+#define MSG_LATENCY 123
+#define MSG_SUBSCRIBE 124
+#define MSG_INVSUBSCRIBE 125
+#define MSG_NOSUBSCRIBE 126
+#define MSG_INVENCODING 127
+#define MSG_ENCODEFAIL 128
 
 #define USE_ALTMSG 0x4000
 
@@ -481,6 +501,12 @@ struct CODES {
  { SEVERITY_ERR,   MSG_INVNUM,	PARAM_BOTH,	"Invalid number (%d) for '%s' range is 0-9999" },
  { SEVERITY_ERR,   MSG_INVNEG,	PARAM_BOTH,	"Invalid negative number (%d) for '%s'" },
  { SEVERITY_SUCC,  MSG_SETQUOTA,PARAM_SET,	"Set pool '%s' to quota %d'" },
+ { SEVERITY_SUCC,  MSG_LATENCY,	PARAM_NONE,	"BFGMiner latency" },
+ { SEVERITY_SUCC,  MSG_SUBSCRIBE,	PARAM_STR,	"Subscribed to events: %s" },
+ { SEVERITY_ERR,   MSG_INVSUBSCRIBE,PARAM_STR,	"Invalid event '%s'" },
+ { SEVERITY_ERR,   MSG_NOSUBSCRIBE,PARAM_NONE,	"Event subscriptions need libevent" },
+ { SEVERITY_ERR,   MSG_INVENCODING,PARAM_NONE,	"Invalid encoding, must be 'json' or 'cbor'" },
+ { SEVERITY_ERR,   MSG_ENCODEFAIL,PARAM_STR,	"Failed to encode reply as %s" },
  { SEVERITY_ERR,   MSG_CONPAR,	PARAM_NONE,	"Missing config parameters 'name,N'" },
  { SEVERITY_ERR,   MSG_CONVAL,	PARAM_STR,	"Missing config value N for '%s,N'" },
 #ifdef HAVE_AN_FPGA
@@ -513,6 +539,9 @@ static bool do_a_restart;
 static time_t when = 0;	// when the request occurred
 static bool per_proc;
 
+// The current request, with room for its null terminator
+static char api_reqbuf[RPC_SOCKBUFSIZ + 1];
+
 struct IP4ACCESS {
 	in_addr_t ip;
 	in_addr_t mask;
@@ -539,6 +568,8 @@ static int ips = 0;
 struct io_data {
 	bytes_t data;
 	SOCKETTYPE sock;
+	// Total bytes already sent from data
+	size_t flushed;
 	
 	// Whether to add various things
 	bool close;
@@ -557,6 +588,7 @@ struct io_data *sock_io_new()
 	struct io_data *io_data = malloc(sizeof(struct io_data));
 	bytes_init(&io_data->data);
 	io_data->sock = INVSOCK;
+	io_data->flushed = 0;
 	io_reinit(io_data);
 	return io_data;
 }
@@ -570,6 +602,10 @@ size_t io_flush(struct io_data *io_data, bool complete)
 	fd_set wd;
 	int count = 0;
 	
+	// Replies built for the event loop are queued by the caller instead
+	if (io_data->sock == INVSOCK)
+		return 0;
+	
 	while (tosend)
 	{
 		FD_ZERO(&wd);
@@ -604,6 +640,7 @@ size_t io_flush(struct io_data *io_data, bool complete)
 	}
 	
 	bytes_shift(&io_data->data, sent);
+	io_data->flushed += sent;
 	
 	return sent;
 }
@@ -611,7 +648,7 @@ size_t io_flush(struct io_data *io_data, bool complete)
 static bool io_add(struct io_data *io_data, char *buf)
 {
 	size_t len = strlen(buf);
-	if (bytes_len(&io_data->data) + len > RPC_SOCKBUFSIZ)
+	if (bytes_len(&io_data->data) + len > RPC_SOCKBUFSIZ && io_data->sock != INVSOCK)
 		io_flush(io_data, false);
 	bytes_append(&io_data->data, buf, len);
 	return true;
@@ -1399,6 +1436,32 @@ static const char *status2str(enum alive status)
 	}
 }
 
+static const char *reason2str(enum dev_reason reason)
+{
+	switch (reason) {
+		case REASON_THREAD_FAIL_INIT:
+			return REASON_THREAD_FAIL_INIT_STR;
+		case REASON_THREAD_ZERO_HASH:
+			return REASON_THREAD_ZERO_HASH_STR;
+		case REASON_THREAD_FAIL_QUEUE:
+			return REASON_THREAD_FAIL_QUEUE_STR;
+		case REASON_DEV_SICK_IDLE_60:
+			return REASON_DEV_SICK_IDLE_60_STR;
+		case REASON_DEV_DEAD_IDLE_600:
+			return REASON_DEV_DEAD_IDLE_600_STR;
+		case REASON_DEV_NOSTART:
+			return REASON_DEV_NOSTART_STR;
+		case REASON_DEV_OVER_HEAT:
+			return REASON_DEV_OVER_HEAT_STR;
+		case REASON_DEV_THERMAL_CUTOFF:
+			return REASON_DEV_THERMAL_CUTOFF_STR;
+		case REASON_DEV_COMMS_ERROR:
+			return REASON_DEV_COMMS_ERROR_STR;
+		default:
+			return REASON_UNKNOWN_STR;
+	}
+}
+
 static
 struct api_data *api_add_device_identifier(struct api_data *root, struct cgpu_info *cgpu)
 {
@@ -2813,7 +2876,7 @@ void notifystatus(struct io_data *io_data, int device, struct cgpu_info *cgpu, b
 	struct cgpu_info *proc;
 	struct api_data *root = NULL;
 	char buf[TMPBUFSIZ];
-	char *reason;
+	const char *reason;
 	
 	time_t last_not_well = 0;
 	enum dev_reason uninitialised_var(enum_reason);
@@ -2846,39 +2909,7 @@ void notifystatus(struct io_data *io_data, int device, struct cgpu_info *cgpu, b
 	if (last_not_well == 0)
 		reason = REASON_NONE;
 	else
-		switch (enum_reason)
-		{
-			case REASON_THREAD_FAIL_INIT:
-				reason = REASON_THREAD_FAIL_INIT_STR;
-				break;
-			case REASON_THREAD_ZERO_HASH:
-				reason = REASON_THREAD_ZERO_HASH_STR;
-				break;
-			case REASON_THREAD_FAIL_QUEUE:
-				reason = REASON_THREAD_FAIL_QUEUE_STR;
-				break;
-			case REASON_DEV_SICK_IDLE_60:
-				reason = REASON_DEV_SICK_IDLE_60_STR;
-				break;
-			case REASON_DEV_DEAD_IDLE_600:
-				reason = REASON_DEV_DEAD_IDLE_600_STR;
-				break;
-			case REASON_DEV_NOSTART:
-				reason = REASON_DEV_NOSTART_STR;
-				break;
-			case REASON_DEV_OVER_HEAT:
-				reason = REASON_DEV_OVER_HEAT_STR;
-				break;
-			case REASON_DEV_THERMAL_CUTOFF:
-				reason = REASON_DEV_THERMAL_CUTOFF_STR;
-				break;
-			case REASON_DEV_COMMS_ERROR:
-				reason = REASON_DEV_COMMS_ERROR_STR;
-				break;
-			default:
-				reason = REASON_UNKNOWN_STR;
-				break;
-		}
+		reason = reason2str(enum_reason);
 
 	// ALL counters (and only counters) must start the name with a '*'
 	// Simplifies future external support for identifying new counters
@@ -2998,6 +3029,10 @@ static int itemstats(struct io_data *io_data, int i, char *id, struct cgminer_st
 		root = api_add_uint64(root, "Bytes Recv", &(pool_stats->bytes_received), false);
 		root = api_add_uint64(root, "Net Bytes Sent", &(pool_stats->net_bytes_sent), false);
 		root = api_add_uint64(root, "Net Bytes Recv", &(pool_stats->net_bytes_received), false);
+		root = api_add_uint32(root, "Submit Acks", &(pool_stats->submit_acks), false);
+		root = api_add_timeval(root, "Submit Latency", &(pool_stats->submit_latency), false);
+		root = api_add_timeval(root, "Submit Latency Max", &(pool_stats->submit_latency_max), false);
+		root = api_add_timeval(root, "Submit Latency Min", &(pool_stats->submit_latency_min), false);
 	}
 
 	if (extra)
@@ -3047,6 +3082,80 @@ static void minerstats(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 		io_close(io_data);
 }
 
+static int itemlatency(struct io_data *io_data, int i, char *id, const char *stage, const struct latency_hist *hist, bool isjson)
+{
+	struct api_data *root = NULL;
+	char buf[TMPBUFSIZ];
+	double avg, p50, p90, p99, p999;
+	char *histstr;
+
+	mutex_lock(&stats_lock);
+	avg = hist->count ? ((double)hist->total_us / hist->count) : 0;
+	p50 = latency_hist_percentile(hist, 50);
+	p90 = latency_hist_percentile(hist, 90);
+	p99 = latency_hist_percentile(hist, 99);
+	p999 = latency_hist_percentile(hist, 99.9);
+	root = api_add_int(root, "LATENCY", &i, false);
+	root = api_add_string(root, "ID", id, true);
+	root = api_add_const(root, "Stage", stage, false);
+	root = api_add_uint64(root, "Count", (uint64_t *)&hist->count, true);
+	root = api_add_double(root, "Avg", &avg, true);
+	root = api_add_uint64(root, "Max", (uint64_t *)&hist->max_us, true);
+	histstr = latency_hist_buckets_str(hist);
+	mutex_unlock(&stats_lock);
+
+	root = api_add_double(root, "P50", &p50, true);
+	root = api_add_double(root, "P90", &p90, true);
+	root = api_add_double(root, "P99", &p99, true);
+	root = api_add_double(root, "P99.9", &p999, true);
+	root = api_add_string(root, "Histogram", histstr, false);
+
+	root = print_data(root, buf, isjson, isjson && (i > 0));
+	io_add(io_data, buf);
+	free(histstr);
+
+	return ++i;
+}
+
+static int itemlatencies(struct io_data *io_data, int i, char *id, const struct share_latency_stats *latency, bool isjson)
+{
+	i = itemlatency(io_data, i, id, "Getwork To Nonce", &latency->getwork_to_nonce, isjson);
+	i = itemlatency(io_data, i, id, "Found To Sent", &latency->found_to_sent, isjson);
+	i = itemlatency(io_data, i, id, "Sent To Ack", &latency->sent_to_ack, isjson);
+	return i;
+}
+
+static void latencystats(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
+{
+	struct cgpu_info *cgpu;
+	bool io_open = false;
+	char id[20];
+	int i, j;
+
+	message(io_data, MSG_LATENCY, 0, NULL, isjson);
+
+	if (isjson)
+		io_open = io_add(io_data, COMSTR JSON_LATENCY);
+
+	i = 0;
+	for (j = 0; j < total_devices; j++) {
+		cgpu = get_devices(j);
+
+		if (cgpu && cgpu->drv)
+			i = itemlatencies(io_data, i, cgpu->proc_repr_ns, &cgpu->latency, isjson);
+	}
+
+	for (j = 0; j < total_pools; j++) {
+		struct pool *pool = pools[j];
+
+		sprintf(id, "POOL%d", j);
+		i = itemlatencies(io_data, i, id, &pool->latency, isjson);
+	}
+
+	if (isjson && io_open)
+		io_close(io_data);
+}
+
 static void failoveronly(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, __maybe_unused char group)
 {
 	if (param == NULL || *param == '\0') {
@@ -3363,6 +3472,188 @@ static void dozero(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *p
 		message(io_data, MSG_ZERNOSUM, 0, all ? "All" : "BestShare", isjson);
 }
 
+// Events streamed to subscribed clients, one JSON object per line
+volatile unsigned api_event_mask;
+
+static const struct {
+	const char *name;
+	enum api_event_type type;
+} api_event_names[] = {
+	{ "share",	API_EVENT_SHARE },
+	{ "block",	API_EVENT_BLOCK },
+	{ "pool",	API_EVENT_POOL },
+	{ "device",	API_EVENT_DEVICE },
+	{ "hashrate",	API_EVENT_HASHRATE },
+	{ NULL,		0 }
+};
+
+// Set by the subscribe command for the event loop to apply to the connection
+static bool api_subscribe_set;
+static unsigned api_subscribe_events;
+
+#ifdef USE_LIBEVENT
+struct api_event_hdr {
+	unsigned type;
+	size_t len;
+};
+
+// Events beyond this are dropped until the API thread catches up
+#define API_EVENT_QUEUE_MAX 0x100000
+
+static pthread_mutex_t api_event_lock;
+static bytes_t api_event_queue;
+static notifier_t api_event_notifier;
+
+static void api_event_push(const enum api_event_type type, const char * const line)
+{
+	const struct api_event_hdr hdr = {
+		.type = type,
+		.len = strlen(line),
+	};
+	bool wake;
+
+	mutex_lock(&api_event_lock);
+	wake = !bytes_len(&api_event_queue);
+	if (likely(bytes_len(&api_event_queue) + sizeof(hdr) + hdr.len <= API_EVENT_QUEUE_MAX)) {
+		bytes_append(&api_event_queue, &hdr, sizeof(hdr));
+		bytes_append(&api_event_queue, line, hdr.len);
+	}
+	mutex_unlock(&api_event_lock);
+
+	if (wake)
+		notifier_wake(api_event_notifier);
+}
+#else
+// Nothing can subscribe, so api_event_wanted() keeps this from being reached
+static void api_event_push(__maybe_unused const enum api_event_type type, __maybe_unused const char * const line)
+{
+}
+#endif
+
+void api_event_share(const struct work *work, const struct cgpu_info *cgpu, bool accepted, const char *reason)
+{
+	char buf[TMPBUFSIZ];
+	char *escape = reason ? escape_string((char *)reason, true) : NULL;
+
+	snprintf(buf, sizeof(buf),
+	         "{\"Event\":\"share\",\"When\":%ld,\"POOL\":%d,\"Name\":\"%s\",\"ID\":%d,\"ProcID\":%d,"
+	         "\"Result\":\"%s\",\"Difficulty\":%f,\"Share Difficulty\":%"PRIu64"%s%s%s}\n",
+	         (long)time(NULL), work->pool->pool_no,
+	         cgpu->drv->name, cgpu->device_id, cgpu->proc_id,
+	         accepted ? "Accepted" : "Rejected", work->work_difficulty, work->share_diff,
+	         escape ? ",\"Reason\":\"" : BLANK, escape ?: BLANK, escape ? JSON1 : BLANK);
+	if (escape != reason)
+		free(escape);
+
+	api_event_push(API_EVENT_SHARE, buf);
+}
+
+void api_event_block(const struct pool *pool, const char *hash, double diff)
+{
+	char buf[TMPBUFSIZ];
+
+	snprintf(buf, sizeof(buf),
+	         "{\"Event\":\"block\",\"When\":%ld,\"POOL\":%d,\"Hash\":\"%s\",\"Network Difficulty\":%f}\n",
+	         (long)time(NULL), pool->pool_no, hash, diff);
+
+	api_event_push(API_EVENT_BLOCK, buf);
+}
+
+void api_event_pool(const struct pool *pool)
+{
+	char buf[TMPBUFSIZ];
+	char *escape = escape_string(pool->rpc_url, true);
+
+	snprintf(buf, sizeof(buf),
+	         "{\"Event\":\"pool\",\"When\":%ld,\"POOL\":%d,\"URL\":\"%s\"}\n",
+	         (long)time(NULL), pool->pool_no, escape);
+	if (escape != pool->rpc_url)
+		free(escape);
+
+	api_event_push(API_EVENT_POOL, buf);
+}
+
+void api_event_device(const struct cgpu_info *cgpu, enum dev_reason reason)
+{
+	char buf[TMPBUFSIZ];
+
+	snprintf(buf, sizeof(buf),
+	         "{\"Event\":\"device\",\"When\":%ld,\"Name\":\"%s\",\"ID\":%d,\"ProcID\":%d,"
+	         "\"Status\":\"%s\",\"Reason\":\"%s\"}\n",
+	         (long)time(NULL), cgpu->drv->name, cgpu->device_id, cgpu->proc_id,
+	         status2str(cgpu->status), reason2str(reason));
+
+	api_event_push(API_EVENT_DEVICE, buf);
+}
+
+// Called by hashmeter() with hash_lock held
+void api_event_hashrate(void)
+{
+	char buf[TMPBUFSIZ];
+
+	snprintf(buf, sizeof(buf),
+	         "{\"Event\":\"hashrate\",\"When\":%ld,\"Elapsed\":%.0f,\"MHS av\":%f,\"MHS %ds\":%f,"
+	         "\"Accepted\":%d,\"Rejected\":%d,\"Stale\":%d,\"Hardware Errors\":%d,"
+	         "\"Diff1 Work\":%f,\"Difficulty Accepted\":%f,\"Difficulty Rejected\":%f,\"Difficulty Stale\":%f}\n",
+	         (long)time(NULL), total_secs, total_secs ? total_mhashes_done / total_secs : 0,
+	         opt_log_interval, total_rolling,
+	         total_accepted, total_rejected, total_stale, hw_errors,
+	         total_diff1, total_diff_accepted, total_diff_rejected, total_diff_stale);
+
+	api_event_push(API_EVENT_HASHRATE, buf);
+}
+
+static void subscribe(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, __maybe_unused char group)
+{
+#ifdef USE_LIBEVENT
+	char names[TMPBUFSIZ];
+	unsigned events = 0;
+	char *ptr, *next;
+	int i;
+
+	// No parameter means all events, and "none" stops them
+	if (param == NULL || *param == '\0' || strcasecmp(param, "all") == 0) {
+		for (i = 0; api_event_names[i].name; i++)
+			events |= api_event_names[i].type;
+	}
+	else
+	if (strcasecmp(param, "none")) {
+		for (ptr = param; ptr; ptr = next) {
+			next = strchr(ptr, ',');
+			if (next)
+				*(next++) = '\0';
+
+			for (i = 0; api_event_names[i].name; i++)
+				if (strcasecmp(ptr, api_event_names[i].name) == 0)
+					break;
+			if (!api_event_names[i].name) {
+				message(io_data, MSG_INVSUBSCRIBE, 0, ptr, isjson);
+				return;
+			}
+			events |= api_event_names[i].type;
+		}
+	}
+
+	names[0] = '\0';
+	for (i = 0; api_event_names[i].name; i++) {
+		if (!(events & api_event_names[i].type))
+			continue;
+		if (names[0])
+			strcat(names, COMSTR);
+		strcat(names, api_event_names[i].name);
+	}
+	if (!names[0])
+		strcpy(names, "none");
+
+	api_subscribe_events = events;
+	api_subscribe_set = true;
+
+	message(io_data, MSG_SUBSCRIBE, 0, names, isjson);
+#else
+	message(io_data, MSG_NOSUBSCRIBE, 0, NULL, isjson);
+#endif
+}
+
 static void checkcommand(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, char group);
 
 struct CMDS {
@@ -3370,14 +3661,15 @@ struct CMDS {
 	void (*func)(struct io_data *, SOCKETTYPE, char *, bool, char);
 	bool iswritemode;
 	bool joinable;
+	bool cacheable;
 } cmds[] = {
 	{ "version",		apiversion,	false,	true },
 	{ "config",		minerconfig,	false,	true },
 	{ "devscan",		devscan,	true,	false },
-	{ "devs",		devstatus,	false,	true },
-	{ "procs",		devstatus,	false,	true },
-	{ "pools",		poolstatus,	false,	true },
-	{ "summary",		summary,	false,	true },
+	{ "devs",		devstatus,	false,	true,	true },
+	{ "procs",		devstatus,	false,	true,	true },
+	{ "pools",		poolstatus,	false,	true,	true },
+	{ "summary",		summary,	false,	true,	true },
 #ifdef HAVE_OPENCL
 	{ "gpuenable",		gpuenable,	true,	false },
 	{ "gpudisable",		gpudisable,	true,	false },
@@ -3428,6 +3720,8 @@ struct CMDS {
 	{ "procdetails",		devdetail,	false,	true },
 	{ "restart",		dorestart,	true,	false },
 	{ "stats",		minerstats,	false,	true },
+	{ "latency",		latencystats,	false,	true },
+	{ "subscribe",		subscribe,	false,	false },
 	{ "check",		checkcommand,	false,	false },
 	{ "failover-only",	failoveronly,	true,	false },
 	{ "coin",		minecoin,	false,	true },
@@ -3441,6 +3735,57 @@ struct CMDS {
 	{ NULL,			NULL,		false,	false }
 };
 
+// The busiest reports are kept, per format, and served again until anything
+// they show changes: api_stats_gen is bumped, or the second (and so "When"
+// and the elapsed times) moves on
+volatile unsigned api_stats_gen;
+
+struct api_cache {
+	bytes_t data;
+	bool close;
+	bool valid;
+	unsigned gen;
+	time_t when;
+};
+
+static struct api_cache api_cache[sizeof(cmds) / sizeof(*cmds)][2];
+static pthread_mutex_t api_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool api_cache_serve(struct io_data * const io_data, const int cmd, const bool isjson)
+{
+	struct api_cache * const cache = &api_cache[cmd][isjson];
+	bool hit;
+
+	mutex_lock(&api_cache_lock);
+	hit = (cache->valid && cache->gen == api_stats_gen && cache->when == when);
+	if (hit)
+	{
+		bytes_cat(&io_data->data, &cache->data);
+		io_data->close = cache->close;
+	}
+	mutex_unlock(&api_cache_lock);
+
+	return hit;
+}
+
+// Keeps what the command added to io_data since start, unless it was flushed
+static void api_cache_store(struct io_data * const io_data, const int cmd, const bool isjson, const unsigned gen, const size_t start, const size_t flushed)
+{
+	struct api_cache * const cache = &api_cache[cmd][isjson];
+
+	if (io_data->flushed != flushed)
+		return;
+
+	mutex_lock(&api_cache_lock);
+	bytes_reset(&cache->data);
+	bytes_append(&cache->data, &bytes_buf(&io_data->data)[start], bytes_len(&io_data->data) - start);
+	cache->close = io_data->close;
+	cache->gen = gen;
+	cache->when = when;
+	cache->valid = true;
+	mutex_unlock(&api_cache_lock);
+}
+
 static void checkcommand(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, char group)
 {
 	struct api_data *root = NULL;
@@ -3524,7 +3869,9 @@ static void tail_join(struct io_data *io_data, bool isjson)
 	}
 }
 
-static void send_result(struct io_data *io_data, SOCKETTYPE c, bool isjson)
+static void send_reply(struct io_data *);
+
+static void send_result(struct io_data *io_data, __maybe_unused SOCKETTYPE c, bool isjson)
 {
 	if (io_data->close)
 		io_add(io_data, JSON_CLOSE);
@@ -3540,6 +3887,14 @@ static void send_result(struct io_data *io_data, SOCKETTYPE c, bool isjson)
 	       bytes_buf(&io_data->data),
 	       bytes_len(&io_data->data) > 10 ? "..." : BLANK);
 	
+	send_reply(io_data);
+}
+
+static void send_reply(struct io_data *io_data)
+{
+	if (io_data->sock == INVSOCK)
+		return;
+	
 	io_flush(io_data, true);
 	
 	if (bytes_len(&io_data->data))
@@ -4033,32 +4388,787 @@ void mcast_init()
 		quit(1, "API mcast thread create failed");
 }
 
+static bool api_blank(const char ch)
+{
+	switch (ch) {
+		case ' ':
+		case '\t':
+		case '\r':
+		case '\n':
+		case '\0':
+			return true;
+	}
+	return false;
+}
+
+// Find the end of the first request in buf
+// JSON requests end with their closing brace, text requests with a '\n' or '\0'
+// Returns the length of the request, or 0 if it is not complete yet,
+//  and sets *skip to the number of bytes it used including any terminator
+static size_t api_frame(const char *buf, size_t len, size_t *skip)
+{
+	bool instr = false;
+	int depth = 0;
+	size_t i;
+
+	if (*buf != ISJSON) {
+		for (i = 0; i < len; i++) {
+			if (buf[i] == '\n' || buf[i] == '\0') {
+				*skip = i + 1;
+				if (i && buf[i - 1] == '\r')
+					i--;
+				return i;
+			}
+		}
+		return 0;
+	}
+
+	for (i = 0; i < len; i++) {
+		if (instr) {
+			if (buf[i] == '\\')
+				i++;
+			else
+			if (buf[i] == '"')
+				instr = false;
+			continue;
+		}
+
+		switch (buf[i]) {
+			case '"':
+				instr = true;
+				break;
+			case '{':
+			case '[':
+				depth++;
+				break;
+			case '}':
+			case ']':
+				if (--depth == 0) {
+					*skip = i + 1;
+					return i + 1;
+				}
+				break;
+		}
+	}
+	return 0;
+}
+
+/* CBOR (RFC 7049) encoding of JSON replies, for collectors that poll often
+ * Each JSON array of objects becomes a table, a map of "Keys" (every key
+ * used, in order of appearance) and "Rows" (an array of values per object,
+ * in the order of Keys, with undefined for keys the object doesn't have),
+ * so names aren't repeated for every device or pool */
+
+static void cbor_head(bytes_t * const out, const uint8_t major, const uint64_t val)
+{
+	uint8_t buf[9];
+	int i, n;
+
+	if (val < 24) {
+		buf[0] = (major << 5) | val;
+		bytes_append(out, buf, 1);
+		return;
+	}
+	if (val <= 0xff)
+		n = 1;
+	else if (val <= 0xffff)
+		n = 2;
+	else if (val <= 0xffffffff)
+		n = 4;
+	else
+		n = 8;
+	// Additional info 24-27 means 1, 2, 4 or 8 bytes follow
+	buf[0] = (major << 5) | (24 + (n == 8 ? 3 : n / 2));
+	for (i = 0; i < n; i++)
+		buf[1 + i] = val >> (8 * (n - 1 - i));
+	bytes_append(out, buf, 1 + n);
+}
+
+static void cbor_text(bytes_t * const out, const char * const str)
+{
+	const size_t len = strlen(str);
+
+	cbor_head(out, 3, len);
+	bytes_append(out, str, len);
+}
+
+static void cbor_double(bytes_t * const out, const double d)
+{
+	const float f = d;
+	uint8_t buf[9];
+	uint64_t u64;
+	uint32_t u32;
+	int i;
+
+	// Single precision is enough for most values, and half the size
+	if (f == d) {
+		memcpy(&u32, &f, sizeof(u32));
+		buf[0] = 0xfa;
+		for (i = 0; i < 4; i++)
+			buf[1 + i] = u32 >> (8 * (3 - i));
+		bytes_append(out, buf, 5);
+		return;
+	}
+	memcpy(&u64, &d, sizeof(u64));
+	buf[0] = 0xfb;
+	for (i = 0; i < 8; i++)
+		buf[1 + i] = u64 >> (8 * (7 - i));
+	bytes_append(out, buf, 9);
+}
+
+static void cbor_json(bytes_t *, json_t *);
+
+static bool cbor_json_table(bytes_t * const out, json_t * const array)
+{
+	const size_t rows = json_array_size(array);
+	const char **keys = NULL;
+	size_t nkeys = 0, i, j;
+	json_t *row, *val;
+	void *iter;
+
+	if (!rows)
+		return false;
+	for (i = 0; i < rows; i++)
+		if (!json_is_object(json_array_get(array, i)))
+			return false;
+
+	for (i = 0; i < rows; i++) {
+		row = json_array_get(array, i);
+		for (iter = json_object_iter(row); iter; iter = json_object_iter_next(row, iter)) {
+			const char * const key = json_object_iter_key(iter);
+			for (j = 0; j < nkeys; j++)
+				if (!strcmp(keys[j], key))
+					break;
+			if (j < nkeys)
+				continue;
+			keys = realloc(keys, sizeof(*keys) * (nkeys + 1));
+			if (unlikely(!keys))
+				quithere(1, "Failed to realloc keys");
+			keys[nkeys++] = key;
+		}
+	}
+
+	cbor_head(out, 5, 2);
+	cbor_text(out, "Keys");
+	cbor_head(out, 4, nkeys);
+	for (j = 0; j < nkeys; j++)
+		cbor_text(out, keys[j]);
+	cbor_text(out, "Rows");
+	cbor_head(out, 4, rows);
+	for (i = 0; i < rows; i++) {
+		row = json_array_get(array, i);
+		cbor_head(out, 4, nkeys);
+		for (j = 0; j < nkeys; j++) {
+			val = json_object_get(row, keys[j]);
+			if (val)
+				cbor_json(out, val);
+			else
+				bytes_append(out, "\xf7", 1);
+		}
+	}
+
+	free(keys);
+	return true;
+}
+
+static void cbor_json(bytes_t * const out, json_t * const json)
+{
+	json_int_t n;
+	void *iter;
+	size_t i;
+
+	switch (json_typeof(json)) {
+		case JSON_OBJECT:
+			cbor_head(out, 5, json_object_size(json));
+			for (iter = json_object_iter(json); iter; iter = json_object_iter_next(json, iter)) {
+				cbor_text(out, json_object_iter_key(iter));
+				cbor_json(out, json_object_iter_value(iter));
+			}
+			break;
+		case JSON_ARRAY:
+			if (cbor_json_table(out, json))
+				break;
+			cbor_head(out, 4, json_array_size(json));
+			for (i = 0; i < json_array_size(json); i++)
+				cbor_json(out, json_array_get(json, i));
+			break;
+		case JSON_STRING:
+			cbor_text(out, json_string_value(json));
+			break;
+		case JSON_INTEGER:
+			n = json_integer_value(json);
+			if (n >= 0)
+				cbor_head(out, 0, n);
+			else
+				cbor_head(out, 1, -1 - n);
+			break;
+		case JSON_REAL:
+			cbor_double(out, json_real_value(json));
+			break;
+		case JSON_TRUE:
+			bytes_append(out, "\xf5", 1);
+			break;
+		case JSON_FALSE:
+			bytes_append(out, "\xf4", 1);
+			break;
+		case JSON_NULL:
+		default:
+			bytes_append(out, "\xf6", 1);
+			break;
+	}
+}
+
+// Replaces the complete JSON reply in io_data with its CBOR encoding
+static void api_cbor_reply(struct io_data * const io_data)
+{
+	bytes_t out = BYTES_INIT;
+	json_error_t json_err;
+	json_t *reply;
+	void *iter;
+
+	reply = JSON_LOADS((char *)bytes_buf(&io_data->data), &json_err);
+	if (!json_is_object(reply)) {
+		applog(LOG_WARNING, "API: failed to encode reply as CBOR");
+		if (reply)
+			json_decref(reply);
+		io_reinit(io_data);
+		message(io_data, MSG_ENCODEFAIL, 0, "CBOR", true);
+		send_result(io_data, INVSOCK, true);
+		reply = JSON_LOADS((char *)bytes_buf(&io_data->data), &json_err);
+	}
+
+	cbor_head(&out, 5, json_object_size(reply) + 1);
+	cbor_text(&out, "Schema");
+	cbor_head(&out, 0, API_CBOR_SCHEMA);
+	for (iter = json_object_iter(reply); iter; iter = json_object_iter_next(reply, iter)) {
+		cbor_text(&out, json_object_iter_key(iter));
+		cbor_json(&out, json_object_iter_value(iter));
+	}
+	json_decref(reply);
+
+	bytes_free(&io_data->data);
+	io_data->data = out;
+}
+
+// Process one request in buf (which must be writable and null terminated)
+//  leaving the reply in io_data
+// *keepalive is updated if a JSON request includes "keepalive"
+static void api_request(struct io_data *io_data, char *buf, size_t len, char group, const char *connectaddr, bool *keepalive)
+{
+	const SOCKETTYPE c = io_data->sock;
+	char param_buf[TMPBUFSIZ];
+	char cmdbuf[100];
+	char *cmd = NULL, *cmdptr, *cmdsbuf = NULL;
+	char *param;
+	json_error_t json_err;
+	json_t *json_config = NULL;
+	json_t *json_val;
+	bool isjson, iscbor = false;
+	bool did, isjoin, firstjoin;
+	int i;
+
+	firstjoin = isjoin = false;
+
+	// the time of the request in now
+	when = time(NULL);
+	io_reinit(io_data);
+
+	did = false;
+
+	if (*buf != ISJSON) {
+		isjson = false;
+
+		param = strchr(buf, SEPARATOR);
+		if (param != NULL)
+			*(param++) = '\0';
+
+		cmd = buf;
+	}
+	else {
+		isjson = true;
+
+		param = NULL;
+
+#if JANSSON_MAJOR_VERSION > 2 || (JANSSON_MAJOR_VERSION == 2 && JANSSON_MINOR_VERSION > 0)
+		json_config = json_loadb(buf, len, 0, &json_err);
+#elif JANSSON_MAJOR_VERSION > 1
+		json_config = json_loads(buf, 0, &json_err);
+#else
+		json_config = json_loads(buf, &json_err);
+#endif
+
+		if (!json_is_object(json_config)) {
+			message(io_data, MSG_INVJSON, 0, NULL, isjson);
+			send_result(io_data, c, isjson);
+			did = true;
+		}
+		else {
+			json_val = json_object_get(json_config, JSON_KEEPALIVE);
+			if (json_is_true(json_val))
+				*keepalive = true;
+			else
+			if (json_is_false(json_val))
+				*keepalive = false;
+
+			json_val = json_object_get(json_config, JSON_COMMAND);
+			if (json_val == NULL) {
+				message(io_data, MSG_MISCMD, 0, NULL, isjson);
+				send_result(io_data, c, isjson);
+				did = true;
+			}
+			else {
+				if (!json_is_string(json_val)) {
+					message(io_data, MSG_INVCMD, 0, NULL, isjson);
+					send_result(io_data, c, isjson);
+					did = true;
+				}
+				else {
+					cmd = (char *)json_string_value(json_val);
+					json_val = json_object_get(json_config, JSON_PARAMETER);
+					if (json_is_string(json_val))
+						param = (char *)json_string_value(json_val);
+					else if (json_is_integer(json_val)) {
+						sprintf(param_buf, "%d", (int)json_integer_value(json_val));
+						param = param_buf;
+					} else if (json_is_real(json_val)) {
+						sprintf(param_buf, "%f", (double)json_real_value(json_val));
+						param = param_buf;
+					}
+				}
+			}
+
+			if (!did && (json_val = json_object_get(json_config, JSON_ENCODING))) {
+				const char * const encoding = json_string_value(json_val);
+
+				if (encoding && !strcasecmp(encoding, "cbor")) {
+					// Nothing can be sent until the whole reply is encoded
+					iscbor = true;
+					io_data->sock = INVSOCK;
+				}
+				else
+				if (!(encoding && !strcasecmp(encoding, "json"))) {
+					message(io_data, MSG_INVENCODING, 0, NULL, isjson);
+					send_result(io_data, c, isjson);
+					did = true;
+				}
+			}
+		}
+	}
+
+	if (!did) {
+		if (strchr(cmd, CMDJOIN)) {
+			firstjoin = isjoin = true;
+			// cmd + leading '|' + '\0'
+			cmdsbuf = malloc(strlen(cmd) + 2);
+			if (!cmdsbuf)
+				quithere(1, "OOM cmdsbuf");
+			strcpy(cmdsbuf, "|");
+			param = NULL;
+		}
+
+		cmdptr = cmd;
+		do {
+			did = false;
+			if (isjoin) {
+				cmd = strchr(cmdptr, CMDJOIN);
+				if (cmd)
+					*(cmd++) = '\0';
+				if (!*cmdptr)
+					goto inochi;
+			}
+
+			for (i = 0; cmds[i].name != NULL; i++) {
+				if (strcmp(cmdptr, cmds[i].name) == 0) {
+					sprintf(cmdbuf, "|%s|", cmdptr);
+					if (isjoin) {
+						if (strstr(cmdsbuf, cmdbuf)) {
+							did = true;
+							break;
+						}
+						strcat(cmdsbuf, cmdptr);
+						strcat(cmdsbuf, "|");
+						head_join(io_data, cmdptr, isjson, &firstjoin);
+						if (!cmds[i].joinable) {
+							message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
+							did = true;
+							tail_join(io_data, isjson);
+							break;
+						}
+					}
+					if (ISPRIVGROUP(group) || strstr(COMMANDS(group), cmdbuf))
+					{
+						per_proc = !strncmp(cmds[i].name, "proc", 4);
+						if (!(cmds[i].cacheable && api_cache_serve(io_data, i, isjson)))
+						{
+							const unsigned gen = api_stats_gen;
+							const size_t start = bytes_len(&io_data->data);
+							const size_t flushed = io_data->flushed;
+
+							// Reports need the mining threads' pending stats
+							if (cmds[i].joinable)
+								fold_thr_stats();
+							(cmds[i].func)(io_data, c, param, isjson, group);
+							if (cmds[i].cacheable)
+								api_cache_store(io_data, i, isjson, gen, start, flushed);
+						}
+						if (cmds[i].iswritemode)
+							api_stats_changed();
+					}
+					else {
+						message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
+						applog(LOG_DEBUG, "API: access denied to '%s' for '%s' command", connectaddr, cmds[i].name);
+					}
+
+					did = true;
+					if (!isjoin)
+						send_result(io_data, c, isjson);
+					else
+						tail_join(io_data, isjson);
+					break;
+				}
+			}
+
+			if (!did) {
+				if (isjoin)
+					head_join(io_data, cmdptr, isjson, &firstjoin);
+				message(io_data, MSG_INVCMD, 0, NULL, isjson);
+				if (isjoin)
+					tail_join(io_data, isjson);
+				else
+					send_result(io_data, c, isjson);
+			}
+inochi:
+			if (isjoin)
+				cmdptr = cmd;
+		} while (isjoin && cmdptr);
+	}
+
+	if (isjson)
+		json_decref(json_config);
+
+	if (isjoin) {
+		send_result(io_data, c, isjson);
+		free(cmdsbuf);
+	}
+
+	if (iscbor) {
+		api_cbor_reply(io_data);
+		io_data->sock = c;
+		send_reply(io_data);
+	}
+}
+
+#ifdef USE_LIBEVENT
+// Drop a connection that has been idle (or unable to send) this long
+#define API_IDLE_TIMEOUT 120
+#define API_SEND_TIMEOUT 10
+
+// Drop a subscriber with this many bytes of events it hasn't taken
+#define API_EVENT_BACKLOG 0x100000
+
+struct api_conn {
+	struct bufferevent *bev;
+	char connectaddr[sizeof("255.255.255.255")];
+	char group;
+	bool keepalive;
+	bool eof;
+	bool closing;
+
+	// Subscribed events, and the list of subscribers
+	unsigned events;
+	struct api_conn *prev;
+	struct api_conn *next;
+};
+
+static const struct timeval api_tv_idle = {API_IDLE_TIMEOUT, 0};
+static const struct timeval api_tv_send = {API_SEND_TIMEOUT, 0};
+
+static struct event_base *api_evbase;
+static struct api_conn *api_subscribers;
+
+static void api_update_event_mask()
+{
+	struct api_conn *conn;
+	unsigned mask = 0;
+
+	DL_FOREACH(api_subscribers, conn)
+		mask |= conn->events;
+	api_event_mask = mask;
+}
+
+static void api_conn_subscribe(struct api_conn *conn, unsigned events)
+{
+	if (events && !conn->events) {
+		DL_APPEND(api_subscribers, conn);
+		// Subscribers only listen, so they are never idle
+		bufferevent_set_timeouts(conn->bev, NULL, &api_tv_send);
+	}
+	else
+	if (!events && conn->events) {
+		DL_DELETE(api_subscribers, conn);
+		bufferevent_set_timeouts(conn->bev, &api_tv_idle, &api_tv_send);
+	}
+	conn->events = events;
+	if (events)
+		conn->keepalive = true;
+	api_update_event_mask();
+}
+
+static void api_conn_free(struct api_conn *conn)
+{
+	if (conn->events) {
+		DL_DELETE(api_subscribers, conn);
+		api_update_event_mask();
+	}
+	bufferevent_free(conn->bev);
+	free(conn);
+
+	if (bye)
+		event_base_loopbreak(api_evbase);
+}
+
+static void api_conn_read(struct bufferevent *bev, void *p)
+{
+	struct api_conn * const conn = p;
+	struct evbuffer * const input = bufferevent_get_input(bev);
+	struct evbuffer * const output = bufferevent_get_output(bev);
+	struct io_data * const io_data = rpc_io_data;
+	size_t len, off, reqlen, skip;
+	char *buf;
+
+	while (!conn->closing && evbuffer_get_length(output) < RPC_SOCKBUFSIZ) {
+		len = evbuffer_get_length(input);
+		if (!len)
+			break;
+		buf = (char *)evbuffer_pullup(input, -1);
+
+		// Skip anything between requests, such as the newline after JSON
+		for (off = 0; off < len && api_blank(buf[off]); off++)
+			;
+		if (off == len) {
+			evbuffer_drain(input, len);
+			break;
+		}
+
+		reqlen = api_frame(&buf[off], len - off, &skip);
+		if (!reqlen) {
+			if (len - off > RPC_SOCKBUFSIZ) {
+				applog(LOG_WARNING, "API: request from %s too large (%lu bytes) - closing",
+				       conn->connectaddr, (unsigned long)(len - off));
+				api_conn_free(conn);
+				return;
+			}
+			// Until a connection asks to be kept alive, an unterminated
+			//  text request is whatever has arrived, as it always was
+			if (conn->eof || (buf[off] != ISJSON && !conn->keepalive))
+				reqlen = skip = len - off;
+			else
+				break;
+		}
+		if (reqlen > RPC_SOCKBUFSIZ) {
+			applog(LOG_WARNING, "API: request from %s too large (%lu bytes) - closing",
+			       conn->connectaddr, (unsigned long)reqlen);
+			api_conn_free(conn);
+			return;
+		}
+
+		memcpy(api_reqbuf, &buf[off], reqlen);
+		api_reqbuf[reqlen] = '\0';
+		evbuffer_drain(input, off + skip);
+
+		applog(LOG_DEBUG, "API: recv command from %s: (%lu) '%s'",
+		       conn->connectaddr, (unsigned long)reqlen, api_reqbuf);
+
+		api_request(io_data, api_reqbuf, reqlen, conn->group, conn->connectaddr, &conn->keepalive);
+		evbuffer_add(output, bytes_buf(&io_data->data), bytes_len(&io_data->data));
+		bytes_reset(&io_data->data);
+
+		if (api_subscribe_set) {
+			api_subscribe_set = false;
+			api_conn_subscribe(conn, api_subscribe_events);
+		}
+
+		if (bye || !conn->keepalive)
+			conn->closing = true;
+	}
+
+	if (conn->eof)
+		conn->closing = true;
+
+	if (conn->closing) {
+		bufferevent_disable(bev, EV_READ);
+		if (!evbuffer_get_length(output))
+			api_conn_free(conn);
+	}
+	else
+	if (evbuffer_get_length(output) >= RPC_SOCKBUFSIZ)
+		// Stop reading until the client has taken its replies
+		bufferevent_disable(bev, EV_READ);
+}
+
+static void api_conn_write(struct bufferevent *bev, void *p)
+{
+	struct api_conn * const conn = p;
+
+	if (conn->closing) {
+		api_conn_free(conn);
+		return;
+	}
+
+	// Handle any requests held back while the replies were sent
+	bufferevent_enable(bev, EV_READ);
+	api_conn_read(bev, p);
+}
+
+static void api_conn_event(struct bufferevent *bev, short events, void *p)
+{
+	struct api_conn * const conn = p;
+
+	if ((events & BEV_EVENT_EOF) && (events & BEV_EVENT_READING) && !conn->closing) {
+		// The client may close its side after sending, but still wants the reply
+		conn->eof = true;
+		api_conn_read(bev, p);
+		return;
+	}
+
+	if (events & BEV_EVENT_TIMEOUT)
+		applog(LOG_DEBUG, "API: connection from %s timed out", conn->connectaddr);
+	else
+	if (events & BEV_EVENT_ERROR)
+		applog(LOG_DEBUG, "API: connection from %s failed: %s", conn->connectaddr, SOCKERRMSG);
+	api_conn_free(conn);
+}
+
+// Send queued events to their subscribers
+static void api_event_dispatch(__maybe_unused evutil_socket_t fd, __maybe_unused short what, __maybe_unused void *p)
+{
+	struct api_conn *conn, *tmp;
+	struct api_event_hdr hdr;
+	bytes_t events = BYTES_INIT;
+	size_t off;
+
+	notifier_read(api_event_notifier);
+
+	mutex_lock(&api_event_lock);
+	bytes_cpy(&events, &api_event_queue);
+	bytes_reset(&api_event_queue);
+	mutex_unlock(&api_event_lock);
+
+	for (off = 0; off + sizeof(hdr) <= bytes_len(&events); off += sizeof(hdr) + hdr.len) {
+		memcpy(&hdr, &bytes_buf(&events)[off], sizeof(hdr));
+		DL_FOREACH(api_subscribers, conn)
+			if (conn->events & hdr.type)
+				bufferevent_write(conn->bev, &bytes_buf(&events)[off + sizeof(hdr)], hdr.len);
+	}
+	bytes_free(&events);
+
+	DL_FOREACH_SAFE(api_subscribers, conn, tmp) {
+		if (evbuffer_get_length(bufferevent_get_output(conn->bev)) > API_EVENT_BACKLOG) {
+			applog(LOG_WARNING, "API: subscriber %s is not keeping up with events - closing",
+			       conn->connectaddr);
+			api_conn_free(conn);
+		}
+	}
+}
+
+static void api_accept(__maybe_unused struct evconnlistener *listener, evutil_socket_t sock, struct sockaddr *addr, __maybe_unused int addrlen, __maybe_unused void *p)
+{
+	struct api_conn *conn;
+	char *connectaddr;
+	char group;
+	bool addrok;
+
+	addrok = check_connect((struct sockaddr_in *)addr, &connectaddr, &group);
+	applog(LOG_DEBUG, "API: connection from %s - %s",
+				connectaddr, addrok ? "Accepted" : "Ignored");
+
+	if (!addrok) {
+		CLOSESOCKET(sock);
+		return;
+	}
+
+	conn = malloc(sizeof(*conn));
+	if (unlikely(!conn))
+		quit(1, "Failed to malloc API connection");
+	*conn = (struct api_conn){
+		.bev = bufferevent_socket_new(api_evbase, sock, BEV_OPT_CLOSE_ON_FREE),
+		.group = group,
+	};
+	snprintf(conn->connectaddr, sizeof(conn->connectaddr), "%s", connectaddr);
+	bufferevent_setcb(conn->bev, api_conn_read, api_conn_write, api_conn_event, conn);
+	bufferevent_set_timeouts(conn->bev, &api_tv_idle, &api_tv_send);
+	bufferevent_enable(conn->bev, EV_READ | EV_WRITE);
+}
+
+static void api_accept_error(__maybe_unused struct evconnlistener *listener, __maybe_unused void *p)
+{
+	applog(LOG_ERR, "API accept failed (%s)", SOCKERRMSG);
+}
+#else
+// Read and answer a single request on a blocking socket
+static void api_serve(struct io_data *io_data, SOCKETTYPE c, char group, const char *connectaddr)
+{
+	struct timeval tv;
+	fd_set rd;
+	size_t len = 0, reqlen, skip;
+	bool keepalive = false;
+	int n;
+
+	while (len < RPC_SOCKBUFSIZ) {
+		n = recv(c, &api_reqbuf[len], RPC_SOCKBUFSIZ - len, 0);
+		if (SOCKETFAIL(n)) {
+			applog(LOG_DEBUG, "API: recv failed: %s", SOCKERRMSG);
+			if (!len)
+				return;
+			break;
+		}
+		if (!n)
+			break;
+		len += n;
+
+		// JSON requests may arrive in pieces, so wait (briefly) for the rest
+		if (*api_reqbuf != ISJSON || api_frame(api_reqbuf, len, &skip))
+			break;
+		FD_ZERO(&rd);
+		FD_SET(c, &rd);
+		tv = (struct timeval){1, 0};
+		if (select(c + 1, &rd, NULL, NULL, &tv) < 1)
+			break;
+	}
+
+	reqlen = api_frame(api_reqbuf, len, &skip);
+	if (!reqlen)
+		reqlen = len;
+	api_reqbuf[reqlen] = '\0';
+
+	applog(LOG_DEBUG, "API: recv command: (%lu) '%s'", (unsigned long)reqlen, api_reqbuf);
+
+	io_data->sock = c;
+	api_request(io_data, api_reqbuf, reqlen, group, connectaddr, &keepalive);
+	io_data->sock = INVSOCK;
+}
+#endif
+
 void api(int api_thr_id)
 {
 	struct io_data *io_data;
 	struct thr_info bye_thr;
-	char buf[TMPBUFSIZ];
-	char param_buf[TMPBUFSIZ];
-	SOCKETTYPE c;
-	int n, bound;
-	char *connectaddr;
+	int bound;
 	const char *binderror;
 	struct timeval bindstart;
 	short int port = opt_api_port;
 	struct sockaddr_in serv;
+#ifdef USE_LIBEVENT
+	struct evconnlistener *listener;
+	struct event *ev_events;
+#else
+	SOCKETTYPE c;
+	char *connectaddr;
 	struct sockaddr_in cli;
 	socklen_t clisiz;
-	char cmdbuf[100];
-	char *cmd = NULL, *cmdptr, *cmdsbuf;
-	char *param;
 	bool addrok;
 	char group;
-	json_error_t json_err;
-	json_t *json_config;
-	json_t *json_val;
-	bool isjson;
-	bool did, isjoin, firstjoin;
-	int i;
+#endif
 
 	SOCKETTYPE *apisock;
 
@@ -4162,6 +5272,31 @@ void api(int api_thr_id)
 	if (opt_api_mcast)
 		mcast_init();
 
+#ifdef USE_LIBEVENT
+	api_evbase = event_base_new();
+	if (unlikely(!api_evbase)) {
+		applog(LOG_ERR, "API4 initialisation failed%s", UNAVAILABLE);
+		goto die;
+	}
+	// The listener does not own apisock, tidyup() closes it
+	evutil_make_socket_nonblocking(*apisock);
+	listener = evconnlistener_new(api_evbase, api_accept, NULL, LEV_OPT_CLOSE_ON_EXEC, -1, *apisock);
+	if (unlikely(!listener)) {
+		applog(LOG_ERR, "API5 initialisation failed%s", UNAVAILABLE);
+		goto die;
+	}
+	evconnlistener_set_error_cb(listener, api_accept_error);
+
+	mutex_init(&api_event_lock);
+	notifier_init(api_event_notifier);
+	ev_events = event_new(api_evbase, api_event_notifier[0], EV_READ | EV_PERSIST, api_event_dispatch, NULL);
+	event_add(ev_events, NULL);
+
+	// Returns once a quit or restart reply has been sent
+	event_base_dispatch(api_evbase);
+
+	evconnlistener_free(listener);
+#else
 	while (!bye) {
 		clisiz = sizeof(cli);
 		if (SOCKETFAIL(c = accept(*apisock, (struct sockaddr *)(&cli), &clisiz))) {
@@ -4173,169 +5308,11 @@ void api(int api_thr_id)
 		applog(LOG_DEBUG, "API: connection from %s - %s",
 					connectaddr, addrok ? "Accepted" : "Ignored");
 
-		if (addrok) {
-			n = recv(c, &buf[0], TMPBUFSIZ-1, 0);
-			if (SOCKETFAIL(n))
-				buf[0] = '\0';
-			else
-				buf[n] = '\0';
-
-			if (opt_debug) {
-				if (SOCKETFAIL(n))
-					applog(LOG_DEBUG, "API: recv failed: %s", SOCKERRMSG);
-				else
-					applog(LOG_DEBUG, "API: recv command: (%d) '%s'", n, buf);
-			}
-
-			firstjoin = isjoin = false;
-			if (!SOCKETFAIL(n)) {
-				// the time of the request in now
-				when = time(NULL);
-				io_reinit(io_data);
-				io_data->sock = c;
-
-				did = false;
-
-				if (*buf != ISJSON) {
-					isjson = false;
-
-					param = strchr(buf, SEPARATOR);
-					if (param != NULL)
-						*(param++) = '\0';
-
-					cmd = buf;
-				}
-				else {
-					isjson = true;
-
-					param = NULL;
-
-#if JANSSON_MAJOR_VERSION > 2 || (JANSSON_MAJOR_VERSION == 2 && JANSSON_MINOR_VERSION > 0)
-					json_config = json_loadb(buf, n, 0, &json_err);
-#elif JANSSON_MAJOR_VERSION > 1
-					json_config = json_loads(buf, 0, &json_err);
-#else
-					json_config = json_loads(buf, &json_err);
-#endif
-
-					if (!json_is_object(json_config)) {
-						message(io_data, MSG_INVJSON, 0, NULL, isjson);
-						send_result(io_data, c, isjson);
-						did = true;
-					}
-					else {
-						json_val = json_object_get(json_config, JSON_COMMAND);
-						if (json_val == NULL) {
-							message(io_data, MSG_MISCMD, 0, NULL, isjson);
-							send_result(io_data, c, isjson);
-							did = true;
-						}
-						else {
-							if (!json_is_string(json_val)) {
-								message(io_data, MSG_INVCMD, 0, NULL, isjson);
-								send_result(io_data, c, isjson);
-								did = true;
-							}
-							else {
-								cmd = (char *)json_string_value(json_val);
-								json_val = json_object_get(json_config, JSON_PARAMETER);
-								if (json_is_string(json_val))
-									param = (char *)json_string_value(json_val);
-								else if (json_is_integer(json_val)) {
-									sprintf(param_buf, "%d", (int)json_integer_value(json_val));
-									param = param_buf;
-								} else if (json_is_real(json_val)) {
-									sprintf(param_buf, "%f", (double)json_real_value(json_val));
-									param = param_buf;
-								}
-							}
-						}
-					}
-				}
-
-				if (!did) {
-					if (strchr(cmd, CMDJOIN)) {
-						firstjoin = isjoin = true;
-						// cmd + leading '|' + '\0'
-						cmdsbuf = malloc(strlen(cmd) + 2);
-						if (!cmdsbuf)
-							quithere(1, "OOM cmdsbuf");
-						strcpy(cmdsbuf, "|");
-						param = NULL;
-					}
-
-					cmdptr = cmd;
-					do {
-						did = false;
-						if (isjoin) {
-							cmd = strchr(cmdptr, CMDJOIN);
-							if (cmd)
-								*(cmd++) = '\0';
-							if (!*cmdptr)
-								goto inochi;
-						}
-
-						for (i = 0; cmds[i].name != NULL; i++) {
-							if (strcmp(cmdptr, cmds[i].name) == 0) {
-								sprintf(cmdbuf, "|%s|", cmdptr);
-								if (isjoin) {
-									if (strstr(cmdsbuf, cmdbuf)) {
-										did = true;
-										break;
-									}
-									strcat(cmdsbuf, cmdptr);
-									strcat(cmdsbuf, "|");
-									head_join(io_data, cmdptr, isjson, &firstjoin);
-									if (!cmds[i].joinable) {
-										message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
-										did = true;
-										tail_join(io_data, isjson);
-										break;
-									}
-								}
-								if (ISPRIVGROUP(group) || strstr(COMMANDS(group), cmdbuf))
-								{
-									per_proc = !strncmp(cmds[i].name, "proc", 4);
-									(cmds[i].func)(io_data, c, param, isjson, group);
-								}
-								else {
-									message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
-									applog(LOG_DEBUG, "API: access denied to '%s' for '%s' command", connectaddr, cmds[i].name);
-								}
-
-								did = true;
-								if (!isjoin)
-									send_result(io_data, c, isjson);
-								else
-									tail_join(io_data, isjson);
-								break;
-							}
-						}
-
-						if (!did) {
-							if (isjoin)
-								head_join(io_data, cmdptr, isjson, &firstjoin);
-							message(io_data, MSG_INVCMD, 0, NULL, isjson);
-							if (isjoin)
-								tail_join(io_data, isjson);
-							else
-								send_result(io_data, c, isjson);
-						}
-inochi:
-						if (isjoin)
-							cmdptr = cmd;
-					} while (isjoin && cmdptr);
-				}
-
-				if (isjson)
-					json_decref(json_config);
-
-				if (isjoin)
-					send_result(io_data, c, isjson);
-			}
-		}
+		if (addrok)
+			api_serve(io_data, c, group, connectaddr);
 		CLOSESOCKET(c);
 	}
+#endif
 die:
 	/* Blank line fix for older compilers since pthread_cleanup_pop is a
 	 * macro that gets confused by a label existing immediately before it
@@ -742,6 +742,7 @@ out: ;
 	if (drv->thread_shutdown)
 		drv->thread_shutdown(mythr);
 
+	free_local_stratum_work(mythr);
 	notifier_destroy(mythr->notifier);
 
 	return NULL;
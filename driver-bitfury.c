@@ -265,27 +265,6 @@ bool bitfury_job_prepare(struct thr_info *thr, struct work *work, __maybe_unused
 	return true;
 }
 
-static
-bool fudge_nonce(struct work * const work, uint32_t *nonce_p) {
-	static const uint32_t offsets[] = {0, 0xffc00000, 0xff800000, 0x02800000, 0x02C00000, 0x00400000};
-	uint32_t nonce;
-	int i;
-	
-	if (unlikely(!work))
-		return false;
-	
-	for (i = 0; i < 6; ++i)
-	{
-		nonce = *nonce_p + offsets[i];
-		if (test_nonce(work, nonce, false))
-		{
-			*nonce_p = nonce;
-			return true;
-		}
-	}
-	return false;
-}
-
 void bitfury_noop_job_start(struct thr_info __maybe_unused * const thr)
 {
 }
@@ -381,6 +360,15 @@ void bitfury_do_io(struct thr_info * const master_thr)
 	struct cgpu_info *procs[n_chips];
 	void *rxbuf[n_chips];
 	bitfury_inp_t rxbuf_copy[n_chips];
+	// Results from every chip, checked together once they have all been read
+	struct bitfury_nonce_check checks[n_chips * 0x10];
+	struct {
+		struct cgpu_info *proc;
+		int i;
+		uint32_t nonce;
+		struct work *work;
+	} results[n_chips * 0x10];
+	int n_results = 0;
 	
 	// NOTE: This code assumes:
 	// 1) that chips on the same SPI bus are grouped together
@@ -583,39 +571,10 @@ void bitfury_do_io(struct thr_info * const master_thr)
 		{
 			for (i = 0; i < n; ++i)
 			{
-				nonce = bitfury_decnonce(newbuf[i]);
-				if (fudge_nonce(thr->work, &nonce))
-				{
-					applog(LOG_DEBUG, "%"PRIpreprv": nonce %x = %08lx (work=%p)",
-					       proc->proc_repr, i, (unsigned long)nonce, thr->work);
-					submit_nonce(thr, thr->work, nonce);
-					bitfury->counter2 += 1;
-				}
-				else
-				if (fudge_nonce(thr->prev_work, &nonce))
-				{
-					applog(LOG_DEBUG, "%"PRIpreprv": nonce %x = %08lx (prev work=%p)",
-					       proc->proc_repr, i, (unsigned long)nonce, thr->prev_work);
-					submit_nonce(thr, thr->prev_work, nonce);
-					bitfury->counter2 += 1;
-				}
-				else
-				{
-					inc_hw_errors(thr, thr->work, nonce);
-					++bitfury->sample_hwe;
-					bitfury->strange_counter += 1;
-				}
-				if (++bitfury->sample_tot >= 0x40 || bitfury->sample_hwe >= 8)
-				{
-					if (bitfury->sample_hwe >= 8)
-					{
-						applog(LOG_WARNING, "%"PRIpreprv": %d of the last %d results were bad, reinitialising",
-						       proc->proc_repr, bitfury->sample_hwe, bitfury->sample_tot);
-						bitfury_send_reinit(bitfury->spi, bitfury->slot, bitfury->fasync, bitfury->osc6_bits);
-						bitfury->desync_counter = 99;
-					}
-					bitfury->sample_tot = bitfury->sample_hwe = 0;
-				}
+				results[n_results].proc = proc;
+				results[n_results].i = i;
+				results[n_results].nonce = bitfury_decnonce(newbuf[i]);
+				++n_results;
 			}
 			bitfury->active = (bitfury->active + n) % 0x10;
 		}
@@ -639,6 +598,70 @@ out:
 			copy_time(tvp_stat, &tv_now);
 	}
 	
+	// Check results against the work their chip is on, then any left over against its previous work
+	for (j = 0; j < n_results; ++j)
+		bitfury_nonce_check_init(&checks[j], results[j].proc->thr[0]->work, results[j].nonce);
+	bitfury_fudge_nonces(checks, n_results);
+	for (j = 0; j < n_results; ++j)
+	{
+		thr = results[j].proc->thr[0];
+		if (checks[j].found)
+		{
+			results[j].work = thr->work;
+			results[j].nonce = checks[j].nonce;
+			bitfury_nonce_check_init(&checks[j], NULL, 0);
+		}
+		else
+		{
+			results[j].work = NULL;
+			bitfury_nonce_check_init(&checks[j], thr->prev_work, results[j].nonce);
+		}
+	}
+	bitfury_fudge_nonces(checks, n_results);
+	
+	for (j = 0; j < n_results; ++j)
+	{
+		proc = results[j].proc;
+		thr = proc->thr[0];
+		bitfury = proc->device_data;
+		i = results[j].i;
+		
+		if (results[j].work)
+		{
+			nonce = results[j].nonce;
+			applog(LOG_DEBUG, "%"PRIpreprv": nonce %x = %08lx (work=%p)",
+			       proc->proc_repr, i, (unsigned long)nonce, thr->work);
+			submit_nonce(thr, thr->work, nonce);
+			bitfury->counter2 += 1;
+		}
+		else
+		if (checks[j].found)
+		{
+			nonce = checks[j].nonce;
+			applog(LOG_DEBUG, "%"PRIpreprv": nonce %x = %08lx (prev work=%p)",
+			       proc->proc_repr, i, (unsigned long)nonce, thr->prev_work);
+			submit_nonce(thr, thr->prev_work, nonce);
+			bitfury->counter2 += 1;
+		}
+		else
+		{
+			inc_hw_errors(thr, thr->work, results[j].nonce);
+			++bitfury->sample_hwe;
+			bitfury->strange_counter += 1;
+		}
+		if (++bitfury->sample_tot >= 0x40 || bitfury->sample_hwe >= 8)
+		{
+			if (bitfury->sample_hwe >= 8)
+			{
+				applog(LOG_WARNING, "%"PRIpreprv": %d of the last %d results were bad, reinitialising",
+				       proc->proc_repr, bitfury->sample_hwe, bitfury->sample_tot);
+				bitfury_send_reinit(bitfury->spi, bitfury->slot, bitfury->fasync, bitfury->osc6_bits);
+				bitfury->desync_counter = 99;
+			}
+			bitfury->sample_tot = bitfury->sample_hwe = 0;
+		}
+	}
+	
 	timer_set_delay(&master_thr->tv_poll, &tv_now, 10000);
 }
 
@@ -19,6 +19,7 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <signal.h>
+#include <math.h>
 
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -34,6 +35,8 @@
 #include "miner.h"
 #include "bench_block.h"
 #include "logging.h"
+#include "scrypt.h"
+#include "sha2.h"
 #include "util.h"
 #include "driver-cpu.h"
 
@@ -45,6 +48,7 @@
 BFG_REGISTER_DRIVER(cpu_drv)
 
 #if defined(__linux) && defined(CPU_ZERO)  /* Linux specific policy and affinity management */
+#include <dirent.h>
 #include <sched.h>
 static inline void drop_policy(void)
 {
@@ -64,7 +68,7 @@ static inline void affine_to_cpu(int id, int cpu)
 
 	CPU_ZERO(&set);
 	CPU_SET(cpu, &set);
-	sched_setaffinity(0, sizeof(&set), &set);
+	sched_setaffinity(0, sizeof(set), &set);
 	applog(LOG_INFO, "Binding cpu mining thread %d to cpu %d", id, cpu);
 }
 #else
@@ -90,6 +94,31 @@ extern bool ScanHash_4WaySSE2(struct thr_info*, const unsigned char *pmidstate,
 	const unsigned char *ptarget,
 	uint32_t max_nonce, uint32_t *last_nonce, uint32_t nonce);
 
+extern bool ScanHash_8WayAVX2(struct thr_info*, const unsigned char *pmidstate,
+	unsigned char *pdata, unsigned char *phash1, unsigned char *phash,
+	const unsigned char *ptarget,
+	uint32_t max_nonce, uint32_t *last_nonce, uint32_t nonce);
+
+extern bool ScanHash_16WayAVX512(struct thr_info*, const unsigned char *pmidstate,
+	unsigned char *pdata, unsigned char *phash1, unsigned char *phash,
+	const unsigned char *ptarget,
+	uint32_t max_nonce, uint32_t *last_nonce, uint32_t nonce);
+
+extern bool scanhash_shani(struct thr_info*, const unsigned char *pmidstate,
+	unsigned char *pdata, unsigned char *phash1, unsigned char *phash,
+	const unsigned char *ptarget,
+	uint32_t max_nonce, uint32_t *last_nonce, uint32_t nonce);
+
+extern bool ScanHash_4WayNEON(struct thr_info*, const unsigned char *pmidstate,
+	unsigned char *pdata, unsigned char *phash1, unsigned char *phash,
+	const unsigned char *ptarget,
+	uint32_t max_nonce, uint32_t *last_nonce, uint32_t nonce);
+
+extern bool scanhash_armce(struct thr_info*, const unsigned char *pmidstate,
+	unsigned char *pdata, unsigned char *phash1, unsigned char *phash,
+	const unsigned char *ptarget,
+	uint32_t max_nonce, uint32_t *last_nonce, uint32_t nonce);
+
 extern bool ScanHash_altivec_4way(struct thr_info*, const unsigned char *pmidstate,
 	unsigned char *pdata,
 	unsigned char *phash1, unsigned char *phash,
@@ -135,9 +164,11 @@ extern bool scanhash_sse2_32(struct thr_info*, const unsigned char *pmidstate, u
 	uint32_t max_nonce, uint32_t *last_nonce,
 	uint32_t nonce);
 
-extern bool scanhash_scrypt(struct thr_info *thr, int thr_id, unsigned char *pdata, unsigned char *scratchbuf,
+extern bool scanhash_scrypt(struct thr_info *, const unsigned char *pmidstate, unsigned char *pdata,
+	unsigned char *phash1, unsigned char *phash,
 	const unsigned char *ptarget,
-	uint32_t max_nonce, unsigned long *hashes_done);
+	uint32_t max_nonce, uint32_t *last_nonce,
+	uint32_t nonce, unsigned int N);
 
 
 
@@ -170,6 +201,21 @@ const char *algo_names[] = {
 #endif
 #ifdef WANT_SCRYPT
     [ALGO_SCRYPT] = "scrypt",
+#endif
+#ifdef WANT_AVX2_8WAY
+	[ALGO_AVX2_8WAY]	= "avx2_8way",
+#endif
+#ifdef WANT_AVX512_16WAY
+	[ALGO_AVX512_16WAY]	= "avx512_16way",
+#endif
+#ifdef WANT_SHANI
+	[ALGO_SHANI]		= "shani",
+#endif
+#ifdef WANT_NEON_4WAY
+	[ALGO_NEON_4WAY]	= "neon_4way",
+#endif
+#ifdef WANT_ARMCE
+	[ALGO_ARMCE]		= "armce",
 #endif
 	[ALGO_FASTAUTO] = "fastauto",
 	[ALGO_AUTO] = "auto",
@@ -199,8 +245,20 @@ static const sha256_func sha256_funcs[] = {
 #ifdef WANT_X8664_SSE4
 	[ALGO_SSE4_64]		= (sha256_func)scanhash_sse4_64,
 #endif
-#ifdef WANT_SCRYPT
-	[ALGO_SCRYPT]		= (sha256_func)scanhash_scrypt
+#ifdef WANT_AVX2_8WAY
+	[ALGO_AVX2_8WAY]	= (sha256_func)ScanHash_8WayAVX2,
+#endif
+#ifdef WANT_AVX512_16WAY
+	[ALGO_AVX512_16WAY]	= (sha256_func)ScanHash_16WayAVX512,
+#endif
+#ifdef WANT_SHANI
+	[ALGO_SHANI]		= (sha256_func)scanhash_shani,
+#endif
+#ifdef WANT_NEON_4WAY
+	[ALGO_NEON_4WAY]	= (sha256_func)ScanHash_4WayNEON,
+#endif
+#ifdef WANT_ARMCE
+	[ALGO_ARMCE]		= (sha256_func)scanhash_armce,
 #endif
 };
 #endif
@@ -210,6 +268,13 @@ static const sha256_func sha256_funcs[] = {
 #ifdef WANT_CPUMINE
 enum sha256_algos opt_algo = ALGO_FASTAUTO;
 static bool forced_n_threads;
+enum cpu_bench_format opt_bench_engines = CPU_BENCH_NONE;
+char *opt_bench_engine_threads;
+int opt_bench_engine_trials = 5;
+int opt_bench_engine_warmup = 1;
+bool opt_bench_engine_pin;
+enum cpu_affinity opt_cpu_affinity = CPU_AFFINITY_CORES;
+int opt_cpu_reserve;
 #endif
 
 static const uint32_t hash1_init[] = {
@@ -223,21 +288,60 @@ static const uint32_t hash1_init[] = {
 
 
 #ifdef WANT_CPUMINE
+// Scans nonces n..max_nonce of work with the given algorithm
+static bool cpu_scan(const enum sha256_algos algo, struct thr_info * const thr, struct work * const work, unsigned char * const hash1, const uint32_t max_nonce, uint32_t * const last_nonce, const uint32_t n)
+{
+#ifdef WANT_SCRYPT
+	// scrypt also needs to know which N this work uses
+	if (algo == ALGO_SCRYPT)
+		return scanhash_scrypt(
+			thr,
+			work->midstate,
+			work->data,
+			hash1,
+			work->hash,
+			work->target,
+			max_nonce,
+			last_nonce,
+			n,
+			scrypt_work_n(work)
+		);
+#endif
+	sha256_func func = sha256_funcs[algo];
+	return (*func)(
+		thr,
+		work->midstate,
+		work->data,
+		hash1,
+		work->hash,
+		work->target,
+		max_nonce,
+		last_nonce,
+		n
+	);
+}
+
+// Fills in work from a random work block pulled from a pool
+static void cpu_bench_work(struct work * const work)
+{
+	static const uint8_t bench_block[] = { CGMINER_BENCHMARK_BLOCK };
+
+	size_t bench_size = sizeof(*work);
+	size_t work_size = sizeof(bench_block);
+	size_t min_size = (work_size < bench_size ? work_size : bench_size);
+	memset(work, 0, sizeof(*work));
+	memcpy(work, &bench_block, min_size);
+}
+
 // Algo benchmark, crash-prone, system independent stage
 double bench_algo_stage3(
 	enum sha256_algos algo
 )
 {
-	// Use a random work block pulled from a pool
-	static uint8_t bench_block[] = { CGMINER_BENCHMARK_BLOCK };
 	struct work work __attribute__((aligned(128)));
 	unsigned char hash1[64];
 
-	size_t bench_size = sizeof(work);
-	size_t work_size = sizeof(bench_block);
-	size_t min_size = (work_size < bench_size ? work_size : bench_size);
-	memset(&work, 0, sizeof(work));
-	memcpy(&work, &bench_block, min_size);
+	cpu_bench_work(&work);
 
 	static struct thr_info dummy;
 
@@ -249,20 +353,7 @@ double bench_algo_stage3(
 	memcpy(&hash1[0], &hash1_init[0], sizeof(hash1));
 
 	timer_set_now(&start);
-			{
-				sha256_func func = sha256_funcs[algo];
-				(*func)(
-					&dummy,
-					work.midstate,
-					work.data,
-					hash1,
-					work.hash,
-					work.target,
-					max_nonce,
-					&last_nonce,
-					work.blk.nonce
-				);
-			}
+	cpu_scan(algo, &dummy, &work, hash1, max_nonce, &last_nonce, work.blk.nonce);
 	timer_set_now(&end);
 
 	uint64_t usec_end = ((uint64_t)end.tv_sec)*1000*1000 + end.tv_usec;
@@ -661,6 +752,29 @@ static enum sha256_algos pick_fastest_algo()
                 bench_algo(&best_rate, &best_algo, ALGO_ALTIVEC_4WAY);
         #endif
 
+	#if defined(WANT_AVX2_8WAY)
+		bench_algo(&best_rate, &best_algo, ALGO_AVX2_8WAY);
+	#endif
+
+	#if defined(WANT_AVX512_16WAY)
+		bench_algo(&best_rate, &best_algo, ALGO_AVX512_16WAY);
+	#endif
+
+	#if defined(WANT_SHANI)
+		if (sha256_shani_available())
+			bench_algo(&best_rate, &best_algo, ALGO_SHANI);
+	#endif
+
+	#if defined(WANT_NEON_4WAY)
+		if (neon_available())
+			bench_algo(&best_rate, &best_algo, ALGO_NEON_4WAY);
+	#endif
+
+	#if defined(WANT_ARMCE)
+		if (sha256_armce_available())
+			bench_algo(&best_rate, &best_algo, ALGO_ARMCE);
+	#endif
+
 	size_t n = max_name_len - strlen(algo_names[best_algo]);
 	memset(name_spaces_pad, ' ', n);
 	name_spaces_pad[n] = 0;
@@ -674,16 +788,61 @@ static enum sha256_algos pick_fastest_algo()
 	return best_algo;
 }
 
+// Returns why the CPU can't run a compiled-in algorithm, or NULL if it can
+static const char *cpu_algo_unsupported(const enum sha256_algos algo)
+{
+	switch (algo)
+	{
+#ifdef WANT_AVX2_8WAY
+		case ALGO_AVX2_8WAY:
+			if (!__builtin_cpu_supports("avx2"))
+				return "CPU does not support AVX2";
+			break;
+#endif
+#ifdef WANT_AVX512_16WAY
+		case ALGO_AVX512_16WAY:
+			if (!__builtin_cpu_supports("avx512f"))
+				return "CPU does not support AVX-512";
+			break;
+#endif
+#ifdef WANT_SHANI
+		case ALGO_SHANI:
+			if (!sha256_shani_available())
+				return "CPU does not support SHA extensions";
+			break;
+#endif
+#ifdef WANT_NEON_4WAY
+		case ALGO_NEON_4WAY:
+			if (!neon_available())
+				return "CPU does not support NEON";
+			break;
+#endif
+#ifdef WANT_ARMCE
+		case ALGO_ARMCE:
+			if (!sha256_armce_available())
+				return "CPU does not support ARMv8 cryptography extensions";
+			break;
+#endif
+		default:
+			break;
+	}
+	return NULL;
+}
+
 /* FIXME: Use asprintf for better errors. */
 char *set_algo(const char *arg, enum sha256_algos *algo)
 {
 	enum sha256_algos i;
+	const char *unsupported;
 
 	if (opt_scrypt)
 		return "Can only use scrypt algorithm";
 
 	for (i = 0; i < ARRAY_SIZE(algo_names); i++) {
 		if (algo_names[i] && !strcmp(arg, algo_names[i])) {
+			unsupported = cpu_algo_unsupported(i);
+			if (unsupported)
+				return (char *)unsupported;
 			*algo = i;
 			return NULL;
 		}
@@ -702,6 +861,97 @@ void show_algo(char buf[OPT_SHOW_LEN], const enum sha256_algos *algo)
 {
 	strncpy(buf, algo_names[*algo], OPT_SHOW_LEN);
 }
+
+static bool cpu_algo_compiled(const enum sha256_algos algo)
+{
+#ifdef WANT_SCRYPT
+	if (algo == ALGO_SCRYPT)
+		return true;
+#endif
+	return algo < ARRAY_SIZE(sha256_funcs) && sha256_funcs[algo];
+}
+
+static
+void _test_cpu_algo(const enum sha256_algos algo, const char * const hexheader)
+{
+	// Scans relative to the winning nonce, and whether they should find it
+	static const struct {
+		const char *desc;
+		int32_t start, end;
+		bool top, restart, found;
+	} scans[] = {
+		{"around the nonce", -0x100, 0x100, false, false, true},
+		{"ending at the nonce", -0x100, 0, false, false, true},
+		{"after the nonce", 1, 0x200, false, false, false},
+		{"with work_restart set", -0x1000, 0x1000, false, true, false},
+		// Odd lengths leave the last batch of wide engines part past max_nonce
+		{"unaligned, ending at the nonce", -0xff, 0, false, false, true},
+		{"ending just before the nonce", -0x103, -1, false, false, false},
+		// Must stop at max_nonce rather than wrapping around to 0
+		{"at the top of the range", -0x100, -1, true, false, false},
+		{"unaligned at the top of the range", -0xff, -1, true, false, false},
+	};
+	struct thr_info thr;
+	struct work work __attribute__((aligned(128)));
+	unsigned char hash1[64];
+	uint32_t win, start, end, last_nonce;
+	bool rc;
+	int i;
+
+	for (i = 0; i < (int)ARRAY_SIZE(scans); ++i)
+	{
+		test_header_work(&work, hexheader);
+		win = le32toh(*(uint32_t *)&work.data[76]);
+		memset(&thr, 0, sizeof(thr));
+		thr.work_restart = scans[i].restart;
+		memcpy(&hash1[0], &hash1_init[0], sizeof(hash1));
+		start = (scans[i].top ? 0 : win) + scans[i].start;
+		end = (scans[i].top ? 0 : win) + scans[i].end;
+		last_nonce = start;
+
+		rc = cpu_scan(algo, &thr, &work, hash1, end, &last_nonce, start);
+		if (rc != scans[i].found)
+			applog(LOG_ERR, "%s: \"%s\" %s nonce %08lx scanning %s",
+			       __func__, algo_names[algo], rc ? "found" : "did not find", (unsigned long)win, scans[i].desc);
+		else
+		if (rc && last_nonce != win)
+			applog(LOG_ERR, "%s: \"%s\" found nonce %08lx instead of %08lx scanning %s",
+			       __func__, algo_names[algo], (unsigned long)last_nonce, (unsigned long)win, scans[i].desc);
+		else
+		if (!rc && (last_nonce < start || last_nonce > end))
+			applog(LOG_ERR, "%s: \"%s\" stopped at nonce %08lx outside %08lx-%08lx scanning %s",
+			       __func__, algo_names[algo], (unsigned long)last_nonce, (unsigned long)start, (unsigned long)end, scans[i].desc);
+		else
+		// Scanning resumes after last_nonce, so stopping short would hash nonces twice
+		if (!(rc || scans[i].restart) && last_nonce != end)
+			applog(LOG_ERR, "%s: \"%s\" stopped at nonce %08lx instead of %08lx scanning %s",
+			       __func__, algo_names[algo], (unsigned long)last_nonce, (unsigned long)end, scans[i].desc);
+	}
+}
+
+/* Known answers for every algorithm the CPU supports: each must find the
+ * winning nonces of the test headers, and stop where it should */
+void test_cpu_algos()
+{
+	enum sha256_algos algo;
+	int i;
+
+	for (algo = 0; algo < ALGO_FASTAUTO; ++algo)
+	{
+		if (!(cpu_algo_compiled(algo) && !cpu_algo_unsupported(algo)))
+			continue;
+#ifdef WANT_SCRYPT
+		if (algo == ALGO_SCRYPT)
+		{
+			for (i = 0; test_scrypt_block_headers[i]; ++i)
+				_test_cpu_algo(algo, test_scrypt_block_headers[i]);
+			continue;
+		}
+#endif
+		for (i = 0; test_block_headers[i]; ++i)
+			_test_cpu_algo(algo, test_block_headers[i]);
+	}
+}
 #endif
 
 #ifdef WANT_CPUMINE
@@ -713,13 +963,9 @@ char *force_nthreads_int(const char *arg, int *i)
 #endif
 
 #ifdef WANT_CPUMINE
-static int cpu_autodetect()
+// Reckon number of cores in the box
+static void cpu_count_processors(void)
 {
-	RUNONCE(0);
-	
-	int i;
-
-	// Reckon number of cores in the box
 	#if defined(WIN32)
 	{
 		DWORD_PTR system_am;
@@ -749,10 +995,510 @@ static int cpu_autodetect()
 	#else
 		num_processors = 1;
 	#endif /* !WIN32 */
+}
+
+char *set_cpu_affinity(const char *arg, enum cpu_affinity *affinity)
+{
+	if (!strcasecmp(arg, "cores"))
+		*affinity = CPU_AFFINITY_CORES;
+	else
+	if (!strcasecmp(arg, "threads"))
+		*affinity = CPU_AFFINITY_THREADS;
+	else
+	if (!strcasecmp(arg, "none"))
+		*affinity = CPU_AFFINITY_NONE;
+	else
+		return "CPU affinity must be cores, threads or none";
+	return NULL;
+}
+
+// CPUs for mining threads to be bound to, in the order they are filled
+static int *cpu_placement;
+static int cpu_placement_count;
+
+#if defined(__linux) && defined(CPU_ZERO)
+struct cpu_topology {
+	int cpu;
+	int package;
+	int core;
+	int node;
+	int sibling;  // 0 for the first thread of a physical core, 1 for the next...
+	int primary;  // index of the core's first thread
+	bool reserved;
+};
+
+static int cpu_topology_read_int(const int cpu, const char * const name)
+{
+	char buf[0x100];
+	FILE *F;
+	int i;
+
+	snprintf(buf, sizeof(buf), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+	F = fopen(buf, "r");
+	if (!F)
+		return -1;
+	if (fscanf(F, "%d", &i) != 1)
+		i = -1;
+	fclose(F);
+	return i;
+}
+
+// Returns the NUMA node a CPU belongs to, from its nodeN link in sysfs
+static int cpu_topology_node(const int cpu)
+{
+	char buf[0x100];
+	struct dirent *de;
+	DIR *D;
+	int node = 0;
+
+	snprintf(buf, sizeof(buf), "/sys/devices/system/cpu/cpu%d", cpu);
+	D = opendir(buf);
+	if (!D)
+		return 0;
+	while ( (de = readdir(D)) )
+		if (!strncmp(de->d_name, "node", 4) && sscanf(&de->d_name[4], "%d", &node) == 1)
+			break;
+	closedir(D);
+	return node;
+}
+
+/* Returns the CPUs this process may run on, in the order mining threads
+ * should use them: the first thread of each physical core, spread round-robin
+ * over the NUMA nodes, then (with smt) each core's other threads the same
+ * way. The first reserve cores, starting with CPU 0's, are left out for the
+ * threads doing network I/O. */
+static int *cpu_placement_order(int * const count, const bool smt, int reserve)
+{
+	struct cpu_topology *topo;
+	cpu_set_t set;
+	int *order, n = 0, n_cores = 0, max_sibling = 0, max_node = 0;
+	int i, j, node, sibling, next;
+
+	*count = 0;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set))
+		return NULL;
+	topo = malloc(sizeof(*topo) * CPU_COUNT(&set));
+	order = malloc(sizeof(*order) * CPU_COUNT(&set));
+	if (unlikely(!(topo && order)))
+		quithere(1, "Failed to malloc");
+
+	for (i = 0; i < CPU_SETSIZE; ++i)
+	{
+		if (!CPU_ISSET(i, &set))
+			continue;
+		struct cpu_topology * const t = &topo[n];
+		t->cpu = i;
+		t->package = cpu_topology_read_int(i, "physical_package_id");
+		t->core = cpu_topology_read_int(i, "core_id");
+		t->node = cpu_topology_node(i);
+		t->sibling = 0;
+		t->primary = n;
+		t->reserved = false;
+		// Without topology information, every CPU is taken to be a core of its own
+		if (t->core >= 0)
+			for (j = 0; j < n; ++j)
+				if (topo[j].primary == j && topo[j].package == t->package && topo[j].core == t->core)
+				{
+					t->primary = j;
+					break;
+				}
+		if (t->primary != n)
+		{
+			for (j = 0; j < n; ++j)
+				if (topo[j].primary == t->primary)
+					++t->sibling;
+			if (t->sibling > max_sibling)
+				max_sibling = t->sibling;
+		}
+		else
+			++n_cores;
+		if (t->node > max_node)
+			max_node = t->node;
+		++n;
+	}
+
+	// At least one core is always left for mining
+	if (reserve && reserve >= n_cores)
+	{
+		applog(LOG_WARNING, "Cannot reserve %d of %d CPU cores, reserving %d", reserve, n_cores, n_cores - 1);
+		reserve = n_cores - 1;
+	}
+	for (i = 0; i < n; ++i)
+	{
+		if (topo[i].primary == i && reserve > 0)
+		{
+			topo[i].reserved = true;
+			--reserve;
+		}
+		topo[i].reserved = topo[topo[i].primary].reserved;
+	}
+
+	if (!smt)
+		max_sibling = 0;
+	for (sibling = 0; sibling <= max_sibling; ++sibling)
+	{
+		// Take the next CPU from each node in turn, until none are left
+		int pos[max_node + 1];
+		memset(pos, 0, sizeof(pos));
+		do {
+			next = 0;
+			for (node = 0; node <= max_node; ++node)
+			{
+				for (j = pos[node]; j < n; ++j)
+					if (topo[j].node == node && topo[j].sibling == sibling && !topo[j].reserved)
+						break;
+				pos[node] = j + 1;
+				if (j < n)
+				{
+					order[(*count)++] = topo[j].cpu;
+					++next;
+				}
+			}
+		} while (next);
+	}
+
+	applog(LOG_DEBUG, "CPU topology: %d threads in %d cores, %d NUMA nodes", n, n_cores, max_node + 1);
+	free(topo);
+	if (!*count)
+	{
+		free(order);
+		return NULL;
+	}
+	return order;
+}
+#else
+static int *cpu_placement_order(int * const count, __maybe_unused const bool smt, __maybe_unused int reserve)
+{
+	*count = 0;
+	return NULL;
+}
+#endif
+
+// Nonces each thread hashes per --bench-engines run
+#define CPU_BENCH_NONCES  (1 << 22)
+#define CPU_BENCH_SCRYPT_NONCES  (1 << 10)
+#define CPU_BENCH_MAX_THREAD_COUNTS  0x20
+
+#if defined(__i386__) || defined(__x86_64__)
+#define HAVE_CPU_BENCH_TSC
+#endif
+
+struct cpu_bench_run {
+	enum sha256_algos algo;
+	uint32_t nonces;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int ready;
+	bool go;
+};
+
+struct cpu_bench_thread {
+	pthread_t pth;
+	struct cpu_bench_run *run;
+	int index;
+	uint64_t hashes;
+};
+
+struct cpu_bench_result {
+	double rate;
+	double stddev;
+	double per_cycle;
+};
+
+// Parses a comma separated list of thread counts, returning how many there are or -1
+static int cpu_bench_parse_threads(const char *arg, int * const counts, const int max_counts)
+{
+	int n = 0;
+	long l;
+	char *end;
+
+	while (true)
+	{
+		l = strtol(arg, &end, 10);
+		if (end == arg || l < 1 || l > 9999 || n >= max_counts)
+			return -1;
+		counts[n++] = l;
+		if (!*end)
+			return n;
+		if (*end != ',')
+			return -1;
+		arg = &end[1];
+	}
+}
+
+char *set_bench_engines(const char *arg, enum cpu_bench_format *format)
+{
+	if (!strcasecmp(arg, "csv"))
+		*format = CPU_BENCH_CSV;
+	else
+	if (!strcasecmp(arg, "json"))
+		*format = CPU_BENCH_JSON;
+	else
+		return "Benchmark output format must be csv or json";
+	return NULL;
+}
+
+char *set_bench_engine_threads(const char *arg, char **threads)
+{
+	int counts[CPU_BENCH_MAX_THREAD_COUNTS];
+
+	if (cpu_bench_parse_threads(arg, counts, CPU_BENCH_MAX_THREAD_COUNTS) < 0)
+		return "Invalid list of benchmark thread counts";
+	free(*threads);
+	*threads = strdup(arg);
+	return NULL;
+}
+
+char *set_bench_engine_trials(const char *arg, int *i)
+{
+	return set_int_range(arg, i, 1, 9999);
+}
+
+char *set_bench_engine_warmup(const char *arg, int *i)
+{
+	return set_int_range(arg, i, 0, 9999);
+}
+
+static void *cpu_bench_thread(void * const userdata)
+{
+	struct cpu_bench_thread * const bt = userdata;
+	struct cpu_bench_run * const run = bt->run;
+	struct thr_info thr;
+	struct work work __attribute__((aligned(128)));
+	unsigned char hash1[64];
+	uint32_t n, end, last_nonce;
+
+	memset(&thr, 0, sizeof(thr));
+	cpu_bench_work(&work);
+	memcpy(&hash1[0], &hash1_init[0], sizeof(hash1));
+	if (opt_bench_engine_pin && cpu_placement_count)
+		affine_to_cpu(bt->index, cpu_placement[bt->index % cpu_placement_count]);
+
+	/* Every thread hashes its own fixed range, so each run does the same
+	 * work; nonces is a power of 2, so no range wraps past 0xffffffff */
+	n = bt->index * run->nonces;
+	end = n + run->nonces - 1;
+	bt->hashes = 0;
+
+	mutex_lock(&run->lock);
+	++run->ready;
+	pthread_cond_broadcast(&run->cond);
+	while (!run->go)
+		pthread_cond_wait(&run->cond, &run->lock);
+	mutex_unlock(&run->lock);
+
+	while (true)
+	{
+		last_nonce = n;
+		const bool rc = cpu_scan(run->algo, &thr, &work, hash1, end, &last_nonce, n);
+		if (last_nonce >= n)
+			bt->hashes += last_nonce - n + 1;
+		// Keep going past any shares found, until the whole range is done
+		if (!rc || last_nonce < n || last_nonce >= end)
+			break;
+		n = last_nonce + 1;
+	}
+
+	return NULL;
+}
+
+// Times one run of threads hashing concurrently; per_cycle is negative if the cycles can't be counted
+static void cpu_bench_run(struct cpu_bench_run * const run, const int threads, double * const rate, double * const per_cycle)
+{
+	struct cpu_bench_thread bt[threads];
+	struct timeval tv_start, tv_end;
+	uint64_t hashes = 0;
+	int i;
+#ifdef HAVE_CPU_BENCH_TSC
+	uint64_t tsc_start, tsc_end;
+#endif
+
+	run->ready = 0;
+	run->go = false;
+	for (i = 0; i < threads; ++i)
+	{
+		bt[i].run = run;
+		bt[i].index = i;
+		if (unlikely(pthread_create(&bt[i].pth, NULL, cpu_bench_thread, &bt[i])))
+			quit(1, "Failed to create benchmark thread");
+	}
+
+	// Start the clock once every thread has its work set up
+	mutex_lock(&run->lock);
+	while (run->ready < threads)
+		pthread_cond_wait(&run->cond, &run->lock);
+	run->go = true;
+	timer_set_now(&tv_start);
+#ifdef HAVE_CPU_BENCH_TSC
+	tsc_start = __builtin_ia32_rdtsc();
+#endif
+	pthread_cond_broadcast(&run->cond);
+	mutex_unlock(&run->lock);
+
+	for (i = 0; i < threads; ++i)
+	{
+		pthread_join(bt[i].pth, NULL);
+		hashes += bt[i].hashes;
+	}
+#ifdef HAVE_CPU_BENCH_TSC
+	tsc_end = __builtin_ia32_rdtsc();
+#endif
+	timer_set_now(&tv_end);
+
+	const double secs = tdiff(&tv_end, &tv_start);
+	*rate = (secs > 0) ? (hashes / secs) : 0;
+#ifdef HAVE_CPU_BENCH_TSC
+	// The TSC ticks at the nominal clock rate; each thread had that many cycles
+	*per_cycle = (tsc_end > tsc_start) ? (hashes / ((double)(tsc_end - tsc_start) * threads)) : 0;
+#else
+	*per_cycle = -1;
+#endif
+}
+
+// Warms up, then returns the mean and standard deviation over the timed trials
+static void cpu_bench_trials(const enum sha256_algos algo, const int threads, struct cpu_bench_result * const res)
+{
+	struct cpu_bench_run run = {
+		.algo = algo,
+		.nonces = (algo == ALGO_SCRYPT) ? CPU_BENCH_SCRYPT_NONCES : CPU_BENCH_NONCES,
+	};
+	const int trials = opt_bench_engine_trials;
+	double rates[trials], per_cycle, sum = 0, sum_per_cycle = 0, var = 0;
+	int i;
+
+	mutex_init(&run.lock);
+	if (unlikely(pthread_cond_init(&run.cond, NULL)))
+		quit(1, "Failed to pthread_cond_init in %s", __func__);
+
+	for (i = 0; i < opt_bench_engine_warmup; ++i)
+		cpu_bench_run(&run, threads, &rates[0], &per_cycle);
+	for (i = 0; i < trials; ++i)
+	{
+		cpu_bench_run(&run, threads, &rates[i], &per_cycle);
+		sum += rates[i];
+		sum_per_cycle += per_cycle;
+	}
+
+	res->rate = sum / trials;
+	for (i = 0; i < trials; ++i)
+		var += (rates[i] - res->rate) * (rates[i] - res->rate);
+	res->stddev = (trials > 1) ? sqrt(var / (trials - 1)) : 0;
+	res->per_cycle = (per_cycle < 0) ? -1 : (sum_per_cycle / trials);
+
+	pthread_cond_destroy(&run.cond);
+	mutex_destroy(&run.lock);
+}
+
+/* Runs every compiled-in algorithm the CPU supports at each thread count,
+ * and prints the results to stdout */
+void cpu_bench_engines(void)
+{
+	int counts[CPU_BENCH_MAX_THREAD_COUNTS], n_counts, n_cores, i;
+	struct cpu_bench_result res;
+	enum sha256_algos algo;
+	const char *unsupported;
+	json_t *results = NULL, *obj;
+	char *s;
+
+	cpu_count_processors();
+	if (num_processors < 1)
+		num_processors = 1;
+
+	// Threads are pinned one per physical core first, then onto SMT siblings
+	free(cpu_placement_order(&n_cores, false, 0));
+	cpu_placement = cpu_placement_order(&cpu_placement_count, true, 0);
+
+	if (opt_bench_engine_threads)
+		n_counts = cpu_bench_parse_threads(opt_bench_engine_threads, counts, CPU_BENCH_MAX_THREAD_COUNTS);
+	else
+	{
+		n_counts = 0;
+		counts[n_counts++] = 1;
+		if (n_cores > 1 && n_cores < num_processors)
+			counts[n_counts++] = n_cores;
+		if (num_processors > 1)
+			counts[n_counts++] = num_processors;
+	}
+
+	if (opt_bench_engines == CPU_BENCH_JSON)
+		results = json_array();
+	else
+		printf("engine,threads,pinned,nonces,trials,hashes_per_sec,stddev,hashes_per_cycle\n");
+
+	for (algo = 0; algo < ALGO_FASTAUTO; ++algo)
+	{
+		if (!cpu_algo_compiled(algo))
+			continue;
+		unsupported = cpu_algo_unsupported(algo);
+		if (unsupported)
+		{
+			applog(LOG_WARNING, "Skipping benchmark of \"%s\": %s", algo_names[algo], unsupported);
+			continue;
+		}
+
+		const uint32_t nonces = (algo == ALGO_SCRYPT) ? CPU_BENCH_SCRYPT_NONCES : CPU_BENCH_NONCES;
+		for (i = 0; i < n_counts; ++i)
+		{
+			applog(LOG_NOTICE, "Benchmarking \"%s\" with %d thread%s", algo_names[algo], counts[i], (counts[i] == 1) ? "" : "s");
+			cpu_bench_trials(algo, counts[i], &res);
+
+			if (results)
+			{
+				obj = json_object();
+				json_object_set_new(obj, "engine", json_string(algo_names[algo]));
+				json_object_set_new(obj, "threads", json_integer(counts[i]));
+				json_object_set_new(obj, "pinned", opt_bench_engine_pin ? json_true() : json_false());
+				json_object_set_new(obj, "nonces", json_integer(nonces));
+				json_object_set_new(obj, "trials", json_integer(opt_bench_engine_trials));
+				json_object_set_new(obj, "hashes_per_sec", json_real(res.rate));
+				json_object_set_new(obj, "stddev", json_real(res.stddev));
+				json_object_set_new(obj, "hashes_per_cycle", (res.per_cycle < 0) ? json_null() : json_real(res.per_cycle));
+				json_array_append_new(results, obj);
+			}
+			else
+			{
+				printf("%s,%d,%d,%lu,%d,%.1f,%.1f,", algo_names[algo], counts[i], opt_bench_engine_pin ? 1 : 0, (unsigned long)nonces, opt_bench_engine_trials, res.rate, res.stddev);
+				if (res.per_cycle >= 0)
+					printf("%.6f", res.per_cycle);
+				printf("\n");
+				fflush(stdout);
+			}
+		}
+	}
+
+	if (results)
+	{
+		s = json_dumps(results, JSON_INDENT(3));
+		puts(s);
+		free(s);
+		json_decref(results);
+	}
+}
+
+static int cpu_autodetect()
+{
+	RUNONCE(0);
+	
+	int i;
+
+	cpu_count_processors();
+
+	if (opt_cpu_affinity != CPU_AFFINITY_NONE)
+		cpu_placement = cpu_placement_order(&cpu_placement_count, opt_cpu_affinity == CPU_AFFINITY_THREADS, opt_cpu_reserve);
 
 	if (opt_n_threads < 0 || !forced_n_threads) {
+		if (cpu_placement_count)
+			opt_n_threads = cpu_placement_count;
+		else
 			opt_n_threads = num_processors;
 	}
+	// More threads than cores were asked for, so they go on the SMT siblings too
+	if (opt_cpu_affinity == CPU_AFFINITY_CORES && cpu_placement_count && opt_n_threads > cpu_placement_count)
+	{
+		free(cpu_placement);
+		cpu_placement = cpu_placement_order(&cpu_placement_count, true, opt_cpu_reserve);
+	}
 	if (num_processors < 1)
 		return 0;
 
@@ -822,10 +1568,12 @@ static bool cpu_thread_init(struct thr_info *thr)
 	 * error if it fails */
 	setpriority(PRIO_PROCESS, 0, 19);
 	drop_policy();
-	/* Cpu affinity only makes sense if the number of threads is a multiple
-	 * of the number of CPUs */
-	if (!(opt_n_threads % num_processors))
-		affine_to_cpu(dev_from_id(thr_id), dev_from_id(thr_id) % num_processors);
+	/* Binding is done before the thread touches its scrypt scratchpad, so
+	 * the kernel allocates it on the thread's own NUMA node. If there are
+	 * more threads than CPUs to place them on, it only makes sense when
+	 * they share them evenly. */
+	if (cpu_placement_count && (opt_n_threads <= cpu_placement_count || !(opt_n_threads % cpu_placement_count)))
+		affine_to_cpu(dev_from_id(thr_id), cpu_placement[dev_from_id(thr_id) % cpu_placement_count]);
 	return true;
 }
 
@@ -842,20 +1590,7 @@ CPUSearch:
 	rc = false;
 
 	/* scan nonces for a proof-of-work hash */
-	{
-		sha256_func func = sha256_funcs[opt_algo];
-		rc = (*func)(
-			thr,
-			work->midstate,
-			work->data,
-			hash1,
-			work->hash,
-			work->target,
-			max_nonce,
-			&last_nonce,
-			work->blk.nonce
-		);
-	}
+	rc = cpu_scan(opt_algo, thr, work, hash1, max_nonce, &last_nonce, work->blk.nonce);
 
 	/* if nonce found, submit work */
 	if (unlikely(rc)) {
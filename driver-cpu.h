@@ -30,6 +30,26 @@
 #define WANT_ALTIVEC_4WAY 1
 #endif
 
+#if (defined(__i386__) || defined(__x86_64__)) && defined(HAVE_AVX2)
+#define WANT_AVX2_8WAY 1
+#endif
+
+#if (defined(__i386__) || defined(__x86_64__)) && defined(HAVE_AVX512F)
+#define WANT_AVX512_16WAY 1
+#endif
+
+#if (defined(__i386__) || defined(__x86_64__)) && defined(HAVE_SHANI)
+#define WANT_SHANI 1
+#endif
+
+#if (defined(__arm__) || defined(__aarch64__)) && defined(HAVE_NEON)
+#define WANT_NEON_4WAY 1
+#endif
+
+#if (defined(__arm__) || defined(__aarch64__)) && defined(HAVE_ARMCE)
+#define WANT_ARMCE 1
+#endif
+
 #if defined(__i386__) && defined(HAVE_YASM) && defined(HAVE_SSE2)
 #define WANT_X8632_SSE2 1
 #endif
@@ -61,19 +81,51 @@ enum sha256_algos {
 	ALGO_SSE4_64,		/* SSE4 for x86_64 */
 	ALGO_ALTIVEC_4WAY,	/* parallel Altivec */
 	ALGO_SCRYPT,		/* scrypt */
+	ALGO_AVX2_8WAY,		/* parallel AVX2 */
+	ALGO_AVX512_16WAY,	/* parallel AVX-512 */
+	ALGO_SHANI,		/* x86 SHA extensions */
+	ALGO_NEON_4WAY,		/* parallel NEON */
+	ALGO_ARMCE,		/* ARMv8 cryptography extensions */
 	
 	ALGO_FASTAUTO,		/* fast autodetect */
 	ALGO_AUTO		/* autodetect */
 };
 
+enum cpu_bench_format {
+	CPU_BENCH_NONE,
+	CPU_BENCH_CSV,
+	CPU_BENCH_JSON,
+};
+
+enum cpu_affinity {
+	CPU_AFFINITY_CORES,	/* one thread per physical core */
+	CPU_AFFINITY_THREADS,	/* one thread per SMT thread */
+	CPU_AFFINITY_NONE,	/* leave placement to the OS */
+};
+
 extern const char *algo_names[];
 extern struct device_drv cpu_drv;
 
+extern enum cpu_bench_format opt_bench_engines;
+extern char *opt_bench_engine_threads;
+extern int opt_bench_engine_trials;
+extern int opt_bench_engine_warmup;
+extern bool opt_bench_engine_pin;
+extern enum cpu_affinity opt_cpu_affinity;
+extern int opt_cpu_reserve;
+
 extern char *set_algo(const char *arg, enum sha256_algos *algo);
 extern void show_algo(char buf[OPT_SHOW_LEN], const enum sha256_algos *algo);
 extern char *force_nthreads_int(const char *arg, int *i);
+extern char *set_cpu_affinity(const char *arg, enum cpu_affinity *affinity);
 extern void init_max_name_len();
 extern double bench_algo_stage3(enum sha256_algos algo);
 extern void set_scrypt_algo(enum sha256_algos *algo);
+extern char *set_bench_engines(const char *arg, enum cpu_bench_format *format);
+extern char *set_bench_engine_threads(const char *arg, char **threads);
+extern char *set_bench_engine_trials(const char *arg, int *i);
+extern char *set_bench_engine_warmup(const char *arg, int *i);
+extern void cpu_bench_engines(void);
+extern void test_cpu_algos();
 
 #endif /* __DEVICE_CPU_H__ */
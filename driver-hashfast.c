@@ -519,15 +519,20 @@ bool hashfast_poll_msg(struct thr_info * const master_thr)
 				hashfast_submit_nonce(thr, work, nonce, false);
 				if (search)
 				{
-					for (int noffset = 1; noffset <= 0x80; ++noffset)
-					{
-						const uint32_t nonce2 = nonce + noffset;
-						if (test_nonce(work, nonce2, false))
+					// The other 0x80 nonces after it are checked all together
+					struct work_nonce searched[0x80];
+					for (int j = 0; j < 0x80; ++j)
+						searched[j] = (struct work_nonce){
+							.work = work,
+							.nonce = nonce + 1 + j,
+						};
+					test_nonces(searched, 0x80, false);
+					for (int j = 0; j < 0x80; ++j)
+						if (searched[j].res == TNR_GOOD)
 						{
-							hashfast_submit_nonce(thr, work, nonce2, true);
+							hashfast_submit_nonce(thr, work, searched[j].nonce, true);
 							++nonces_found;
 						}
-					}
 					if (!nonces_found)
 					{
 						inc_hw_errors_only(thr);
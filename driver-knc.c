@@ -442,6 +442,23 @@ uint32_t get_u32be(const void * const p)
 	     |             b[3];
 }
 
+// Submits the nonces found so far in a response all together
+static
+void knc_submit_nonces(struct work_nonce * const found, int * const n_found)
+{
+	struct knc_core *knccore;
+	int i;
+	
+	submit_nonces(found, *n_found);
+	for (i = 0; i < *n_found; ++i)
+		if (found[i].res != TNR_BAD)
+		{
+			knccore = found[i].thr->cgpu_data;
+			knccore->hwerr_in_row = 0;
+		}
+	*n_found = 0;
+}
+
 static
 void knc_poll(struct thr_info * const thr)
 {
@@ -458,6 +475,8 @@ void knc_poll(struct thr_info * const thr)
 	uint32_t nonce, coreno;
 	size_t spi_req_sz = 0x1000;
 	unsigned long delay_usecs = KNC_POLL_INTERVAL_US;
+	struct work_nonce found[0x1000 / 0xc];
+	int n_found = 0;
 	
 	knc_prune_local_queue(thr);
 	
@@ -552,16 +571,24 @@ void knc_poll(struct thr_info * const thr)
 			case KNC_REPLY_NONCE_FOUND:
 				nonce = get_u32be(&rxbuf[4]);
 				nonce = le32toh(nonce);
-				if (submit_nonce(mythr, work, nonce))
-					knccore->hwerr_in_row = 0;
+				found[n_found++] = (struct work_nonce){
+					.thr = mythr,
+					.work = work,
+					.nonce = nonce,
+				};
 				break;
 			case KNC_REPLY_WORK_DONE:
+				// Anything found for it needs checking before it goes
+				if (n_found)
+					knc_submit_nonces(found, &n_found);
 				HASH_DEL(knc->devicework, work);
 				free_work(work);
 				hashes_done2(mythr, 0x100000000, NULL);
 				break;
 		}
 	}
+	if (n_found)
+		knc_submit_nonces(found, &n_found);
 	
 	if (knc->need_flush)
 	{
@@ -408,7 +408,13 @@ double _nanofury_total_diff1(struct cgpu_info * const dev)
 {
 	double d = 0.;
 	for (struct cgpu_info *proc = dev; proc; proc = proc->next_proc)
-		d += proc->diff1;
+	{
+		// Include what hasn't been folded into the processor's diff1 yet
+		struct thr_stats_shard * const shard = &proc->thr[0]->stats_shard;
+		mutex_lock(&shard->lock);
+		d += proc->diff1 + shard->diff1;
+		mutex_unlock(&shard->lock);
+	}
 	return d;
 }
 
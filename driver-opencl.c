@@ -44,6 +44,7 @@
 #include "findnonce.h"
 #include "ocl.h"
 #include "adl.h"
+#include "scrypt.h"
 #include "util.h"
 
 /* TODO: cleanup externals ********************/
@@ -107,6 +108,9 @@ CL_API_ENTRY cl_mem CL_API_CALL
                void *       /* host_ptr */,
                cl_int *     /* errcode_ret */) CL_API_SUFFIX__VERSION_1_0;
 
+CL_API_ENTRY cl_int CL_API_CALL
+(*clReleaseMemObject)(cl_mem /* memobj */) CL_API_SUFFIX__VERSION_1_0;
+
 /* Program Object APIs  */
 CL_API_ENTRY cl_program CL_API_CALL
 (*clCreateProgramWithSource)(cl_context        /* context */,
@@ -240,6 +244,7 @@ load_opencl_symbols() {
 	LOAD_OCL_SYM(clCreateCommandQueue);
 	LOAD_OCL_SYM(clReleaseCommandQueue);
 	LOAD_OCL_SYM(clCreateBuffer);
+	LOAD_OCL_SYM(clReleaseMemObject);
 	LOAD_OCL_SYM(clCreateProgramWithSource);
 	LOAD_OCL_SYM(clCreateProgramWithBinary);
 	LOAD_OCL_SYM(clReleaseProgram);
@@ -1641,10 +1646,64 @@ static bool opencl_thread_init(struct thr_info *thr)
 }
 
 
+#ifdef USE_SCRYPT
+/* The scrypt kernel and its pad buffer are built for a single N, so when work
+ * needing another arrives, the thread's OpenCL state is rebuilt for it */
+static
+bool opencl_scrypt_rebuild(struct thr_info * const thr, const unsigned int N)
+{
+	struct cgpu_info * const gpu = thr->cgpu;
+	struct opencl_device_data * const data = gpu->device_data;
+	_clState * const old_clState = clStates[thr->id];
+	_clState *clState;
+	char name[256];
+	cl_int status;
+
+	applog(LOG_NOTICE, "%"PRIpreprv": Rebuilding scrypt kernel for N=%u",
+	       gpu->proc_repr, N);
+
+	// Build the new state first, so a failure leaves the old one usable
+	data->scrypt_n = N;
+	strcpy(name, "");
+	clState = initCl(data->virtual_gpu, name, sizeof(name));
+	if (!clState) {
+		applog(LOG_ERR, "%"PRIpreprv": Failed to build scrypt kernel for N=%u",
+		       gpu->proc_repr, N);
+		data->scrypt_n = old_clState->scrypt_n;
+		return false;
+	}
+
+	clStates[thr->id] = clState;
+	clReleaseKernel(old_clState->kernel);
+	clReleaseProgram(old_clState->program);
+	clReleaseMemObject(old_clState->padbuffer8);
+	clReleaseMemObject(old_clState->CLbuffer0);
+	clReleaseMemObject(old_clState->outputBuffer);
+	clReleaseCommandQueue(old_clState->commandQueue);
+	clReleaseContext(old_clState->context);
+	free(old_clState);
+
+	status = clEnqueueWriteBuffer(clState->commandQueue, clState->outputBuffer, CL_TRUE, 0,
+				      SCRYPT_BUFFERSIZE, blank_res, 0, NULL, NULL);
+	if (unlikely(status != CL_SUCCESS)) {
+		applog(LOG_ERR, "Error: clEnqueueWriteBuffer failed.");
+		return false;
+	}
+
+	return true;
+}
+#endif
+
 static bool opencl_prepare_work(struct thr_info __maybe_unused *thr, struct work *work)
 {
 #ifdef USE_SCRYPT
-	if (!opt_scrypt)
+	if (opt_scrypt)
+	{
+		const unsigned int N = scrypt_work_n(work);
+		if (unlikely(clStates[thr->id]->scrypt_n != N))
+			return opencl_scrypt_rebuild(thr, N);
+	}
+	else
 #endif
 	{
 		struct opencl_work_data * const blk = _opencl_work_data(work);
@@ -27,6 +27,8 @@ struct opencl_device_data {
 	int opt_lg, lookup_gap;
 	size_t opt_tc, thread_concurrency;
 	size_t shaders;
+	// N to build the scrypt kernel for; 0 for the default
+	unsigned int scrypt_n;
 #endif
 	struct timeval tv_gpustart;
 	int intervals;
@@ -18,6 +18,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #ifndef WIN32
 #include <sys/types.h>
@@ -33,6 +34,7 @@
 static struct MHD_Daemon *httpsrv;
 
 extern int handle_getwork(struct MHD_Connection *, bytes_t *);
+extern int handle_metrics(struct MHD_Connection *);
 
 void httpsrv_prepare_resp(struct MHD_Response *resp)
 {
@@ -42,6 +44,8 @@ void httpsrv_prepare_resp(struct MHD_Response *resp)
 static
 int httpsrv_handle_req(struct MHD_Connection *conn, const char *url, const char *method, bytes_t *upbuf)
 {
+	if (!strcmp(url, "/metrics") && !strcmp(method, "GET"))
+		return handle_metrics(conn);
 	return handle_getwork(conn, upbuf);
 }
 
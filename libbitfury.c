@@ -302,64 +302,105 @@ unsigned bitfury_decnonce(unsigned in)
 	return out;
 }
 
+// Candidate nonces hashed per sha256d_80_h7_multi call
+#define BITFURY_FUDGE_BATCH  0x40
+
+struct bitfury_fudge_batch {
+	struct bitfury_nonce_check *owner[BITFURY_FUDGE_BATCH];
+	const uint32_t *midstate[BITFURY_FUDGE_BATCH];
+	uint32_t tail[BITFURY_FUDGE_BATCH][4];
+	int n;
+};
+
 static
-int libbitfury_rehash(const void *midstate, const uint32_t m7, const uint32_t ntime, const uint32_t nbits, uint32_t nnonce) {
-	unsigned char in[16];
-	unsigned int *in32 = (unsigned int *)in;
-	unsigned int *mid32 = (unsigned int *)midstate;
-	unsigned out32[8];
-	unsigned char *out = (unsigned char *) out32;
-#ifdef BITFURY_REHASH_DEBUG
-	static unsigned history[512];
-	static unsigned history_p;
-#endif
-	sha256_ctx ctx;
-
-
-	memset( &ctx, 0, sizeof( sha256_ctx ) );
-	memcpy(ctx.h, mid32, 8*4);
-	ctx.tot_len = 64;
-	ctx.len = 0;
-
-	nnonce = bswap_32(nnonce);
-	in32[0] = bswap_32(m7);
-	in32[1] = bswap_32(ntime);
-	in32[2] = bswap_32(nbits);
-	in32[3] = nnonce;
-
-	sha256_update(&ctx, in, 16);
-	sha256_final(&ctx, out);
-	sha256(out, 32, out);
-
-	if (out32[7] == 0) {
-#ifdef BITFURY_REHASH_DEBUG
-		char hex[65];
-		bin2hex(hex, out, 32);
-		applog(LOG_INFO, "! MS0: %08x, m7: %08x, ntime: %08x, nbits: %08x, nnonce: %08x", mid32[0], m7, ntime, nbits, nnonce);
-		applog(LOG_INFO, " out: %s", hex);
-		history[history_p] = nnonce;
-		history_p++; history_p &= 512 - 1;
-#endif
-		return 1;
+void bitfury_fudge_flush(struct bitfury_fudge_batch * const batch)
+{
+	uint32_t h7[BITFURY_FUDGE_BATCH];
+	int i;
+	
+	sha256d_80_h7_multi(batch->midstate, (const uint32_t (*)[4])batch->tail, h7, batch->n);
+	for (i = 0; i < batch->n; ++i)
+	{
+		struct bitfury_nonce_check * const check = batch->owner[i];
+		// Candidates are queued in offset order, so the first one found wins
+		if (h7[i] || check->found)
+			continue;
+		check->nonce = batch->tail[i][3];
+		check->found = true;
 	}
-	return 0;
+	batch->n = 0;
 }
 
-bool bitfury_fudge_nonce(const void *midstate, const uint32_t m7, const uint32_t ntime, const uint32_t nbits, uint32_t *nonce_p) {
+void bitfury_nonce_check_init(struct bitfury_nonce_check * const check, const struct work * const work, const uint32_t nonce)
+{
+	if (work)
+	{
+		check->midstate = work->midstate;
+		check->m7    = *((uint32_t *)&work->data[64]);
+		check->ntime = *((uint32_t *)&work->data[68]);
+		check->nbits = *((uint32_t *)&work->data[72]);
+	}
+	else
+		check->midstate = NULL;
+	check->nonce = nonce;
+	check->found = false;
+}
+
+/* Checks each result as bitfury_fudge_nonce does, but hashes the candidates
+ * of many results together several lanes at a time. Most results are fine as
+ * they are, so the other offsets are only tried for those that aren't. */
+void bitfury_fudge_nonces(struct bitfury_nonce_check * const checks, const int n)
+{
 	static const uint32_t offsets[] = {0, 0xffc00000, 0xff800000, 0x02800000, 0x02C00000, 0x00400000};
-	uint32_t nonce;
-	int i;
+	static const int first_offset[] = {0, 1, 6};
+	struct bitfury_fudge_batch batch;
+	int pass, i, k;
 	
-	for (i = 0; i < 6; ++i)
+	for (i = 0; i < n; ++i)
+		checks[i].found = false;
+	
+	batch.n = 0;
+	for (pass = 0; pass < 2; ++pass)
 	{
-		nonce = *nonce_p + offsets[i];
-		if (libbitfury_rehash(midstate, m7, ntime, nbits, nonce))
+		for (i = 0; i < n; ++i)
 		{
-			*nonce_p = nonce;
-			return true;
+			struct bitfury_nonce_check * const check = &checks[i];
+			if (!check->midstate)
+				continue;
+			for (k = first_offset[pass]; k < first_offset[pass + 1]; ++k)
+			{
+				// A flush may have found this one already, and changed its nonce
+				if (check->found)
+					break;
+				batch.owner[batch.n] = check;
+				batch.midstate[batch.n] = check->midstate;
+				batch.tail[batch.n][0] = check->m7;
+				batch.tail[batch.n][1] = check->ntime;
+				batch.tail[batch.n][2] = check->nbits;
+				batch.tail[batch.n][3] = check->nonce + offsets[k];
+				if (++batch.n == BITFURY_FUDGE_BATCH)
+					bitfury_fudge_flush(&batch);
+			}
 		}
+		if (batch.n)
+			bitfury_fudge_flush(&batch);
 	}
-	return false;
+}
+
+bool bitfury_fudge_nonce(const void *midstate, const uint32_t m7, const uint32_t ntime, const uint32_t nbits, uint32_t *nonce_p) {
+	struct bitfury_nonce_check check = {
+		.midstate = midstate,
+		.m7 = m7,
+		.ntime = ntime,
+		.nbits = nbits,
+		.nonce = *nonce_p,
+	};
+	
+	bitfury_fudge_nonces(&check, 1);
+	if (!check.found)
+		return false;
+	*nonce_p = check.nonce;
+	return true;
 }
 
 void work_to_bitfury_payload(struct bitfury_payload *p, struct work *w) {
@@ -380,3 +421,50 @@ void bitfury_payload_to_atrvec(uint32_t *atrvec, struct bitfury_payload *p)
 	memcpy(atrvec, p, 20*4);
 	libbitfury_ms3_compute(atrvec);
 }
+
+/* Known answers for bitfury_decnonce, from the bit order documented above,
+ * and for bitfury_fudge_nonces, using the test headers' winning nonces */
+void test_bitfury_nonces()
+{
+	// Where each bit of the decoded nonce comes from, from bit 31 down
+	static const uint8_t in_bits[32] = {
+		0x07, 0x06, 0x05, 0x04, 0x03, 0x02, 0x01, 0x00, 0x0f, 0x0e,
+		0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f,
+		0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+		0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d,
+	};
+	// What the chips' results can be off by (see bitfury_fudge_nonces)
+	static const uint32_t offsets[] = {0, 0xffc00000, 0xff800000, 0x02800000, 0x02C00000, 0x00400000};
+	const int n_offsets = sizeof(offsets) / sizeof(*offsets);
+	struct work work[3];
+	struct bitfury_nonce_check checks[3][n_offsets + 1];
+	uint32_t win[3];
+	unsigned out;
+	int i, j;
+
+	for (i = 0; i < 32; ++i)
+	{
+		out = bitfury_decnonce(1U << in_bits[i]);
+		if (out != (1U << (31 - i)) - 0x800004)
+			applog(LOG_ERR, "%s: bitfury_decnonce(%08x) gave %08x", __func__, 1U << in_bits[i], out);
+	}
+
+	// Every offset must be undone, and a nonce that's just wrong not found
+	for (i = 0; i < 3 && test_block_headers[i]; ++i)
+	{
+		test_header_work(&work[i], test_block_headers[i]);
+		win[i] = *(uint32_t *)&work[i].data[76];
+		for (j = 0; j < n_offsets; ++j)
+			bitfury_nonce_check_init(&checks[i][j], &work[i], win[i] - offsets[j]);
+		bitfury_nonce_check_init(&checks[i][n_offsets], &work[i], win[i] + 1);
+	}
+	bitfury_fudge_nonces(&checks[0][0], i * (n_offsets + 1));
+	while (i--)
+	{
+		for (j = 0; j < n_offsets; ++j)
+			if (!(checks[i][j].found && checks[i][j].nonce == win[i]))
+				applog(LOG_ERR, "%s: Nonce %08lx was not corrected to %08lx", __func__, (unsigned long)(win[i] - offsets[j]), (unsigned long)win[i]);
+		if (checks[i][n_offsets].found)
+			applog(LOG_ERR, "%s: Nonce %08lx was wrongly accepted as %08lx", __func__, (unsigned long)(win[i] + 1), (unsigned long)checks[i][n_offsets].nonce);
+	}
+}
@@ -56,6 +56,14 @@ struct bitfury_device {
 	int sample_tot;
 };
 
+// A result to check by bitfury_fudge_nonces; midstate is NULL if there is no work for it
+struct bitfury_nonce_check {
+	const void *midstate;
+	uint32_t m7, ntime, nbits;
+	uint32_t nonce;
+	bool found;
+};
+
 extern void work_to_bitfury_payload(struct bitfury_payload *, struct work *);
 extern void bitfury_payload_to_atrvec(uint32_t *atrvec, struct bitfury_payload *);
 extern void bitfury_send_reinit(struct spi_port *, int slot, int chip_n, int n);
@@ -63,6 +71,9 @@ extern void bitfury_send_shutdown(struct spi_port *, int slot, int chip_n);
 extern void bitfury_send_freq(struct spi_port *, int slot, int chip_n, int bits);
 extern int libbitfury_detectChips1(struct spi_port *);
 extern unsigned bitfury_decnonce(unsigned);
+extern void bitfury_nonce_check_init(struct bitfury_nonce_check *, const struct work *, uint32_t nonce);
+extern void bitfury_fudge_nonces(struct bitfury_nonce_check *, int n);
 extern bool bitfury_fudge_nonce(const void *midstate, const uint32_t m7, const uint32_t ntime, const uint32_t nbits, uint32_t *nonce_p);
+extern void test_bitfury_nonces();
 
 #endif /* __LIBBITFURY_H__ */
@@ -0,0 +1,271 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#ifdef WIN32
+#include <winsock2.h>
+#endif
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef WIN32
+#include <sys/types.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#endif
+
+#include <microhttpd.h>
+
+#include "httpsrv.h"
+#include "miner.h"
+#include "util.h"
+
+/* OpenMetrics exporter for the HTTP server
+ * Each scrape first folds in the mining threads' stats, like the API's
+ * report commands. The statistics are then read without taking the stats
+ * locks, so values are whatever was last stored. The pool list itself is
+ * only walked under control_lock. */
+
+#define METRICS_CONTENT_TYPE  "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+static
+void metrics_printf(bytes_t * const out, const char * const fmt, ...)
+{
+	char buf[0x200];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		return;
+	if (len >= sizeof(buf))
+		len = sizeof(buf) - 1;
+	bytes_append(out, buf, len);
+}
+
+// Escapes backslash, double-quote and newline as label values require
+static
+void metrics_label_escape(char * const dst, const size_t dstsz, const char *src)
+{
+	char *p = dst, * const end = &dst[dstsz - 1];
+
+	for ( ; *src && p < end; ++src)
+	{
+		const char *esc;
+		switch (*src)
+		{
+			case '\\':  esc = "\\\\";  break;
+			case '"':   esc = "\\\"";  break;
+			case '\n':  esc = "\\n";   break;
+			default:
+				*(p++) = *src;
+				continue;
+		}
+		if (end - p < 2)
+			break;
+		*(p++) = esc[0];
+		*(p++) = esc[1];
+	}
+	*p = '\0';
+}
+
+static
+void metrics_family(bytes_t * const out, const char * const name, const char * const type, const char * const help)
+{
+	metrics_printf(out, "# TYPE bfgminer_%s %s\n# HELP bfgminer_%s %s\n", name, type, name, help);
+}
+
+static double proc_hashrate(const struct cgpu_info *proc) { return proc->rolling * 1e6; }
+static double proc_hashes(const struct cgpu_info *proc) { return proc->total_mhashes * 1e6; }
+static double proc_diff1(const struct cgpu_info *proc) { return proc->diff1; }
+static double proc_accepted(const struct cgpu_info *proc) { return proc->diff_accepted; }
+static double proc_rejected(const struct cgpu_info *proc) { return proc->diff_rejected; }
+static double proc_stale(const struct cgpu_info *proc) { return proc->diff_stale; }
+static double proc_hwerrors(const struct cgpu_info *proc) { return proc->hw_errors; }
+static double proc_temp(const struct cgpu_info *proc) { return proc->temp; }
+static double proc_up(const struct cgpu_info *proc) { return proc->status == LIFE_WELL; }
+static double proc_enabled(const struct cgpu_info *proc) { return proc->deven == DEV_ENABLED; }
+
+static const struct {
+	const char *name;
+	const char *type;
+	const char *help;
+	double (*get)(const struct cgpu_info *);
+	// Processors without a reading (<= 0) are left out
+	bool optional;
+} metrics_proc_families[] = {
+	{"proc_hashrate", "gauge", "Rolling average hashrate in hashes per second", proc_hashrate},
+	{"proc_hashes", "counter", "Hashes done", proc_hashes},
+	{"proc_diff1", "counter", "Difficulty-1 shares found", proc_diff1},
+	{"proc_accepted_diff", "counter", "Difficulty of accepted shares", proc_accepted},
+	{"proc_rejected_diff", "counter", "Difficulty of rejected shares", proc_rejected},
+	{"proc_stale_diff", "counter", "Difficulty of stale shares", proc_stale},
+	{"proc_hardware_errors", "counter", "Hardware errors", proc_hwerrors},
+	{"proc_temperature_celsius", "gauge", "Temperature", proc_temp, true},
+	{"proc_up", "gauge", "Whether the processor is alive and well", proc_up},
+	{"proc_enabled", "gauge", "Whether the processor is enabled", proc_enabled},
+};
+
+static
+void metrics_procs(bytes_t * const out)
+{
+	char drvname[0x40], labels[0x100];
+	struct cgpu_info *proc;
+	int i, j;
+
+	for (j = 0; j < sizeof(metrics_proc_families) / sizeof(*metrics_proc_families); ++j)
+	{
+		const bool counter = !strcmp(metrics_proc_families[j].type, "counter");
+		metrics_family(out, metrics_proc_families[j].name, metrics_proc_families[j].type, metrics_proc_families[j].help);
+		for (i = 0; i < total_devices; ++i)
+		{
+			proc = get_devices(i);
+			const double val = metrics_proc_families[j].get(proc);
+			if (metrics_proc_families[j].optional && val <= 0)
+				continue;
+			metrics_label_escape(drvname, sizeof(drvname), proc->drv->name);
+			snprintf(labels, sizeof(labels), "proc=\"%s\",driver=\"%s\",device_id=\"%d\",proc_id=\"%d\"",
+			         proc->proc_repr_ns, drvname, proc->device_id, proc->proc_id);
+			metrics_printf(out, "bfgminer_%s%s{%s} %.17g\n", metrics_proc_families[j].name, counter ? "_total" : "", labels, val);
+		}
+	}
+}
+
+static double pool_accepted(const struct pool *pool) { return pool->diff_accepted; }
+static double pool_rejected(const struct pool *pool) { return pool->diff_rejected; }
+static double pool_stale(const struct pool *pool) { return pool->diff_stale; }
+static double pool_alive(const struct pool *pool) { return !pool->idle; }
+
+static const struct {
+	const char *name;
+	const char *type;
+	const char *help;
+	double (*get)(const struct pool *);
+} metrics_pool_families[] = {
+	{"pool_accepted_diff", "counter", "Difficulty of shares accepted by the pool", pool_accepted},
+	{"pool_rejected_diff", "counter", "Difficulty of shares rejected by the pool", pool_rejected},
+	{"pool_stale_diff", "counter", "Difficulty of stale shares for the pool", pool_stale},
+	{"pool_up", "gauge", "Whether the pool is alive", pool_alive},
+};
+
+static const double metrics_quantiles[] = {0.5, 0.9, 0.99};
+
+// Sets labels for the pool, which the caller must hold data_lock for
+static
+void metrics_pool_labels(char * const labels, const size_t labelssz, const struct pool * const pool)
+{
+	char url[0x100];
+
+	metrics_label_escape(url, sizeof(url), pool->rpc_url);
+	snprintf(labels, labelssz, "pool=\"%d\",url=\"%s\"", pool->pool_no, url);
+}
+
+static
+void metrics_pools(bytes_t * const out)
+{
+	char labels[0x140];
+	struct pool **mypools, *pool;
+	int mytotal, i, j;
+
+	/* add_pool and remove_pool change the list under control_lock; the pools
+	 * themselves are never freed, so only the list needs copying */
+	cg_rlock(&control_lock);
+	mytotal = total_pools;
+	mypools = malloc(sizeof(*mypools) * (mytotal ?: 1));
+	if (unlikely(!mypools))
+		quithere(1, "Failed to malloc pools list");
+	memcpy(mypools, pools, sizeof(*mypools) * mytotal);
+	cg_runlock(&control_lock);
+
+	for (j = 0; j < sizeof(metrics_pool_families) / sizeof(*metrics_pool_families); ++j)
+	{
+		const bool counter = !strcmp(metrics_pool_families[j].type, "counter");
+		metrics_family(out, metrics_pool_families[j].name, metrics_pool_families[j].type, metrics_pool_families[j].help);
+		for (i = 0; i < mytotal; ++i)
+		{
+			pool = mypools[i];
+			cg_rlock(&pool->data_lock);
+			if (pool->removed)
+			{
+				cg_runlock(&pool->data_lock);
+				continue;
+			}
+			metrics_pool_labels(labels, sizeof(labels), pool);
+			const double val = metrics_pool_families[j].get(pool);
+			cg_runlock(&pool->data_lock);
+			metrics_printf(out, "bfgminer_%s%s{%s} %.17g\n", metrics_pool_families[j].name, counter ? "_total" : "", labels, val);
+		}
+	}
+
+	metrics_family(out, "pool_share_ack_seconds", "summary", "Time from sending a share to the pool's reply");
+	for (i = 0; i < mytotal; ++i)
+	{
+		const struct latency_hist *hist;
+		uint64_t quantiles[sizeof(metrics_quantiles) / sizeof(*metrics_quantiles)], count, total_us;
+
+		pool = mypools[i];
+		cg_rlock(&pool->data_lock);
+		if (pool->removed)
+		{
+			cg_runlock(&pool->data_lock);
+			continue;
+		}
+		metrics_pool_labels(labels, sizeof(labels), pool);
+		hist = &pool->latency.sent_to_ack;
+		for (j = 0; j < sizeof(metrics_quantiles) / sizeof(*metrics_quantiles); ++j)
+			quantiles[j] = latency_hist_percentile(hist, metrics_quantiles[j] * 100);
+		count = hist->count;
+		total_us = hist->total_us;
+		cg_runlock(&pool->data_lock);
+
+		for (j = 0; j < sizeof(metrics_quantiles) / sizeof(*metrics_quantiles); ++j)
+			metrics_printf(out, "bfgminer_pool_share_ack_seconds{%s,quantile=\"%g\"} %.6f\n", labels, metrics_quantiles[j], quantiles[j] / 1e6);
+		metrics_printf(out, "bfgminer_pool_share_ack_seconds_count{%s} %"PRIu64"\n", labels, count);
+		metrics_printf(out, "bfgminer_pool_share_ack_seconds_sum{%s} %.6f\n", labels, total_us / 1e6);
+	}
+
+	free(mypools);
+}
+
+int handle_metrics(struct MHD_Connection *conn)
+{
+	struct MHD_Response *resp;
+	bytes_t out = BYTES_INIT;
+	int staged, submitting, ret;
+
+	fold_thr_stats();
+
+	metrics_family(&out, "build", "info", "Build information");
+	metrics_printf(&out, "bfgminer_build_info{version=\"%s\"} 1\n", VERSION);
+	metrics_family(&out, "uptime_seconds", "gauge", "Time since mining started");
+	metrics_printf(&out, "bfgminer_uptime_seconds %.3f\n", total_secs);
+
+	get_queue_depths(&staged, &submitting);
+	metrics_family(&out, "staged_work", "gauge", "Work items queued for the mining threads");
+	metrics_printf(&out, "bfgminer_staged_work %d\n", staged);
+	metrics_family(&out, "submitting_shares", "gauge", "Shares waiting to be submitted or acknowledged");
+	metrics_printf(&out, "bfgminer_submitting_shares %d\n", submitting);
+
+	metrics_procs(&out);
+	metrics_pools(&out);
+	bytes_append(&out, "# EOF\n", 6);
+
+	resp = MHD_create_response_from_buffer(bytes_len(&out), bytes_buf(&out), MHD_RESPMEM_MUST_FREE);
+	httpsrv_prepare_resp(resp);
+	MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE, METRICS_CONTENT_TYPE);
+	ret = MHD_queue_response(conn, MHD_HTTP_OK, resp);
+	MHD_destroy_response(resp);
+	return ret;
+}
@@ -63,6 +63,9 @@
 #include <jansson.h>
 #include <curl/curl.h>
 #include <libgen.h>
+#ifdef USE_LIBEVENT
+#include <event2/event.h>
+#endif
 #include <sha2.h>
 #include <utlist.h>
 
@@ -223,6 +226,7 @@ bool use_curses;
 bool have_libusb;
 #endif
 static bool opt_submit_stale = true;
+static bool opt_local_work;
 static int opt_shares;
 static int opt_submit_threads = 0x40;
 bool opt_fail_only;
@@ -303,7 +307,6 @@ int total_getworks, total_stale, total_discarded;
 uint64_t total_bytes_rcvd, total_bytes_sent;
 double total_diff1, total_bad_diff1;
 double total_diff_accepted, total_diff_rejected, total_diff_stale;
-static int staged_rollable;
 unsigned int new_blocks;
 unsigned int found_blocks;
 
@@ -395,10 +398,61 @@ struct stratum_share {
 	bool block;
 	struct work *work;
 	int id;
+	int thr_id;
+	struct timeval tv_queued;
+	struct timeval tv_sent;
+	struct stratum_share *next;  // in sshare_cache
 };
 
 static struct stratum_share *stratum_shares = NULL;
 
+/* Answered stratum shares are kept here for reuse, like retired work */
+#define SSHARE_CACHE_MAX 0x100
+static pthread_mutex_t sshare_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stratum_share *sshare_cache;
+static int sshare_cache_count;
+
+static
+struct stratum_share *make_stratum_share(void)
+{
+	struct stratum_share *sshare;
+
+	mutex_lock(&sshare_cache_lock);
+	sshare = sshare_cache;
+	if (sshare)
+	{
+		sshare_cache = sshare->next;
+		--sshare_cache_count;
+	}
+	mutex_unlock(&sshare_cache_lock);
+
+	if (sshare)
+		memset(sshare, 0, sizeof(*sshare));
+	else
+	{
+		sshare = calloc(1, sizeof(*sshare));
+		if (unlikely(!sshare))
+			quit(1, "Failed to calloc stratum share");
+	}
+	return sshare;
+}
+
+static
+void free_stratum_share(struct stratum_share *sshare)
+{
+	mutex_lock(&sshare_cache_lock);
+	if (sshare_cache_count < SSHARE_CACHE_MAX)
+	{
+		sshare->next = sshare_cache;
+		sshare_cache = sshare;
+		++sshare_cache_count;
+		sshare = NULL;
+	}
+	mutex_unlock(&sshare_cache_lock);
+
+	free(sshare);
+}
+
 char *opt_socks_proxy = NULL;
 
 static const char def_conf[] = "bfgminer.conf";
@@ -431,7 +485,23 @@ struct thread_q *getq;
 
 static int total_work;
 static bool staged_full;
-struct work *staged_work = NULL;
+
+/* Staged work is kept in two lanes, non-rollable and rollable, each a list
+ * ordered oldest first by tv_staged so it never needs to be searched or sorted.
+ * Protected by stgd_lock */
+enum staged_lane {
+	SL_FIXED,
+	SL_ROLLABLE,
+	SL_COUNT
+};
+static struct work *staged_work[SL_COUNT];
+static int staged_count[SL_COUNT];
+
+/* Maximum stratum works generated together by the getwork scheduler */
+#define STRATUM_WORK_BATCH  (SHA256_MB_LANES * 2)
+
+/* Maximum stratum shares sent to a pool in a single write */
+#define STRATUM_SUBMIT_BATCH  16
 
 struct schedtime {
 	bool enable;
@@ -904,6 +974,22 @@ static struct cgpu_info *get_thr_cgpu(int thr_id)
 	return thr->cgpu;
 }
 
+// Adds a share latency to the pool's and device's histograms
+static void record_share_latency(struct pool * const pool, const int thr_id, const size_t hist_offset, const struct timeval * const tvp_start, const struct timeval * const tvp_end)
+{
+	struct cgpu_info * const cgpu = get_thr_cgpu(thr_id);
+	const int64_t us = timer_elapsed_us(tvp_start, tvp_end);
+
+	mutex_lock(&stats_lock);
+	latency_hist_add((void *)&((char *)&pool->latency)[hist_offset], us);
+	if (cgpu)
+		latency_hist_add((void *)&((char *)&cgpu->latency)[hist_offset], us);
+	mutex_unlock(&stats_lock);
+}
+
+#define share_latency(work, hist, tvp_start, tvp_end)  \
+	record_share_latency((work)->pool, (work)->thr_id, offsetof(struct share_latency_stats, hist), tvp_start, tvp_end)
+
 struct cgpu_info *get_devices(int id)
 {
 	struct cgpu_info *cgpu;
@@ -1066,8 +1152,10 @@ struct pool *add_pool(void)
 	pool->sock = INVSOCK;
 	pool->lp_socket = CURL_SOCKET_BAD;
 
+	cg_wlock(&control_lock);
 	pools = realloc(pools, sizeof(struct pool *) * (total_pools + 2));
 	pools[total_pools++] = pool;
+	cg_wunlock(&control_lock);
 
 	return pool;
 }
@@ -1592,6 +1680,25 @@ static char *set_pool_proxy(const char *arg)
 	return NULL;
 }
 
+#ifdef USE_SCRYPT
+static char *set_pool_scrypt_n(const char *arg)
+{
+	struct pool *pool;
+	const char *err;
+
+	if (!total_pools)
+		return "Usage of --pool-scrypt-n before pools are defined does not make sense";
+
+	pool = pools[total_pools - 1];
+	err = scrypt_parse_n_steps(arg, &pool->scrypt_n_steps);
+	if (err)
+		return (char *)err;
+	opt_set_charp(arg, &pool->scrypt_n_str);
+
+	return NULL;
+}
+#endif
+
 static char *set_pool_force_rollntime(const char *arg)
 {
 	struct pool *pool;
@@ -1908,6 +2015,21 @@ static struct opt_table opt_config_table[] = {
 #endif
 #ifdef WANT_ALTIVEC_4WAY
     "\n\taltivec_4way\tAltivec implementation for PowerPC G4 and G5 machines"
+#endif
+#ifdef WANT_AVX2_8WAY
+		     "\n\tavx2_8way\t8-way AVX2 implementation"
+#endif
+#ifdef WANT_AVX512_16WAY
+		     "\n\tavx512_16way\t16-way AVX-512 implementation"
+#endif
+#ifdef WANT_SHANI
+		     "\n\tshani\t\tx86 SHA extensions implementation"
+#endif
+#ifdef WANT_NEON_4WAY
+		     "\n\tneon_4way\t4-way NEON implementation for ARM machines"
+#endif
+#ifdef WANT_ARMCE
+		     "\n\tarmce\t\tARMv8 cryptography extensions implementation"
 #endif
 		),
 	OPT_WITH_ARG("-a",
@@ -1970,6 +2092,21 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--bench-algo",
 		     set_int_0_to_9999, opt_show_intval, &opt_bench_algo,
 		     opt_hidden),
+	OPT_WITHOUT_ARG("--bench-engine-pin",
+			opt_set_bool, &opt_bench_engine_pin,
+			"Bind each --bench-engines thread to its own CPU"),
+	OPT_WITH_ARG("--bench-engine-threads",
+		     set_bench_engine_threads, NULL, &opt_bench_engine_threads,
+		     "Comma separated thread counts for --bench-engines (default: 1, the number of cores and the number of CPUs)"),
+	OPT_WITH_ARG("--bench-engine-trials",
+		     set_bench_engine_trials, opt_show_intval, &opt_bench_engine_trials,
+		     "Timed runs of each algorithm and thread count for --bench-engines"),
+	OPT_WITH_ARG("--bench-engine-warmup",
+		     set_bench_engine_warmup, opt_show_intval, &opt_bench_engine_warmup,
+		     "Untimed runs before the trials for --bench-engines"),
+	OPT_WITH_ARG("--bench-engines",
+		     set_bench_engines, NULL, &opt_bench_engines,
+		     "Benchmark every CPU mining algorithm, print the results as csv or json, and exit"),
 #endif
 #ifdef HAVE_CHROOT
         OPT_WITH_ARG("--chroot-dir",
@@ -2007,6 +2144,12 @@ static struct opt_table opt_config_table[] = {
 			"Use compact display without per device statistics"),
 #endif
 #ifdef WANT_CPUMINE
+	OPT_WITH_ARG("--cpu-affinity",
+		     set_cpu_affinity, NULL, &opt_cpu_affinity,
+		     "Bind CPU mining threads to one per physical core (cores), one per SMT thread (threads), or leave them unbound (none)"),
+	OPT_WITH_ARG("--cpu-reserve",
+		     set_int_0_to_9999, opt_show_intval, &opt_cpu_reserve,
+		     "Number of physical CPU cores to leave free of mining threads for network and API threads"),
 	OPT_WITH_ARG("--cpu-threads",
 		     force_nthreads_int, opt_show_intval, &opt_n_threads,
 		     "Number of miner CPU threads"),
@@ -2032,7 +2175,7 @@ static struct opt_table opt_config_table[] = {
 #ifdef USE_LIBMICROHTTPD
 	OPT_WITH_ARG("--http-port",
 	             opt_set_intval, opt_show_intval, &httpsrv_port,
-	             "Port number to listen on for HTTP getwork miners (-1 means disabled)"),
+	             "Port number to listen on for HTTP getwork miners and /metrics (-1 means disabled)"),
 #endif
 	OPT_WITH_ARG("--expiry",
 		     set_int_0_to_9999, opt_show_intval, &opt_expiry,
@@ -2141,6 +2284,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--load-balance",
 		     set_loadbalance, &pool_strategy,
 		     "Change multipool strategy from failover to quota based balance"),
+	OPT_WITHOUT_ARG("--local-work",
+			opt_set_bool, &opt_local_work,
+			"Generate stratum work within each mining thread, bypassing the shared work queue"),
 	OPT_WITH_ARG("--log|-l",
 		     set_int_0_to_9999, opt_show_intval, &opt_log_interval,
 		     "Interval in seconds between log output"),
@@ -2238,6 +2384,11 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--pool-proxy|-x",
 		     set_pool_proxy, NULL, NULL,
 		     "Proxy URI to use for connecting to just the previous-defined pool"),
+#ifdef USE_SCRYPT
+	OPT_WITH_ARG("--pool-scrypt-n",
+		     set_pool_scrypt_n, NULL, NULL,
+		     "scrypt N for just the previous-defined pool, or a list of ntime:N steps"),
+#endif
 	OPT_WITH_ARG("--force-rollntime",  // NOTE: must be after --pass for config file ordering
 			 set_pool_force_rollntime, NULL, NULL,
 			 opt_hidden),
@@ -2649,19 +2800,11 @@ static bool jobj_binary(const json_t *obj, const char *key,
 	return true;
 }
 
+static void calc_midstates(struct work **, int);
+
 static void calc_midstate(struct work *work)
 {
-	union {
-		unsigned char c[64];
-		uint32_t i[16];
-	} data;
-
-	swap32yes(&data.i[0], work->data, 16);
-	sha256_ctx ctx;
-	sha256_init(&ctx);
-	sha256_update(&ctx, data.c, 64);
-	memcpy(work->midstate, ctx.h, sizeof(work->midstate));
-	swap32tole(work->midstate, work->midstate, 8);
+	calc_midstates(&work, 1);
 }
 
 static
@@ -2697,12 +2840,35 @@ void tmpl_decref(struct bfg_tmpl_ref * const tr)
 	}
 }
 
+/* Retired work structs are kept here (already cleaned) for reuse, so the
+ * share and work generation paths rarely need to touch the allocator; they
+ * keep their (emptied) nonce2 buffer too */
+#define WORK_CACHE_MAX 0x100
+static pthread_mutex_t work_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct work *work_cache;
+static int work_cache_count;
+
 static struct work *make_work(void)
 {
-	struct work *work = calloc(1, sizeof(struct work));
+	struct work *work;
+
+	mutex_lock(&work_cache_lock);
+	work = work_cache;
+	if (work)
+	{
+		work_cache = work->next;
+		--work_cache_count;
+	}
+	mutex_unlock(&work_cache_lock);
 
-	if (unlikely(!work))
-		quit(1, "Failed to calloc work in make_work");
+	if (work)
+		work->next = NULL;
+	else
+	{
+		work = calloc(1, sizeof(struct work));
+		if (unlikely(!work))
+			quit(1, "Failed to calloc work in make_work");
+	}
 
 	cg_wlock(&control_lock);
 	work->id = total_work++;
@@ -2715,9 +2881,9 @@ static struct work *make_work(void)
  * cleaned to remove any dynamically allocated arrays within the struct */
 void clean_work(struct work *work)
 {
-	free(work->job_id);
+	refstr_unref(work->job_id);
 	bytes_free(&work->nonce2);
-	free(work->nonce1);
+	refstr_unref(work->nonce1);
 	if (work->device_data_free_func)
 		work->device_data_free_func(work);
 
@@ -2727,12 +2893,39 @@ void clean_work(struct work *work)
 	memset(work, 0, sizeof(struct work));
 }
 
+// Like clean_work, but leaves the nonce2 buffer allocated (and empty) for reuse
+static
+void clean_work_keep_nonce2(struct work * const work)
+{
+	bytes_t nonce2 = work->nonce2;
+	
+	bytes_init(&work->nonce2);
+	clean_work(work);
+	bytes_reset(&nonce2);
+	work->nonce2 = nonce2;
+}
+
 /* All dynamically allocated work structs should be freed here to not leak any
  * ram from arrays allocated within the work struct */
 void free_work(struct work *work)
 {
-	clean_work(work);
-	free(work);
+	clean_work_keep_nonce2(work);
+	
+	mutex_lock(&work_cache_lock);
+	if (work_cache_count < WORK_CACHE_MAX)
+	{
+		work->next = work_cache;
+		work_cache = work;
+		++work_cache_count;
+		work = NULL;
+	}
+	mutex_unlock(&work_cache_lock);
+	
+	if (work)
+	{
+		bytes_free(&work->nonce2);
+		free(work);
+	}
 }
 
 const char *bfg_workpadding_bin = "\0\0\0\x80\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\x80\x02\0\0";
@@ -2972,6 +3165,7 @@ static bool work_decode(struct pool *pool, struct work *work, json_t *val)
 			swork->tr = work->tr;
 			bytes_assimilate_raw(&swork->coinbase, cbtxn, cbtxnsz, cbtxnsz);
 			swork->nonce2_offset = cbextranonceoffset;
+			swork->coinbase_prefix_valid = false;
 			bytes_assimilate_raw(&swork->merkle_bin, branches, branchdatasz, branchdatasz);
 			swork->merkles = branchcount;
 			memcpy(swork->header1, &buf[0], 36);
@@ -2979,7 +3173,7 @@ static bool work_decode(struct pool *pool, struct work *work, json_t *val)
 			swork->tv_received = tv_now;
 			memcpy(swork->diffbits, &buf[72], 4);
 			swork->diff = target_diff(work->target);
-			free(swork->job_id);
+			refstr_unref(swork->job_id);
 			swork->job_id = NULL;
 			swork->clean = true;
 			swork->work_restart_id = pool->work_restart_id;
@@ -3025,7 +3219,60 @@ void decay_time(double *f, double fadd, double fsecs)
 
 static int __total_staged(void)
 {
-	return HASH_COUNT(staged_work);
+	return staged_count[SL_FIXED] + staged_count[SL_ROLLABLE];
+}
+
+static bool work_rollable(struct work *work)
+{
+	return (!work->clone && work->rolltime);
+}
+
+static inline
+enum staged_lane staged_lane(struct work * const work)
+{
+	return work_rollable(work) ? SL_ROLLABLE : SL_FIXED;
+}
+
+static
+void __staged_add(struct work * const work)
+{
+	const enum staged_lane lane = staged_lane(work);
+	struct work ** const headp = &staged_work[lane];
+	struct work * const head = *headp;
+	struct work *pos;
+	
+	++staged_count[lane];
+	
+	// New work is almost always the newest, so this is normally just an append
+	if ((!head) || head->prev->tv_staged.tv_sec <= work->tv_staged.tv_sec)
+	{
+		DL_APPEND(*headp, work);
+		return;
+	}
+	
+	// Find the newest item not newer than this work, searching back from the tail
+	for (pos = head->prev; pos != head && pos->tv_staged.tv_sec > work->tv_staged.tv_sec; pos = pos->prev)
+	{}
+	if (pos->tv_staged.tv_sec > work->tv_staged.tv_sec)
+	{
+		DL_PREPEND(*headp, work);
+		return;
+	}
+	
+	// Insert after pos (which is never the tail here)
+	work->prev = pos;
+	work->next = pos->next;
+	pos->next->prev = work;
+	pos->next = work;
+}
+
+static
+void __staged_del(struct work * const work)
+{
+	const enum staged_lane lane = staged_lane(work);
+	
+	DL_DELETE(staged_work[lane], work);
+	--staged_count[lane];
 }
 
 static int total_staged(void)
@@ -3039,6 +3286,13 @@ static int total_staged(void)
 	return ret;
 }
 
+// Unlocked, for monitoring; the two values may be momentarily inconsistent
+void get_queue_depths(int * const staged, int * const submitting)
+{
+	*staged = __total_staged();
+	*submitting = total_submitting;
+}
+
 #ifdef HAVE_CURSES
 WINDOW *mainwin, *statuswin, *logwin;
 #endif
@@ -4222,6 +4476,20 @@ void maybe_local_submit(const struct work *work)
 #endif
 }
 
+static const char *share_reject_reason(json_t *val, json_t *res, json_t *err, const struct work *work)
+{
+	if (!json_is_string(res))
+		res = json_object_get(val, "reject-reason");
+	if (json_is_string(res))
+		return json_string_value(res);
+	if (work->stratum && err && json_is_array(err)) {
+		res = json_array_get(err, 1);
+		if (json_is_string(res))
+			return json_string_value(res);
+	}
+	return NULL;
+}
+
 /* Theoretically threads could race when modifying accepted and
  * rejected values but the chance of two submits completing at the
  * same time is zero so there is no point adding extra locking */
@@ -4244,6 +4512,10 @@ share_result(json_t *val, json_t *res, json_t *err, const struct work *work,
 		pool->diff_accepted += work->work_difficulty;
 		mutex_unlock(&stats_lock);
 
+		api_stats_changed();
+		if (api_event_wanted(API_EVENT_SHARE))
+			api_event_share(work, cgpu, true, NULL);
+
 		pool->seq_rejects = 0;
 		cgpu->last_share_pool = pool->pool_no;
 		cgpu->last_share_pool_time = time(NULL);
@@ -4297,6 +4569,10 @@ share_result(json_t *val, json_t *res, json_t *err, const struct work *work,
 		pool->seq_rejects++;
 		mutex_unlock(&stats_lock);
 
+		api_stats_changed();
+		if (api_event_wanted(API_EVENT_SHARE))
+			api_event_share(work, cgpu, false, share_reject_reason(val, res, err, work));
+
 		applog(LOG_DEBUG, "PROOF OF WORK RESULT: false (booooo)");
 		if (!QUIET) {
 			char where[20];
@@ -4418,6 +4694,7 @@ static bool submit_upstream_work_completed(struct work *work, bool resubmit, str
 
 	cgtime(&tv_submit_reply);
 	ts_submit_reply = time(NULL);
+	share_latency(work, sent_to_ack, ptv_submit, &tv_submit_reply);
 
 	if (unlikely(!val)) {
 		applog(LOG_INFO, "submit_upstream_work json_rpc_call failed");
@@ -5215,17 +5492,18 @@ static void roll_work(struct work *work)
 static void _copy_work(struct work *work, const struct work *base_work, int noffset)
 {
 	int id = work->id;
+	bytes_t nonce2;
 
-	clean_work(work);
+	clean_work_keep_nonce2(work);
+	nonce2 = work->nonce2;
 	memcpy(work, base_work, sizeof(struct work));
 	/* Keep the unique new id assigned during make_work to prevent copied
 	 * work from having the same id. */
 	work->id = id;
-	if (base_work->job_id)
-		work->job_id = strdup(base_work->job_id);
-	if (base_work->nonce1)
-		work->nonce1 = strdup(base_work->nonce1);
-	bytes_cpy(&work->nonce2, &base_work->nonce2);
+	refstr_ref(work->job_id);
+	refstr_ref(work->nonce1);
+	work->nonce2 = nonce2;
+	bytes_cat(&work->nonce2, &base_work->nonce2);
 
 	if (base_work->tr)
 		tmpl_incref(base_work->tr);
@@ -5282,10 +5560,7 @@ static bool clone_available(void)
 	bool cloned = false;
 
 	mutex_lock(stgd_lock);
-	if (!staged_rollable)
-		goto out_unlock;
-
-	HASH_ITER(hh, staged_work, work, tmp) {
+	DL_FOREACH_SAFE(staged_work[SL_ROLLABLE], work, tmp) {
 		if (can_roll(work) && should_roll(work)) {
 			roll_work(work);
 			work_clone = make_clone(work);
@@ -5295,8 +5570,6 @@ static bool clone_available(void)
 			break;
 		}
 	}
-
-out_unlock:
 	mutex_unlock(stgd_lock);
 
 	if (cloned) {
@@ -5489,6 +5762,7 @@ static void submit_discard_share2(const char *reason, struct work *work)
 	cgpu->diff_stale += work->work_difficulty;
 	work->pool->diff_stale += work->work_difficulty;
 	mutex_unlock(&stats_lock);
+	api_stats_changed();
 }
 
 static void submit_discard_share(struct work *work)
@@ -5504,19 +5778,57 @@ struct submit_work_state {
 	struct timeval tv_staleexpire;
 	char *s;
 	struct timeval tv_submit;
+	struct timeval tv_queued;
+	struct submit_work_state *prev;
 	struct submit_work_state *next;
+#ifdef USE_LIBEVENT
+	struct submit_loop *loop;
+	struct event *ev;
+	bool retried;
+#endif
 };
 
-static int my_curl_timer_set(__maybe_unused CURLM *curlm, long timeout_ms, void *userp)
+/* Finished submission states are kept here for reuse, like retired work */
+#define SWS_CACHE_MAX 0x100
+static pthread_mutex_t sws_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct submit_work_state *sws_cache;
+static int sws_cache_count;
+
+static struct submit_work_state *make_sws(void)
 {
-	long *p_timeout_us = userp;
-	
-	const long max_ms = LONG_MAX / 1000;
-	if (max_ms < timeout_ms)
-		timeout_ms = max_ms;
-	
-	*p_timeout_us = timeout_ms * 1000;
-	return 0;
+	struct submit_work_state *sws;
+
+	mutex_lock(&sws_cache_lock);
+	sws = sws_cache;
+	if (sws)
+	{
+		sws_cache = sws->next;
+		--sws_cache_count;
+	}
+	mutex_unlock(&sws_cache_lock);
+
+	if (!sws)
+	{
+		sws = malloc(sizeof(*sws));
+		if (unlikely(!sws))
+			quit(1, "Failed to malloc submit_work_state");
+	}
+	return sws;
+}
+
+static void release_sws(struct submit_work_state *sws)
+{
+	mutex_lock(&sws_cache_lock);
+	if (sws_cache_count < SWS_CACHE_MAX)
+	{
+		sws->next = sws_cache;
+		sws_cache = sws;
+		++sws_cache_count;
+		sws = NULL;
+	}
+	mutex_unlock(&sws_cache_lock);
+
+	free(sws);
 }
 
 static void sws_has_ce(struct submit_work_state *sws)
@@ -5524,6 +5836,7 @@ static void sws_has_ce(struct submit_work_state *sws)
 	struct pool *pool = sws->work->pool;
 	sws->s = submit_upstream_work_request(sws->work);
 	cgtime(&sws->tv_submit);
+	share_latency(sws->work, found_to_sent, &sws->work->tv_work_found, &sws->tv_submit);
 	json_rpc_call_async(sws->ce->curl, pool->rpc_url, pool->rpc_userpass, sws->s, false, pool, true, sws);
 }
 
@@ -5533,10 +5846,11 @@ static struct submit_work_state *begin_submission(struct work *work)
 	struct submit_work_state *sws = NULL;
 
 	pool = work->pool;
-	sws = malloc(sizeof(*sws));
+	sws = make_sws();
 	*sws = (struct submit_work_state){
 		.work = work,
 	};
+	cgtime(&sws->tv_queued);
 
 	rebuild_hash(work);
 
@@ -5554,13 +5868,7 @@ static struct submit_work_state *begin_submission(struct work *work)
 		timer_set_delay_from_now(&sws->tv_staleexpire, 300000000);
 	}
 
-	if (work->stratum) {
-		char *s;
-
-		s = malloc(1024);
-
-		sws->s = s;
-	} else {
+	if (!work->stratum) {
 		/* submit solution to bitcoin via JSON-RPC */
 		sws->ce = pop_curl_entry2(pool, false);
 		if (sws->ce) {
@@ -5578,7 +5886,7 @@ static struct submit_work_state *begin_submission(struct work *work)
 	return sws;
 
 out:
-	free(sws);
+	release_sws(sws);
 	return NULL;
 }
 
@@ -5627,90 +5935,540 @@ static bool retry_submission(struct submit_work_state *sws)
 static void free_sws(struct submit_work_state *sws)
 {
 	free(sws->s);
-	free_work(sws->work);
-	free(sws);
+	// Stratum submissions hand their work over to the stratum_share once sent
+	if (sws->work)
+		free_work(sws->work);
+	release_sws(sws);
 }
 
-static void *submit_work_thread(__maybe_unused void *userdata)
-{
-	int wip = 0;
+struct submit_loop {
 	CURLM *curlm;
-	long curlm_timeout_us = -1;
-	struct timeval curlm_timer;
-	struct submit_work_state *sws, **swsp;
-	struct submit_work_state *write_sws = NULL;
-	unsigned tsreduce = 0;
-
-	pthread_detach(pthread_self());
+	int wip;
+	unsigned tsreduce;
+	struct submit_work_state *write_sws;
+#ifdef USE_LIBEVENT
+	struct event_base *evbase;
+	struct event *ev_curl_timer;
+	struct event *ev_write_retry;
+#endif
+};
 
-	RenameThread("submit_work");
+#ifdef USE_LIBEVENT
+static void sws_arm_write(struct submit_loop *, struct submit_work_state *);
+static void submit_loop_rearm(struct submit_loop *);
+#endif
 
-	applog(LOG_DEBUG, "Creating extra submit work thread");
+static void submit_loop_add_write(struct submit_loop * const loop, struct submit_work_state * const sws)
+{
+	DL_APPEND(loop->write_sws, sws);
+#ifdef USE_LIBEVENT
+	sws->loop = loop;
+	sws_arm_write(loop, sws);
+#endif
+}
 
-	curlm = curl_multi_init();
-	curlm_timeout_us = -1;
-	curl_multi_setopt(curlm, CURLMOPT_TIMERDATA, &curlm_timeout_us);
-	curl_multi_setopt(curlm, CURLMOPT_TIMERFUNCTION, my_curl_timer_set);
+static void submit_loop_del_write(struct submit_loop * const loop, struct submit_work_state * const sws)
+{
+	DL_DELETE(loop->write_sws, sws);
+#ifdef USE_LIBEVENT
+	if (sws->ev)
+		event_free(sws->ev);
+#endif
+	free_sws(sws);
+	--loop->wip;
+}
 
-	fd_set rfds, wfds, efds;
-	int maxfd;
-	struct timeval tv_timeout, tv_now;
-	int n;
-	CURLMsg *cm;
-	FD_ZERO(&rfds);
-	while (1) {
-		mutex_lock(&submitting_lock);
-		total_submitting -= tsreduce;
-		tsreduce = 0;
-		if (FD_ISSET(submit_waiting_notifier[0], &rfds)) {
-			notifier_read(submit_waiting_notifier);
+// Must be called with submitting_lock held
+static void submit_loop_receive(struct submit_loop * const loop)
+{
+	struct submit_work_state *sws;
+	
+	while (submit_waiting) {
+		struct work *work = submit_waiting;
+		DL_DELETE(submit_waiting, work);
+		if ( (sws = begin_submission(work)) ) {
+			if (sws->ce)
+				curl_multi_add_handle(loop->curlm, sws->ce->curl);
+			else if (work->stratum)
+				submit_loop_add_write(loop, sws);
+			++loop->wip;
 		}
-		
-		// Receive any new submissions
-		while (submit_waiting) {
-			struct work *work = submit_waiting;
-			DL_DELETE(submit_waiting, work);
-			if ( (sws = begin_submission(work)) ) {
-				if (sws->ce)
-					curl_multi_add_handle(curlm, sws->ce->curl);
-				else if (sws->s) {
-					sws->next = write_sws;
-					write_sws = sws;
-				}
-				++wip;
-			}
-			else {
-				--total_submitting;
-				free_work(work);
-			}
+		else {
+			--total_submitting;
+			free_work(work);
 		}
-		
-		if (unlikely(shutting_down && !wip))
-			break;
-		mutex_unlock(&submitting_lock);
-		
-		FD_ZERO(&rfds);
-		FD_ZERO(&wfds);
-		FD_ZERO(&efds);
-		tv_timeout.tv_sec = -1;
-		
-		// Setup cURL with select
-		// Need to call perform to ensure the timeout gets updated
-		curl_multi_perform(curlm, &n);
-		curl_multi_fdset(curlm, &rfds, &wfds, &efds, &maxfd);
-		if (curlm_timeout_us >= 0)
+	}
+}
+
+// Returns the socket a stratum submission is waiting to write to, or INVSOCK if the pool is not ready for it
+static SOCKETTYPE sws_stratum_fd(const struct submit_work_state * const sws)
+{
+	struct pool * const pool = sws->work->pool;
+	if ((!pool->stratum_init) || !pool->stratum_notify)
+		return INVSOCK;
+	return pool->sock;
+}
+
+// Formats a stratum share and adds it to the stratum_shares db (taking its work); returns its id
+static int sws_stratum_prepare(struct submit_work_state * const sws, char * const s, const size_t sz, const struct timeval * const tvp_sent)
+{
+	struct work *work = sws->work;
+	struct pool *pool = work->pool;
+	struct stratum_share *sshare = make_stratum_share();
+	int sshare_id;
+	uint32_t nonce;
+	char nonce2hex[(bytes_len(&work->nonce2) * 2) + 1];
+	char noncehex[9];
+	char ntimehex[9];
+
+	bin2hex(nonce2hex, bytes_buf(&work->nonce2), bytes_len(&work->nonce2));
+	nonce = *((uint32_t *)(work->data + 76));
+	bin2hex(noncehex, (const unsigned char *)&nonce, 4);
+	bin2hex(ntimehex, (void *)&work->data[68], 4);
+
+	sshare->thr_id = work->thr_id;
+	sshare->tv_queued = sws->tv_queued;
+	sshare->tv_sent = *tvp_sent;
+	mutex_lock(&sshare_lock);
+	/* Give the stratum share a unique id */
+	sshare_id =
+	sshare->id = swork_id++;
+	snprintf(s, sz, "{\"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\": %d, \"method\": \"mining.submit\"}",
+		pool->rpc_user, work->job_id, nonce2hex, ntimehex, noncehex, sshare->id);
+	// The work itself moves to the stratum_shares db, rather than being copied
+	sshare->work = work;
+	sws->work = NULL;
+	HASH_ADD_INT(stratum_shares, id, sshare);
+	mutex_unlock(&sshare_lock);
+
+	applog(LOG_DEBUG, "DBG: sending %s submit RPC call: %s", pool->stratum_url, s);
+
+	return sshare_id;
+}
+
+// Takes the work back from an unsent stratum share; returns false if something else has consumed it already
+static bool sws_stratum_unsend(struct submit_work_state * const sws, const int sshare_id)
+{
+	struct stratum_share *sshare;
+
+	mutex_lock(&sshare_lock);
+	// NOTE: Need to find it again in case something else has consumed it already (like the stratum-disconnect resubmitter...)
+	HASH_FIND_INT(stratum_shares, &sshare_id, sshare);
+	if (sshare)
+		HASH_DEL(stratum_shares, sshare);
+	mutex_unlock(&sshare_lock);
+	if (!sshare)
+		return false;
+
+	// Take the work back for the retry
+	sws->work = sshare->work;
+	free_stratum_share(sshare);
+	return true;
+}
+
+/* Sends the shares waiting for a stratum pool, up to STRATUM_SUBMIT_BATCH
+ * at a time in a single write. If the socket can't take them yet, they stay
+ * queued until it is writable again. */
+static void submit_stratum_batch(struct submit_loop * const loop, struct pool * const pool)
+{
+	struct submit_work_state *sws, *tmp, *batch[STRATUM_SUBMIT_BATCH];
+	char s[STRATUM_SUBMIT_BATCH][1024];
+	const char *lines[STRATUM_SUBMIT_BATCH];
+	size_t lens[STRATUM_SUBMIT_BATCH];
+	int sshare_ids[STRATUM_SUBMIT_BATCH];
+	int thr_ids[STRATUM_SUBMIT_BATCH];
+	struct timeval tv_found[STRATUM_SUBMIT_BATCH], tv_sent;
+	int i, n = 0, rv;
+	char *nonce1;
+
+	cg_rlock(&pool->data_lock);
+	nonce1 = refstr_ref(pool->swork.nonce1);
+	cg_runlock(&pool->data_lock);
+
+	DL_FOREACH_SAFE(loop->write_sws, sws, tmp)
+	{
+		struct work * const work = sws->work;
+		if (work->pool != pool)
+			continue;
+
+		// NOTE: cgminer only does this check on retries, but BFGMiner does it for even the first/normal submit; therefore, it needs to be such that it always is true on the same connection regardless of session management
+		// NOTE: Worst case scenario for a false positive: the pool rejects it as H-not-zero
+		if (nonce1 && strcmp(work->nonce1, nonce1))
 		{
-			timer_set_delay_from_now(&curlm_timer, curlm_timeout_us);
-			reduce_timeout_to(&tv_timeout, &curlm_timer);
+			applog(LOG_DEBUG, "No matching session id for resubmitting stratum share");
+			submit_discard_share2("disconnect", work);
+			++loop->tsreduce;
+			submit_loop_del_write(loop, sws);
+			continue;
 		}
-		
-		// Setup waiting stratum submissions with select
-		for (sws = write_sws; sws; sws = sws->next)
-		{
-			struct pool *pool = sws->work->pool;
-			int fd = pool->sock;
-			if (fd == INVSOCK || (!pool->stratum_init) || !pool->stratum_notify)
-				continue;
+
+		if (!n)
+			cgtime(&tv_sent);
+		batch[n] = sws;
+		// The work may be gone as soon as it's in the stratum_shares db
+		thr_ids[n] = work->thr_id;
+		tv_found[n] = work->tv_work_found;
+		sshare_ids[n] = sws_stratum_prepare(sws, s[n], sizeof(s[n]), &tv_sent);
+		lines[n] = s[n];
+		lens[n] = strlen(s[n]);
+		if (++n == STRATUM_SUBMIT_BATCH)
+			break;
+	}
+	refstr_unref(nonce1);
+	if (!n)
+		return;
+
+	rv = stratum_send_lines(pool, lines, lens, n);
+	if (likely(rv > 0)) {
+		if (pool_tclear(pool, &pool->submit_fail))
+			applog(LOG_WARNING, "Pool %d communication resumed, submitting work", pool->pool_no);
+		applog(LOG_DEBUG, "Successfully submitted %d share(s), adding to stratum_shares db", n);
+		for (i = 0; i < n; ++i)
+		{
+			record_share_latency(pool, thr_ids[i], offsetof(struct share_latency_stats, found_to_sent), &tv_found[i], &tv_sent);
+			submit_loop_del_write(loop, batch[i]);
+		}
+		return;
+	}
+
+	// Undo stuff
+	for (i = 0; i < n; ++i)
+		if (!sws_stratum_unsend(batch[i], sshare_ids[i]))
+			submit_loop_del_write(loop, batch[i]);
+
+	if (rv < 0 && !pool_tset(pool, &pool->submit_fail))
+	{
+		applog(LOG_WARNING, "Pool %d stratum share submission failure", pool->pool_no);
+		total_ro++;
+		pool->remotefail_occasions++;
+	}
+}
+
+static void submit_loop_curl_check(struct submit_loop * const loop)
+{
+	struct submit_work_state *sws;
+	CURLMsg *cm;
+	int n;
+	
+	while( (cm = curl_multi_info_read(loop->curlm, &n)) ) {
+		if (cm->msg == CURLMSG_DONE)
+		{
+			bool finished;
+			json_t *val = json_rpc_call_completed(cm->easy_handle, cm->data.result, false, NULL, &sws);
+			curl_multi_remove_handle(loop->curlm, cm->easy_handle);
+			finished = submit_upstream_work_completed(sws->work, sws->resubmit, &sws->tv_submit, val);
+			if (!finished) {
+				if (retry_submission(sws))
+					curl_multi_add_handle(loop->curlm, sws->ce->curl);
+				else
+					finished = true;
+			}
+			
+			if (finished) {
+				--loop->wip;
+				++loop->tsreduce;
+				struct pool *pool = sws->work->pool;
+				if (pool->sws_waiting_on_curl) {
+					pool->sws_waiting_on_curl->ce = sws->ce;
+					sws_has_ce(pool->sws_waiting_on_curl);
+					pool->sws_waiting_on_curl = pool->sws_waiting_on_curl->next;
+					curl_multi_add_handle(loop->curlm, sws->ce->curl);
+				} else {
+					push_curl_entry(sws->ce, sws->work->pool);
+				}
+				free_sws(sws);
+			}
+		}
+	}
+}
+
+#ifdef USE_LIBEVENT
+/* The submit loop is driven by libevent: cURL reports the sockets it cares
+ * about through its socket API, and each waiting stratum share gets a one-shot
+ * write event, so only sockets with something to do wake the thread. */
+
+static const struct timeval tv_write_retry = {1, 0};
+
+static
+void submit_loop_sync(struct submit_loop * const loop)
+{
+	mutex_lock(&submitting_lock);
+	total_submitting -= loop->tsreduce;
+	loop->tsreduce = 0;
+	submit_loop_receive(loop);
+	if (unlikely(shutting_down && !loop->wip))
+		event_base_loopbreak(loop->evbase);
+	mutex_unlock(&submitting_lock);
+}
+
+static
+void submit_notified(__maybe_unused evutil_socket_t fd, __maybe_unused short what, void * const p)
+{
+	struct submit_loop * const loop = p;
+	notifier_read(submit_waiting_notifier);
+	submit_loop_sync(loop);
+}
+
+static
+void submit_curl_event(const evutil_socket_t fd, const short what, void * const p)
+{
+	struct submit_loop * const loop = p;
+	int action = 0, n;
+	
+	if (what & EV_READ)
+		action |= CURL_CSELECT_IN;
+	if (what & EV_WRITE)
+		action |= CURL_CSELECT_OUT;
+	curl_multi_socket_action(loop->curlm, fd, action, &n);
+	submit_loop_curl_check(loop);
+	submit_loop_sync(loop);
+}
+
+static
+void submit_curl_timeout(__maybe_unused evutil_socket_t fd, __maybe_unused short what, void * const p)
+{
+	struct submit_loop * const loop = p;
+	int n;
+	
+	curl_multi_socket_action(loop->curlm, CURL_SOCKET_TIMEOUT, 0, &n);
+	submit_loop_curl_check(loop);
+	submit_loop_sync(loop);
+}
+
+static
+int submit_curl_socket(__maybe_unused CURL *curl, const curl_socket_t s, const int what, void * const userp, void * const socketp)
+{
+	struct submit_loop * const loop = userp;
+	struct event *ev = socketp;
+	
+	if (ev)
+		event_free(ev);
+	if (what == CURL_POLL_REMOVE)
+		return 0;
+	
+	short events = EV_PERSIST;
+	if (what & CURL_POLL_IN)
+		events |= EV_READ;
+	if (what & CURL_POLL_OUT)
+		events |= EV_WRITE;
+	ev = event_new(loop->evbase, s, events, submit_curl_event, loop);
+	event_add(ev, NULL);
+	curl_multi_assign(loop->curlm, s, ev);
+	return 0;
+}
+
+static
+int submit_curl_timer_set(__maybe_unused CURLM *curlm, const long timeout_ms, void * const userp)
+{
+	struct submit_loop * const loop = userp;
+	
+	if (timeout_ms < 0)
+		evtimer_del(loop->ev_curl_timer);
+	else
+	{
+		const struct timeval tv = {
+			.tv_sec = timeout_ms / 1000,
+			.tv_usec = (timeout_ms % 1000) * 1000,
+		};
+		evtimer_add(loop->ev_curl_timer, &tv);
+	}
+	return 0;
+}
+
+static
+void submit_stratum_writable(const evutil_socket_t fd, __maybe_unused short what, void * const p)
+{
+	struct submit_work_state * const sws = p;
+	struct submit_loop * const loop = sws->loop;
+	
+	event_free(sws->ev);
+	sws->ev = NULL;
+	if (sws_stratum_fd(sws) == fd)
+		// This may finish with any number of waiting submissions, including this one
+		submit_stratum_batch(loop, sws->work->pool);
+	submit_loop_rearm(loop);
+	submit_loop_sync(loop);
+}
+
+static
+void sws_arm_write(struct submit_loop * const loop, struct submit_work_state * const sws)
+{
+	if (sws->ev)
+		return;
+	
+	const SOCKETTYPE fd = sws_stratum_fd(sws);
+	
+	if (fd != INVSOCK)
+	{
+		sws->ev = event_new(loop->evbase, fd, EV_WRITE, submit_stratum_writable, sws);
+		event_add(sws->ev, NULL);
+	}
+	// Pools reconnect without telling us, so always have a periodic look at waiting shares
+	if (!evtimer_pending(loop->ev_write_retry, NULL))
+		evtimer_add(loop->ev_write_retry, &tv_write_retry);
+}
+
+static
+void submit_loop_rearm(struct submit_loop * const loop)
+{
+	struct submit_work_state *sws;
+	
+	DL_FOREACH(loop->write_sws, sws)
+		sws_arm_write(loop, sws);
+}
+
+static
+void submit_write_retry(__maybe_unused evutil_socket_t fd, __maybe_unused short what, void * const p)
+{
+	struct submit_loop * const loop = p;
+	struct submit_work_state *sws, *tmp;
+	
+	DL_FOREACH(loop->write_sws, sws)
+	{
+		// TODO: Check if stale, possibly discard etc
+		if (sws->ev)
+		{
+			event_free(sws->ev);
+			sws->ev = NULL;
+		}
+		sws->retried = false;
+	}
+	
+	// Try each pool once directly, then go back to waiting for writability
+retry:
+	DL_FOREACH(loop->write_sws, sws)
+	{
+		if (sws->retried)
+			continue;
+		struct pool * const pool = sws->work->pool;
+		if (sws_stratum_fd(sws) != INVSOCK)
+			submit_stratum_batch(loop, pool);
+		DL_FOREACH(loop->write_sws, tmp)
+			if (tmp->work->pool == pool)
+			{
+				tmp->retried = true;
+				sws_arm_write(loop, tmp);
+			}
+		goto retry;
+	}
+	submit_loop_sync(loop);
+}
+
+static void *submit_work_thread(__maybe_unused void *userdata)
+{
+	struct submit_loop loop = {
+		.wip = 0,
+	};
+	struct event *ev_notifier;
+
+	pthread_detach(pthread_self());
+
+	RenameThread("submit_work");
+
+	applog(LOG_DEBUG, "Creating extra submit work thread");
+
+	loop.evbase = event_base_new();
+	if (unlikely(!loop.evbase))
+		quit(1, "Failed to create event_base for submit_work thread");
+	loop.ev_curl_timer = evtimer_new(loop.evbase, submit_curl_timeout, &loop);
+	loop.ev_write_retry = evtimer_new(loop.evbase, submit_write_retry, &loop);
+	ev_notifier = event_new(loop.evbase, submit_waiting_notifier[0], EV_READ | EV_PERSIST, submit_notified, &loop);
+	event_add(ev_notifier, NULL);
+
+	loop.curlm = curl_multi_init();
+	curl_multi_setopt(loop.curlm, CURLMOPT_SOCKETFUNCTION, submit_curl_socket);
+	curl_multi_setopt(loop.curlm, CURLMOPT_SOCKETDATA, &loop);
+	curl_multi_setopt(loop.curlm, CURLMOPT_TIMERFUNCTION, submit_curl_timer_set);
+	curl_multi_setopt(loop.curlm, CURLMOPT_TIMERDATA, &loop);
+
+	event_base_dispatch(loop.evbase);
+
+	assert(!loop.write_sws);
+
+	curl_multi_cleanup(loop.curlm);
+	event_free(ev_notifier);
+	event_free(loop.ev_write_retry);
+	event_free(loop.ev_curl_timer);
+	event_base_free(loop.evbase);
+
+	applog(LOG_DEBUG, "submit_work thread exiting");
+
+	return NULL;
+}
+#else
+static int my_curl_timer_set(__maybe_unused CURLM *curlm, long timeout_ms, void *userp)
+{
+	long *p_timeout_us = userp;
+	
+	const long max_ms = LONG_MAX / 1000;
+	if (max_ms < timeout_ms)
+		timeout_ms = max_ms;
+	
+	*p_timeout_us = timeout_ms * 1000;
+	return 0;
+}
+
+static void *submit_work_thread(__maybe_unused void *userdata)
+{
+	struct submit_loop loop = {
+		.wip = 0,
+	};
+	long curlm_timeout_us = -1;
+	struct timeval curlm_timer;
+	struct submit_work_state *sws, *tmp;
+
+	pthread_detach(pthread_self());
+
+	RenameThread("submit_work");
+
+	applog(LOG_DEBUG, "Creating extra submit work thread");
+
+	loop.curlm = curl_multi_init();
+	curlm_timeout_us = -1;
+	curl_multi_setopt(loop.curlm, CURLMOPT_TIMERDATA, &curlm_timeout_us);
+	curl_multi_setopt(loop.curlm, CURLMOPT_TIMERFUNCTION, my_curl_timer_set);
+
+	fd_set rfds, wfds, efds;
+	int maxfd;
+	struct timeval tv_timeout, tv_now;
+	int n;
+	FD_ZERO(&rfds);
+	while (1) {
+		mutex_lock(&submitting_lock);
+		total_submitting -= loop.tsreduce;
+		loop.tsreduce = 0;
+		if (FD_ISSET(submit_waiting_notifier[0], &rfds)) {
+			notifier_read(submit_waiting_notifier);
+		}
+		
+		// Receive any new submissions
+		submit_loop_receive(&loop);
+		
+		if (unlikely(shutting_down && !loop.wip))
+			break;
+		mutex_unlock(&submitting_lock);
+		
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		FD_ZERO(&efds);
+		tv_timeout.tv_sec = -1;
+		
+		// Setup cURL with select
+		// Need to call perform to ensure the timeout gets updated
+		curl_multi_perform(loop.curlm, &n);
+		curl_multi_fdset(loop.curlm, &rfds, &wfds, &efds, &maxfd);
+		if (curlm_timeout_us >= 0)
+		{
+			timer_set_delay_from_now(&curlm_timer, curlm_timeout_us);
+			reduce_timeout_to(&tv_timeout, &curlm_timer);
+		}
+		
+		// Setup waiting stratum submissions with select
+		DL_FOREACH(loop.write_sws, sws)
+		{
+			int fd = sws_stratum_fd(sws);
+			if (fd == INVSOCK)
+				continue;
 			FD_SET(fd, &wfds);
 			set_maxfd(&maxfd, fd);
 		}
@@ -5727,136 +6485,37 @@ static void *submit_work_thread(__maybe_unused void *userdata)
 		}
 		
 		// Handle any stratum ready-to-write results
-		for (swsp = &write_sws; (sws = *swsp); ) {
-			struct work *work = sws->work;
-			struct pool *pool = work->pool;
-			int fd = pool->sock;
-			bool sessionid_match;
+		for (sws = loop.write_sws; sws; ) {
+			int fd = sws_stratum_fd(sws);
 			
-			if (fd == INVSOCK || (!pool->stratum_init) || (!pool->stratum_notify) || !FD_ISSET(fd, &wfds)) {
-next_write_sws:
-				// TODO: Check if stale, possibly discard etc
-				swsp = &sws->next;
-				continue;
-			}
-			
-			cg_rlock(&pool->data_lock);
-			// NOTE: cgminer only does this check on retries, but BFGMiner does it for even the first/normal submit; therefore, it needs to be such that it always is true on the same connection regardless of session management
-			// NOTE: Worst case scenario for a false positive: the pool rejects it as H-not-zero
-			sessionid_match = (!pool->swork.nonce1) || !strcmp(work->nonce1, pool->swork.nonce1);
-			cg_runlock(&pool->data_lock);
-			if (!sessionid_match)
+			if (fd == INVSOCK || !FD_ISSET(fd, &wfds))
 			{
-				applog(LOG_DEBUG, "No matching session id for resubmitting stratum share");
-				submit_discard_share2("disconnect", work);
-				++tsreduce;
-next_write_sws_del:
-				// Clear the fd from wfds, to avoid potentially blocking on other submissions to the same socket
-				FD_CLR(fd, &wfds);
-				// Delete sws for this submission, since we're done with it
-				*swsp = sws->next;
-				free_sws(sws);
-				--wip;
+				// TODO: Check if stale, possibly discard etc
+				sws = sws->next;
 				continue;
 			}
 			
-			char *s = sws->s;
-			struct stratum_share *sshare = calloc(sizeof(struct stratum_share), 1);
-			int sshare_id;
-			uint32_t nonce;
-			char nonce2hex[(bytes_len(&work->nonce2) * 2) + 1];
-			char noncehex[9];
-			char ntimehex[9];
-			
-			sshare->work = copy_work(work);
-			bin2hex(nonce2hex, bytes_buf(&work->nonce2), bytes_len(&work->nonce2));
-			nonce = *((uint32_t *)(work->data + 76));
-			bin2hex(noncehex, (const unsigned char *)&nonce, 4);
-			bin2hex(ntimehex, (void *)&work->data[68], 4);
-			
-			mutex_lock(&sshare_lock);
-			/* Give the stratum share a unique id */
-			sshare_id =
-			sshare->id = swork_id++;
-			HASH_ADD_INT(stratum_shares, id, sshare);
-			snprintf(s, 1024, "{\"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\": %d, \"method\": \"mining.submit\"}",
-				pool->rpc_user, work->job_id, nonce2hex, ntimehex, noncehex, sshare->id);
-			mutex_unlock(&sshare_lock);
-			
-			applog(LOG_DEBUG, "DBG: sending %s submit RPC call: %s", pool->stratum_url, s);
-
-			if (likely(stratum_send(pool, s, strlen(s)))) {
-				if (pool_tclear(pool, &pool->submit_fail))
-					applog(LOG_WARNING, "Pool %d communication resumed, submitting work", pool->pool_no);
-				applog(LOG_DEBUG, "Successfully submitted, adding to stratum_shares db");
-				goto next_write_sws_del;
-			} else if (!pool_tset(pool, &pool->submit_fail)) {
-				// Undo stuff
-				mutex_lock(&sshare_lock);
-				// NOTE: Need to find it again in case something else has consumed it already (like the stratum-disconnect resubmitter...)
-				HASH_FIND_INT(stratum_shares, &sshare_id, sshare);
-				if (sshare)
-					HASH_DEL(stratum_shares, sshare);
-				mutex_unlock(&sshare_lock);
-				if (sshare)
-				{
-					free_work(sshare->work);
-					free(sshare);
-				}
-				
-				applog(LOG_WARNING, "Pool %d stratum share submission failure", pool->pool_no);
-				total_ro++;
-				pool->remotefail_occasions++;
-				
-				if (!sshare)
-					goto next_write_sws_del;
-				
-				goto next_write_sws;
-			}
+			submit_stratum_batch(&loop, sws->work->pool);
+			// Clear the fd from wfds, to avoid potentially blocking on other submissions to the same socket
+			FD_CLR(fd, &wfds);
+			// Any number of submissions may be gone now, so start over
+			sws = loop.write_sws;
 		}
 		
 		// Handle any cURL activities
-		curl_multi_perform(curlm, &n);
-		while( (cm = curl_multi_info_read(curlm, &n)) ) {
-			if (cm->msg == CURLMSG_DONE)
-			{
-				bool finished;
-				json_t *val = json_rpc_call_completed(cm->easy_handle, cm->data.result, false, NULL, &sws);
-				curl_multi_remove_handle(curlm, cm->easy_handle);
-				finished = submit_upstream_work_completed(sws->work, sws->resubmit, &sws->tv_submit, val);
-				if (!finished) {
-					if (retry_submission(sws))
-						curl_multi_add_handle(curlm, sws->ce->curl);
-					else
-						finished = true;
-				}
-				
-				if (finished) {
-					--wip;
-					++tsreduce;
-					struct pool *pool = sws->work->pool;
-					if (pool->sws_waiting_on_curl) {
-						pool->sws_waiting_on_curl->ce = sws->ce;
-						sws_has_ce(pool->sws_waiting_on_curl);
-						pool->sws_waiting_on_curl = pool->sws_waiting_on_curl->next;
-						curl_multi_add_handle(curlm, sws->ce->curl);
-					} else {
-						push_curl_entry(sws->ce, sws->work->pool);
-					}
-					free_sws(sws);
-				}
-			}
-		}
+		curl_multi_perform(loop.curlm, &n);
+		submit_loop_curl_check(&loop);
 	}
-	assert(!write_sws);
+	assert(!loop.write_sws);
 	mutex_unlock(&submitting_lock);
 
-	curl_multi_cleanup(curlm);
+	curl_multi_cleanup(loop.curlm);
 
 	applog(LOG_DEBUG, "submit_work thread exiting");
 
 	return NULL;
 }
+#endif
 
 /* Find the pool that currently has the highest priority */
 static struct pool *priority_pool(int choice)
@@ -6058,6 +6717,9 @@ void switch_pools(struct pool *selected)
 	if (pool != last_pool)
 	{
 		pool->block_id = 0;
+		api_stats_changed();
+		if (api_event_wanted(API_EVENT_POOL))
+			api_event_pool(pool);
 		if (pool_strategy != POOL_LOADBALANCE && pool_strategy != POOL_BALANCE) {
 			applog(LOG_WARNING, "Switching to pool %d %s", pool->pool_no, pool->rpc_url);
 			if (pool_localgen(pool) || opt_fail_only)
@@ -6099,14 +6761,15 @@ static void discard_stale(void)
 	int stale = 0;
 
 	mutex_lock(stgd_lock);
-	HASH_ITER(hh, staged_work, work, tmp) {
-		if (stale_work(work, false)) {
-			HASH_DEL(staged_work, work);
-			discard_work(work);
-			stale++;
-			staged_full = false;
+	for (int lane = 0; lane < SL_COUNT; ++lane)
+		DL_FOREACH_SAFE(staged_work[lane], work, tmp) {
+			if (stale_work(work, false)) {
+				__staged_del(work);
+				discard_work(work);
+				stale++;
+				staged_full = false;
+			}
 		}
-	}
 	pthread_cond_signal(&gws_cond);
 	mutex_unlock(stgd_lock);
 
@@ -6293,6 +6956,10 @@ static bool test_work_current(struct work *work)
 		template_nonce = 0;
 #endif
 		set_curblock(hexstr, &work->data[4]);
+		if (api_event_wanted(API_EVENT_BLOCK)) {
+			blkhashstr(hexstr, &work->data[4]);
+			api_event_block(work->pool, hexstr, current_diff);
+		}
 		if (unlikely(new_blocks == 1))
 			goto out_free;
 
@@ -6358,27 +7025,14 @@ out_free:
 	return ret;
 }
 
-static int tv_sort(struct work *worka, struct work *workb)
-{
-	return worka->tv_staged.tv_sec - workb->tv_staged.tv_sec;
-}
-
-static bool work_rollable(struct work *work)
-{
-	return (!work->clone && work->rolltime);
-}
-
 static bool hash_push(struct work *work)
 {
 	bool rc = true;
 
 	mutex_lock(stgd_lock);
-	if (work_rollable(work))
-		staged_rollable++;
-	if (likely(!getq->frozen)) {
-		HASH_ADD_INT(staged_work, id, work);
-		HASH_SORT(staged_work, tv_sort);
-	} else
+	if (likely(!getq->frozen))
+		__staged_add(work);
+	else
 		rc = false;
 	pthread_cond_broadcast(&getq->cond);
 	mutex_unlock(stgd_lock);
@@ -6464,9 +7118,12 @@ static void display_pool_summary(struct pool *pool)
  * still be work referencing it. We just remove it from the pools list */
 void remove_pool(struct pool *pool)
 {
-	int i, last_pool = total_pools - 1;
+	int i, last_pool;
 	struct pool *other;
 
+	cg_wlock(&control_lock);
+	last_pool = total_pools - 1;
+
 	/* Boost priority of any lower prio than this one */
 	for (i = 0; i < total_pools; i++) {
 		other = pools[i];
@@ -6484,6 +7141,7 @@ void remove_pool(struct pool *pool)
 	pool->removed = true;
 	pool->has_stratum = false;
 	total_pools--;
+	cg_wunlock(&control_lock);
 }
 
 /* add a mutex if this needs to be thread safe in the future */
@@ -6571,6 +7229,10 @@ void write_config(FILE *fcfg)
 		}
 		if (pool->rpc_proxy)
 			fprintf(fcfg, "\n\t\t\"pool-proxy\" : \"%s\",", json_escape(pool->rpc_proxy));
+#ifdef USE_SCRYPT
+		if (pool->scrypt_n_str)
+			fprintf(fcfg, "\n\t\t\"pool-scrypt-n\" : \"%s\",", json_escape(pool->scrypt_n_str));
+#endif
 		fprintf(fcfg, "\n\t\t\"user\" : \"%s\",", json_escape(pool->rpc_user));
 		fprintf(fcfg, "\n\t\t\"pass\" : \"%s\",", json_escape(pool->rpc_pass));
 		fprintf(fcfg, "\n\t\t\"pool-priority\" : \"%d\"", pool->prio);
@@ -6694,6 +7356,7 @@ void zero_stats(void)
 	
 	applog(LOG_DEBUG, "Zeroing stats");
 
+	fold_thr_stats();
 	cgtime(&total_tv_start);
 	miner_started = total_tv_start;
 	total_rolling = 0;
@@ -6758,6 +7421,11 @@ void zero_stats(void)
 		pool->cgminer_pool_stats.times_received = 0;
 		pool->cgminer_pool_stats.bytes_received = 0;
 		pool->cgminer_pool_stats.net_bytes_received = 0;
+		pool->cgminer_pool_stats.submit_acks = 0;
+		timerclear(&pool->cgminer_pool_stats.submit_latency);
+		timerclear(&pool->cgminer_pool_stats.submit_latency_max);
+		pool->cgminer_pool_stats.submit_latency_min.tv_sec = MIN_SEC_UNSET;
+		memset(&pool->latency, 0, sizeof(pool->latency));
 	}
 
 	zero_bestshare();
@@ -6796,6 +7464,10 @@ void zero_stats(void)
 		cgpu->cgminer_stats.getwork_wait_max.tv_sec = 0;
 		cgpu->cgminer_stats.getwork_wait_max.tv_usec = 0;
 		mutex_unlock(&hash_lock);
+
+		mutex_lock(&stats_lock);
+		memset(&cgpu->latency, 0, sizeof(cgpu->latency));
+		mutex_unlock(&stats_lock);
 	}
 }
 
@@ -7623,6 +8295,86 @@ void thread_reportout(struct thr_info *thr)
 	thr->getwork = time(NULL);
 }
 
+static double local_mhashes_done;
+
+/* Mining threads add their hashes, diff1 and hardware errors to their own
+ * stats_shard, which nothing else updates. These are only added to the
+ * device, pool and global totals when they are about to be shown: by
+ * hashmeter every log interval (which the watchdog also triggers for the TUI),
+ * by the API, and before zeroing or printing the summary. */
+static
+void thr_stats_shard_fold(struct thr_info * const thr)
+{
+	struct thr_stats_shard * const shard = &thr->stats_shard;
+	struct cgpu_info * const cgpu = thr->cgpu;
+	struct pool *pool;
+	int i;
+
+	if (unlikely(!cgpu))
+		return;
+
+	mutex_lock(&shard->lock);
+	total_mhashes_done += shard->mhashes;
+	local_mhashes_done += shard->mhashes;
+	cgpu->total_mhashes += shard->mhashes;
+	total_diff1 += shard->diff1;
+	cgpu->diff1 += shard->diff1;
+	hw_errors += shard->hw_errors;
+	cgpu->hw_errors += shard->hw_errors;
+	total_bad_diff1 += shard->bad_diff1;
+	cgpu->bad_diff1 += shard->bad_diff1;
+	for (i = 0; i < THR_STATS_POOLS && (pool = shard->pools[i].pool); ++i)
+		pool->diff1 += shard->pools[i].diff1;
+
+	shard->mhashes = shard->diff1 = shard->bad_diff1 = 0;
+	shard->hw_errors = 0;
+	memset(shard->pools, 0, sizeof(shard->pools));
+	mutex_unlock(&shard->lock);
+}
+
+// Caller must hold hash_lock
+static
+void fold_thr_stats_locked(void)
+{
+	int i;
+
+	mutex_lock(&stats_lock);
+	for (i = 0; i < mining_threads; ++i)
+		thr_stats_shard_fold(get_thread(i));
+	mutex_unlock(&stats_lock);
+}
+
+void fold_thr_stats(void)
+{
+	mutex_lock(&hash_lock);
+	fold_thr_stats_locked();
+	mutex_unlock(&hash_lock);
+}
+
+static
+void thr_stats_add_diff1(struct thr_info * const thr, struct pool * const pool, const double diff1)
+{
+	struct thr_stats_shard * const shard = &thr->stats_shard;
+	int i;
+
+	while (true)
+	{
+		mutex_lock(&shard->lock);
+		for (i = 0; i < THR_STATS_POOLS; ++i)
+			if (shard->pools[i].pool == pool || !shard->pools[i].pool)
+				break;
+		if (likely(i < THR_STATS_POOLS))
+			break;
+		// Mining for more pools than there are slots for; make room
+		mutex_unlock(&shard->lock);
+		fold_thr_stats();
+	}
+	shard->diff1 += diff1;
+	shard->pools[i].pool = pool;
+	shard->pools[i].diff1 += diff1;
+	mutex_unlock(&shard->lock);
+}
+
 static void hashmeter(int thr_id, struct timeval *diff,
 		      uint64_t hashes_done)
 {
@@ -7630,7 +8382,6 @@ static void hashmeter(int thr_id, struct timeval *diff,
 	struct timeval temp_tv_end, total_diff;
 	double secs;
 	double local_secs;
-	static double local_mhashes_done = 0;
 	double local_mhashes = (double)hashes_done / 1000000.0;
 	bool showlog = false;
 	char cHr[h2bs_fmt_size[H2B_NOUNIT]], aHr[h2bs_fmt_size[H2B_NOUNIT]], uHr[h2bs_fmt_size[H2B_SPACED]];
@@ -7662,10 +8413,16 @@ static void hashmeter(int thr_id, struct timeval *diff,
 		for (i = 0; i < threadobj; i++)
 			thread_rolling += cgpu->thr[i]->rolling;
 
-		mutex_lock(&hash_lock);
+		mutex_lock(&thr->stats_shard.lock);
+		thr->stats_shard.mhashes += local_mhashes;
+		mutex_unlock(&thr->stats_shard.lock);
+
+		// With only one thread, nothing else updates the device's rolling average
+		if (threadobj > 1)
+			mutex_lock(&hash_lock);
 		decay_time(&cgpu->rolling, thread_rolling, secs);
-		cgpu->total_mhashes += local_mhashes;
-		mutex_unlock(&hash_lock);
+		if (threadobj > 1)
+			mutex_unlock(&hash_lock);
 
 		// If needed, output detailed, per-device stats
 		if (want_per_device_stats) {
@@ -7691,18 +8448,31 @@ static void hashmeter(int thr_id, struct timeval *diff,
 		}
 	}
 
-	/* Totals are updated by all threads so can race without locking */
-	mutex_lock(&hash_lock);
+	/* Only update with opt_log_interval. The unlocked check is just a hint
+	 * to avoid hash_lock in between; if another mining thread is already
+	 * updating, there's nothing for this one to do. */
 	cgtime(&temp_tv_end);
+	if (thr_id >= 0)
+	{
+		if (temp_tv_end.tv_sec - total_tv_end.tv_sec < opt_log_interval)
+			return;
+		if (mutex_trylock(&hash_lock))
+			return;
+	}
+	else
+		mutex_lock(&hash_lock);
 	timersub(&temp_tv_end, &total_tv_end, &total_diff);
 
-	total_mhashes_done += local_mhashes;
-	local_mhashes_done += local_mhashes;
-	/* Only update with opt_log_interval */
+	if (thr_id < 0)
+	{
+		total_mhashes_done += local_mhashes;
+		local_mhashes_done += local_mhashes;
+	}
 	if (total_diff.tv_sec < opt_log_interval)
 		goto out_unlock;
 	showlog = true;
 	cgtime(&total_tv_end);
+	fold_thr_stats_locked();
 
 	local_secs = (double)total_diff.tv_sec + ((double)total_diff.tv_usec / 1000000.0);
 	decay_time(&total_rolling, local_mhashes_done / local_secs, local_secs);
@@ -7712,6 +8482,10 @@ static void hashmeter(int thr_id, struct timeval *diff,
 	total_secs = (double)total_diff.tv_sec +
 		((double)total_diff.tv_usec / 1000000.0);
 
+	api_stats_changed();
+	if (api_event_wanted(API_EVENT_HASHRATE))
+		api_event_hashrate();
+
 	double wtotal = (total_diff_accepted + total_diff_rejected + total_diff_stale);
 	
 	multi_format_unit_array2(
@@ -7863,6 +8637,27 @@ static void stratum_share_result(json_t *val, json_t *res_val, json_t *err_val,
 	share_result(val, res_val, err_val, work, false, "");
 }
 
+// Records how long a share took from being queued for the pool until its response
+static void stratum_share_latency(struct pool * const pool, const struct stratum_share * const sshare)
+{
+	struct cgminer_pool_stats * const pool_stats = &pool->cgminer_pool_stats;
+	struct timeval tv_now, tv_latency;
+
+	cgtime(&tv_now);
+	timersub(&tv_now, &sshare->tv_queued, &tv_latency);
+
+	mutex_lock(&stats_lock);
+	timeradd(&tv_latency, &pool_stats->submit_latency, &pool_stats->submit_latency);
+	if (timercmp(&tv_latency, &pool_stats->submit_latency_max, >))
+		pool_stats->submit_latency_max = tv_latency;
+	if (timercmp(&tv_latency, &pool_stats->submit_latency_min, <))
+		pool_stats->submit_latency_min = tv_latency;
+	++pool_stats->submit_acks;
+	mutex_unlock(&stats_lock);
+
+	record_share_latency(pool, sshare->thr_id, offsetof(struct share_latency_stats, sent_to_ack), &sshare->tv_sent, &tv_now);
+}
+
 /* Parses stratum json responses and tries to find the id that the request
  * matched to and treat it accordingly. */
 bool parse_stratum_response(struct pool *pool, char *s)
@@ -7979,9 +8774,10 @@ fishy:
 		--total_submitting;
 		mutex_unlock(&submitting_lock);
 	}
+	stratum_share_latency(pool, sshare);
 	stratum_share_result(val, res_val, err_val, sshare);
 	free_work(sshare->work);
-	free(sshare);
+	free_stratum_share(sshare);
 
 	ret = true;
 out:
@@ -8034,7 +8830,7 @@ void clear_stratum_shares(struct pool *pool)
 			thr_diff_cleared[work->thr_id] += work->work_difficulty;
 			++thr_cleared[work->thr_id];
 			free_work(sshare->work);
-			free(sshare);
+			free_stratum_share(sshare);
 			cleared++;
 		}
 	}
@@ -8079,7 +8875,7 @@ static void resubmit_stratum_shares(struct pool *pool)
 		work = sshare->work;
 		DL_APPEND(submit_waiting, work);
 		
-		free(sshare);
+		free_stratum_share(sshare);
 		++resubmitted;
 	}
 	mutex_unlock(&submitting_lock);
@@ -8097,14 +8893,15 @@ static void clear_pool_work(struct pool *pool)
 	int cleared = 0;
 
 	mutex_lock(stgd_lock);
-	HASH_ITER(hh, staged_work, work, tmp) {
-		if (work->pool == pool) {
-			HASH_DEL(staged_work, work);
-			free_work(work);
-			cleared++;
-			staged_full = false;
+	for (int lane = 0; lane < SL_COUNT; ++lane)
+		DL_FOREACH_SAFE(staged_work[lane], work, tmp) {
+			if (work->pool == pool) {
+				__staged_del(work);
+				free_work(work);
+				cleared++;
+				staged_full = false;
+			}
 		}
-	}
 	mutex_unlock(stgd_lock);
 }
 
@@ -8192,6 +8989,359 @@ static bool supports_resume(struct pool *pool)
 	return ret;
 }
 
+/* Check to see whether we need to maintain this connection indefinitely or
+ * just bring it up when we switch to this pool. Returns false if the pool has
+ * been removed while waiting to reconnect. */
+static bool stratum_ensure_connected(struct pool *pool)
+{
+	int sock;
+
+	while (true)
+	{
+		sock = pool->sock;
+
+		if (sock == INVSOCK)
+			applog(LOG_DEBUG, "Pool %u: Invalid socket, suspending",
+			       pool->pool_no);
+		else
+		if (!sock_full(pool) && !cnx_needed(pool))
+			applog(LOG_DEBUG, "Pool %u: Connection not needed, suspending",
+			       pool->pool_no);
+		else
+			return true;
+
+		suspend_stratum(pool);
+		clear_stratum_shares(pool);
+		clear_pool_work(pool);
+
+		wait_lpcurrent(pool);
+		if (!restart_stratum(pool)) {
+			pool_died(pool);
+			while (!restart_stratum(pool)) {
+				if (pool->removed)
+					return false;
+				cgsleep_ms(30000);
+			}
+		}
+	}
+}
+
+/* Returns true if the connection was restarted; otherwise the pool is dead */
+static bool stratum_connection_lost(struct pool *pool)
+{
+	applog(LOG_NOTICE, "Stratum connection to pool %d interrupted", pool->pool_no);
+	pool->getfail_occasions++;
+	total_go++;
+
+	mutex_lock(&pool->stratum_lock);
+	pool->stratum_active = pool->stratum_notify = false;
+	pool->sock = INVSOCK;
+	mutex_unlock(&pool->stratum_lock);
+
+	/* If the socket to our stratum pool disconnects, all
+	 * submissions need to be discarded or resent. */
+	if (!supports_resume(pool))
+		clear_stratum_shares(pool);
+	else
+		resubmit_stratum_shares(pool);
+	clear_pool_work(pool);
+	if (pool == current_pool())
+		restart_threads();
+
+	if (restart_stratum(pool))
+		return true;
+
+	shutdown_stratum(pool);
+	pool_died(pool);
+	return false;
+}
+
+static void stratum_process_line(struct pool *pool, char *s)
+{
+	/* Check this pool hasn't died while being a backup pool and
+	 * has not had its idle flag cleared */
+	stratum_resumed(pool);
+
+	if (!parse_method(pool, s) && !parse_stratum_response(pool, s))
+		applog(LOG_INFO, "Unknown stratum msg: %s", s);
+	free(s);
+	if (pool->swork.clean) {
+		struct work *work = make_work();
+
+		/* Generate a single work item to update the current
+		 * block database */
+		pool->swork.clean = false;
+		gen_stratum_work(pool, work);
+
+		/* Try to extract block height from coinbase scriptSig */
+		uint8_t *bin_height = &bytes_buf(&pool->swork.coinbase)[4 /*version*/ + 1 /*txin count*/ + 36 /*prevout*/ + 1 /*scriptSig len*/ + 1 /*push opcode*/];
+		unsigned char cb_height_sz;
+		cb_height_sz = bin_height[-1];
+		if (cb_height_sz == 3) {
+			// FIXME: The block number will overflow this by AD 2173
+			uint32_t block_id = ((uint32_t*)work->data)[1];
+			uint32_t height = 0;
+			memcpy(&height, bin_height, 3);
+			height = le32toh(height);
+			have_block_height(block_id, height);
+		}
+
+		pool->swork.work_restart_id =
+		++pool->work_restart_id;
+		if (test_work_current(work)) {
+			/* Only accept a work update if this stratum
+			 * connection is from the current pool */
+			if (pool == current_pool()) {
+				restart_threads();
+				applog(
+				       (opt_quiet_work_updates ? LOG_DEBUG : LOG_NOTICE),
+				       "Stratum from pool %d requested work update", pool->pool_no);
+			}
+		} else
+			applog(LOG_NOTICE, "Stratum from pool %d detected new block", pool->pool_no);
+		free_work(work);
+	}
+
+	if (timer_passed(&pool->swork.tv_transparency, NULL)) {
+		// More than 4 timmills past since requested transactions
+		timer_unset(&pool->swork.tv_transparency);
+		pool_set_opaque(pool, true);
+	}
+}
+
+#ifdef USE_LIBEVENT
+/* Established stratum connections are all read by a single thread running a
+ * libevent loop. Whenever a connection needs (re)establishing or suspending,
+ * it is handed off to a short-lived thread for the pool, which does the
+ * blocking work and then gives the connection back to the loop. */
+
+static struct event_base *stratum_evbase;
+static notifier_t stratum_evloop_notifier;
+static pthread_mutex_t stratum_evloop_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pool *stratum_evloop_pending;
+static pthread_t stratum_evloop_pth;
+
+static void *stratum_manage_thread(void *userdata);
+
+static
+void stratum_evloop_release(struct pool * const pool, const bool lost)
+{
+	event_free(pool->stratum_ev);
+	pool->stratum_ev = NULL;
+
+	if (lost && !pool->has_stratum)
+		return;
+
+	pool->stratum_ev_lost = lost;
+	if (unlikely(pthread_create(&pool->stratum_thread, NULL, stratum_manage_thread, (void *)pool)))
+		quit(1, "Failed to create stratum thread");
+}
+
+static
+void stratum_evloop_read(evutil_socket_t, short, void *);
+
+static
+void stratum_evloop_listen(struct pool * const pool)
+{
+	static const struct timeval tv_timeout = {120, 0};
+
+	pool->stratum_ev = event_new(stratum_evbase, pool->sock, EV_READ | EV_PERSIST, stratum_evloop_read, pool);
+	event_add(pool->stratum_ev, &tv_timeout);
+}
+
+/* Checks whether a watched pool needs to leave the loop, or its socket has
+ * been replaced since the event was set up. Returns false if the pool is no
+ * longer watched. */
+static
+bool stratum_evloop_check(struct pool * const pool)
+{
+	if (unlikely(!pool->has_stratum))
+	{
+		event_free(pool->stratum_ev);
+		pool->stratum_ev = NULL;
+		return false;
+	}
+	if (pool->sock == INVSOCK)
+	{
+		stratum_evloop_release(pool, true);
+		return false;
+	}
+	if (pool->stratum_reconnect || (!sock_full(pool) && !cnx_needed(pool)))
+	{
+		stratum_evloop_release(pool, false);
+		return false;
+	}
+	if (pool->sock != event_get_fd(pool->stratum_ev))
+	{
+		event_free(pool->stratum_ev);
+		stratum_evloop_listen(pool);
+	}
+	return true;
+}
+
+static
+void stratum_evloop_read(__maybe_unused evutil_socket_t fd, const short what, void * const p)
+{
+	struct pool * const pool = p;
+	bool ok;
+	char *s;
+
+	if (what & EV_TIMEOUT)
+	{
+		/* If we fail to receive any notify messages for 2 minutes we
+		 * assume the connection has been dropped and treat this pool
+		 * as dead */
+		applog(LOG_DEBUG, "Stratum connection to pool %d timed out", pool->pool_no);
+		ok = false;
+	}
+	else
+		ok = recv_available(pool);
+
+	while ( (s = recv_line_buffered(pool)) )
+		stratum_process_line(pool, s);
+
+	if (!ok)
+		stratum_evloop_release(pool, true);
+	else
+		stratum_evloop_check(pool);
+}
+
+static
+void stratum_evloop_watch(struct pool * const pool)
+{
+	char *s;
+
+	// Anything already buffered during setup won't trigger a read event
+	while ( (s = recv_line_buffered(pool)) )
+		stratum_process_line(pool, s);
+
+	stratum_evloop_listen(pool);
+	stratum_evloop_check(pool);
+}
+
+static
+void stratum_evloop_notified(__maybe_unused evutil_socket_t fd, __maybe_unused short what, __maybe_unused void *p)
+{
+	struct pool *pool;
+	bool add;
+
+	notifier_read(stratum_evloop_notifier);
+	mutex_lock(&stratum_evloop_lock);
+	while ( (pool = stratum_evloop_pending) )
+	{
+		stratum_evloop_pending = pool->stratum_ev_next;
+		pool->stratum_ev_queued = false;
+		add = pool->stratum_ev_add;
+		pool->stratum_ev_add = false;
+		mutex_unlock(&stratum_evloop_lock);
+		if (add)
+			stratum_evloop_watch(pool);
+		else
+		// Otherwise its socket changed; if it isn't watched, its stratum thread has it
+		if (pool->stratum_ev)
+			stratum_evloop_check(pool);
+		mutex_lock(&stratum_evloop_lock);
+	}
+	mutex_unlock(&stratum_evloop_lock);
+}
+
+static void *stratum_evloop_thread(__maybe_unused void *userdata)
+{
+	struct event *ev_notifier;
+
+	pthread_detach(pthread_self());
+	RenameThread("stratum");
+
+	ev_notifier = event_new(stratum_evbase, stratum_evloop_notifier[0], EV_READ | EV_PERSIST, stratum_evloop_notified, NULL);
+	event_add(ev_notifier, NULL);
+	event_base_dispatch(stratum_evbase);
+
+	return NULL;
+}
+
+static
+void stratum_evloop_queue(struct pool * const pool, const bool add)
+{
+	mutex_lock(&stratum_evloop_lock);
+	if (!stratum_evbase)
+	{
+		if (!add)
+		{
+			// Nothing is watched yet
+			mutex_unlock(&stratum_evloop_lock);
+			return;
+		}
+		stratum_evbase = event_base_new();
+		if (unlikely(!stratum_evbase))
+			quit(1, "Failed to create stratum event_base");
+		notifier_init(stratum_evloop_notifier);
+		if (unlikely(pthread_create(&stratum_evloop_pth, NULL, stratum_evloop_thread, NULL)))
+			quit(1, "Failed to create stratum event loop thread");
+	}
+	if (add)
+		pool->stratum_ev_add = true;
+	if (!pool->stratum_ev_queued)
+	{
+		pool->stratum_ev_queued = true;
+		pool->stratum_ev_next = stratum_evloop_pending;
+		stratum_evloop_pending = pool;
+	}
+	mutex_unlock(&stratum_evloop_lock);
+	notifier_wake(stratum_evloop_notifier);
+}
+
+// Hands a connected pool over to the stratum event loop
+static
+void stratum_evloop_add(struct pool * const pool)
+{
+	stratum_evloop_queue(pool, true);
+}
+
+// Called whenever pool->sock is replaced, so the loop stops watching the old one
+void stratum_evloop_sock_changed(struct pool * const pool)
+{
+	stratum_evloop_queue(pool, false);
+}
+
+static void *stratum_manage_thread(void *userdata)
+{
+	struct pool *pool = (struct pool *)userdata;
+
+	pthread_detach(pthread_self());
+
+	char threadname[20];
+	snprintf(threadname, 20, "stratum%u", pool->pool_no);
+	RenameThread(threadname);
+
+	srand(time(NULL) + (intptr_t)userdata);
+
+	if (pool->stratum_reconnect)
+	{
+		// A failed reconnect leaves no socket, which is dealt with below
+		pool->stratum_reconnect = false;
+		pool->stratum_ev_lost = false;
+		restart_stratum(pool);
+	}
+	if (pool->stratum_ev_lost && !stratum_connection_lost(pool))
+		return NULL;
+	if (unlikely(!pool->has_stratum))
+		return NULL;
+	if (!stratum_ensure_connected(pool))
+		return NULL;
+
+	stratum_evloop_add(pool);
+	return NULL;
+}
+
+static void init_stratum_thread(struct pool *pool)
+{
+	have_longpoll = true;
+
+	pool->stratum_ev_lost = false;
+	if (unlikely(pthread_create(&pool->stratum_thread, NULL, stratum_manage_thread, (void *)pool)))
+		quit(1, "Failed to create stratum thread");
+}
+#else
 /* One stratum thread per pool that has stratum waits on the socket checking
  * for new messages and for the integrity of the socket connection. We reset
  * the connection based on the integrity of the receive side only as the send
@@ -8218,37 +9368,9 @@ static void *stratum_thread(void *userdata)
 		if (unlikely(!pool->has_stratum))
 			break;
 
-		/* Check to see whether we need to maintain this connection
-		 * indefinitely or just bring it up when we switch to this
-		 * pool */
-		while (true)
-		{
-			sock = pool->sock;
-			
-			if (sock == INVSOCK)
-				applog(LOG_DEBUG, "Pool %u: Invalid socket, suspending",
-				       pool->pool_no);
-			else
-			if (!sock_full(pool) && !cnx_needed(pool))
-				applog(LOG_DEBUG, "Pool %u: Connection not needed, suspending",
-				       pool->pool_no);
-			else
-				break;
-			
-			suspend_stratum(pool);
-			clear_stratum_shares(pool);
-			clear_pool_work(pool);
-
-			wait_lpcurrent(pool);
-			if (!restart_stratum(pool)) {
-				pool_died(pool);
-				while (!restart_stratum(pool)) {
-					if (pool->removed)
-						goto out;
-					cgsleep_ms(30000);
-				}
-			}
-		}
+		if (!stratum_ensure_connected(pool))
+			break;
+		sock = pool->sock;
 
 		FD_ZERO(&rd);
 		FD_SET(sock, &rd);
@@ -8267,85 +9389,14 @@ static void *stratum_thread(void *userdata)
 			if (!pool->has_stratum)
 				break;
 
-			applog(LOG_NOTICE, "Stratum connection to pool %d interrupted", pool->pool_no);
-			pool->getfail_occasions++;
-			total_go++;
-
-			mutex_lock(&pool->stratum_lock);
-			pool->stratum_active = pool->stratum_notify = false;
-			pool->sock = INVSOCK;
-			mutex_unlock(&pool->stratum_lock);
-
-			/* If the socket to our stratum pool disconnects, all
-			 * submissions need to be discarded or resent. */
-			if (!supports_resume(pool))
-				clear_stratum_shares(pool);
-			else
-				resubmit_stratum_shares(pool);
-			clear_pool_work(pool);
-			if (pool == current_pool())
-				restart_threads();
-
-			if (restart_stratum(pool))
+			if (stratum_connection_lost(pool))
 				continue;
-
-			shutdown_stratum(pool);
-			pool_died(pool);
 			break;
 		}
 
-		/* Check this pool hasn't died while being a backup pool and
-		 * has not had its idle flag cleared */
-		stratum_resumed(pool);
-
-		if (!parse_method(pool, s) && !parse_stratum_response(pool, s))
-			applog(LOG_INFO, "Unknown stratum msg: %s", s);
-		free(s);
-		if (pool->swork.clean) {
-			struct work *work = make_work();
-
-			/* Generate a single work item to update the current
-			 * block database */
-			pool->swork.clean = false;
-			gen_stratum_work(pool, work);
-
-			/* Try to extract block height from coinbase scriptSig */
-			uint8_t *bin_height = &bytes_buf(&pool->swork.coinbase)[4 /*version*/ + 1 /*txin count*/ + 36 /*prevout*/ + 1 /*scriptSig len*/ + 1 /*push opcode*/];
-			unsigned char cb_height_sz;
-			cb_height_sz = bin_height[-1];
-			if (cb_height_sz == 3) {
-				// FIXME: The block number will overflow this by AD 2173
-				uint32_t block_id = ((uint32_t*)work->data)[1];
-				uint32_t height = 0;
-				memcpy(&height, bin_height, 3);
-				height = le32toh(height);
-				have_block_height(block_id, height);
-			}
-
-			pool->swork.work_restart_id =
-			++pool->work_restart_id;
-			if (test_work_current(work)) {
-				/* Only accept a work update if this stratum
-				 * connection is from the current pool */
-				if (pool == current_pool()) {
-					restart_threads();
-					applog(
-					       (opt_quiet_work_updates ? LOG_DEBUG : LOG_NOTICE),
-					       "Stratum from pool %d requested work update", pool->pool_no);
-				}
-			} else
-				applog(LOG_NOTICE, "Stratum from pool %d detected new block", pool->pool_no);
-			free_work(work);
-		}
-
-		if (timer_passed(&pool->swork.tv_transparency, NULL)) {
-			// More than 4 timmills past since requested transactions
-			timer_unset(&pool->swork.tv_transparency);
-			pool_set_opaque(pool, true);
-		}
+		stratum_process_line(pool, s);
 	}
 
-out:
 	return NULL;
 }
 
@@ -8356,6 +9407,7 @@ static void init_stratum_thread(struct pool *pool)
 	if (unlikely(pthread_create(&pool->stratum_thread, NULL, stratum_thread, (void *)pool)))
 		quit(1, "Failed to create stratum thread");
 }
+#endif
 
 static void *longpoll_thread(void *userdata);
 
@@ -8569,13 +9621,12 @@ static void pool_resus(struct pool *pool)
 
 static struct work *hash_pop(void)
 {
-	struct work *work = NULL, *tmp;
-	int hc;
+	struct work *work = NULL;
 	struct timespec ts;
 
 retry:
 	mutex_lock(stgd_lock);
-	while (!HASH_COUNT(staged_work))
+	while (!__total_staged())
 	{
 		if (unlikely(staged_full))
 		{
@@ -8601,15 +9652,8 @@ retry:
 	
 	no_work = false;
 
-	hc = HASH_COUNT(staged_work);
 	/* Find clone work if possible, to allow masters to be reused */
-	if (hc > staged_rollable) {
-		HASH_ITER(hh, staged_work, work, tmp) {
-			if (!work_rollable(work))
-				break;
-		}
-	} else
-		work = staged_work;
+	work = staged_work[SL_FIXED] ?: staged_work[SL_ROLLABLE];
 	
 	if (can_roll(work) && should_roll(work))
 	{
@@ -8619,9 +9663,7 @@ retry:
 		goto retry;
 	}
 	
-	HASH_DEL(staged_work, work);
-	if (work_rollable(work))
-		staged_rollable--;
+	__staged_del(work);
 
 	/* Signal the getwork scheduler to look for more work */
 	pthread_cond_signal(&gws_cond);
@@ -8728,8 +9770,8 @@ void stratum_work_cpy(struct stratum_work * const dst, const struct stratum_work
 	*dst = *src;
 	if (dst->tr)
 		tmpl_incref(dst->tr);
-	dst->nonce1 = maybe_strdup(src->nonce1);
-	dst->job_id = maybe_strdup(src->job_id);
+	refstr_ref(dst->nonce1);
+	refstr_ref(dst->job_id);
 	bytes_cpy(&dst->coinbase, &src->coinbase);
 	bytes_cpy(&dst->merkle_bin, &src->merkle_bin);
 	
@@ -8741,8 +9783,8 @@ void stratum_work_clean(struct stratum_work * const swork)
 {
 	if (swork->tr)
 		tmpl_decref(swork->tr);
-	free(swork->nonce1);
-	free(swork->job_id);
+	refstr_unref(swork->nonce1);
+	refstr_unref(swork->job_id);
 	bytes_free(&swork->coinbase);
 	bytes_free(&swork->merkle_bin);
 }
@@ -8764,101 +9806,286 @@ bool pool_has_usable_swork(const struct pool * const pool)
 /* Generates stratum based work based on the most recent notify information
  * from the pool. This will keep generating work while a pool is down so we use
  * other means to detect when the pool has died in stratum_thread */
-static void gen_stratum_work(struct pool *pool, struct work *work)
+static void gen_stratum_works(struct pool * const pool, struct work ** const works, const int n)
 {
-	clean_work(work);
+	struct work *work;
+	int i;
+	
+	for (i = 0; i < n; ++i)
+		clean_work_keep_nonce2(works[i]);
 	
 	cg_wlock(&pool->data_lock);
 	
 	const int n2size = pool->swork.n2size;
-	bytes_resize(&work->nonce2, n2size);
-	if (pool->nonce2sz < n2size)
-		memset(&bytes_buf(&work->nonce2)[pool->nonce2sz], 0, n2size - pool->nonce2sz);
-	memcpy(bytes_buf(&work->nonce2),
+	for (i = 0; i < n; ++i)
+	{
+		work = works[i];
+		bytes_resize(&work->nonce2, n2size);
+		if (pool->nonce2sz < n2size)
+			memset(&bytes_buf(&work->nonce2)[pool->nonce2sz], 0, n2size - pool->nonce2sz);
+		memcpy(bytes_buf(&work->nonce2),
 #ifdef WORDS_BIGENDIAN
-	// NOTE: On big endian, the most significant bits are stored at the end, so skip the LSBs
-	       &((char*)&pool->nonce2)[pool->nonce2off],
+		// NOTE: On big endian, the most significant bits are stored at the end, so skip the LSBs
+		       &((char*)&pool->nonce2)[pool->nonce2off],
 #else
-	       &pool->nonce2,
+		       &pool->nonce2,
 #endif
-	       pool->nonce2sz);
-	pool->nonce2++;
+		       pool->nonce2sz);
+		pool->nonce2++;
+		
+		work->pool = pool;
+		work->work_restart_id = pool->swork.work_restart_id;
+	}
+	gen_stratum_works2(works, n, &pool->swork);
 	
-	work->pool = pool;
-	work->work_restart_id = pool->swork.work_restart_id;
-	gen_stratum_work2(work, &pool->swork);
+	for (i = 0; i < n; ++i)
+		cgtime(&works[i]->tv_staged);
+}
+
+static void gen_stratum_work(struct pool *pool, struct work *work)
+{
+	gen_stratum_works(pool, &work, 1);
+}
+
+static
+void stratum_work_hash_coinbases(struct stratum_work * const swork, struct work ** const works, const int n, unsigned char (* const out_hash)[32])
+{
+	const uint8_t * const coinbase = bytes_buf(&swork->coinbase);
+	const size_t n2len = bytes_len(&works[0]->nonce2);
+	const size_t suffix_offset = swork->nonce2_offset + n2len;
+	const unsigned char *nonce2s[n];
+	unsigned char *digests[n];
+	int i;
 	
-	cgtime(&work->tv_staged);
+	/* Only the part of the coinbase before nonce2 is constant for the job, so
+	 * its SHA-256 state is computed once and reused for every nonce2 */
+	if (unlikely(!swork->coinbase_prefix_valid))
+	{
+		sha256_init(&swork->coinbase_prefix_ctx);
+		sha256_update(&swork->coinbase_prefix_ctx, coinbase, swork->nonce2_offset);
+		swork->coinbase_prefix_valid = true;
+	}
+	
+	for (i = 0; i < n; ++i)
+	{
+		nonce2s[i] = bytes_buf(&works[i]->nonce2);
+		digests[i] = out_hash[i];
+	}
+	sha256_multi(&swork->coinbase_prefix_ctx, nonce2s, n2len, &coinbase[suffix_offset], bytes_len(&swork->coinbase) - suffix_offset, digests, n);
+	sha256_multi(NULL, (const unsigned char **)digests, 32, NULL, 0, digests, n);
 }
 
-void gen_stratum_work2(struct work *work, struct stratum_work *swork)
+static
+void calc_midstates(struct work ** const works, const int n)
+{
+	uint32_t data[n][16];
+	uint32_t h[n][8];
+	const unsigned char *blocks[n];
+	int i;
+	
+	for (i = 0; i < n; ++i)
+	{
+		swap32yes(data[i], works[i]->data, 16);
+		blocks[i] = (const unsigned char *)data[i];
+		memcpy(h[i], sha256_h0, sizeof(h[i]));
+	}
+	sha256_transf_multi(h, blocks, n);
+	for (i = 0; i < n; ++i)
+	{
+		memcpy(works[i]->midstate, h[i], sizeof(works[i]->midstate));
+		swap32tole(works[i]->midstate, works[i]->midstate, 8);
+	}
+}
+
+/* Builds n work items sharing one stratum job at once, hashing their coinbases
+ * and merkle branches in parallel lanes; all works must use the same nonce2 size */
+void gen_stratum_works2(struct work ** const works, const int n, struct stratum_work * const swork)
 {
-	unsigned char *coinbase, merkle_root[32], merkle_sha[64];
+	unsigned char merkle_root[n][32];
+	unsigned char *digests[n];
 	uint8_t *merkle_bin;
-	uint32_t *data32, *swap32;
+	struct work *work;
+	uint32_t ntime;
 	int i;
 
-	/* Generate coinbase */
-	coinbase = bytes_buf(&swork->coinbase);
-	memcpy(&coinbase[swork->nonce2_offset], bytes_buf(&work->nonce2), bytes_len(&work->nonce2));
+	/* Generate coinbase hashes (may update the prefix cache, so needs the write lock) */
+	stratum_work_hash_coinbases(swork, works, n, merkle_root);
 
 	/* Downgrade to a read lock to read off the variables */
 	if (swork->data_lock_p)
 		cg_dwlock(swork->data_lock_p);
 
-	/* Generate merkle root */
-	gen_hash(coinbase, merkle_root, bytes_len(&swork->coinbase));
-	memcpy(merkle_sha, merkle_root, 32);
+	/* Generate merkle roots */
+	for (i = 0; i < n; ++i)
+		digests[i] = merkle_root[i];
 	merkle_bin = bytes_buf(&swork->merkle_bin);
 	for (i = 0; i < swork->merkles; ++i, merkle_bin += 32) {
-		memcpy(merkle_sha + 32, merkle_bin, 32);
-		gen_hash(merkle_sha, merkle_root, 64);
-		memcpy(merkle_sha, merkle_root, 32);
-	}
-	data32 = (uint32_t *)merkle_sha;
-	swap32 = (uint32_t *)merkle_root;
-	flip32(swap32, data32);
-	
-	memcpy(&work->data[0], swork->header1, 36);
-	memcpy(&work->data[36], merkle_root, 32);
-	*((uint32_t*)&work->data[68]) = htobe32(swork->ntime + timer_elapsed(&swork->tv_received, NULL));
-	memcpy(&work->data[72], swork->diffbits, 4);
-	memset(&work->data[76], 0, 4);  // nonce
-	memcpy(&work->data[80], workpadding_bin, 48);
+		sha256_multi(NULL, (const unsigned char **)digests, 32, merkle_bin, 32, digests, n);
+		sha256_multi(NULL, (const unsigned char **)digests, 32, NULL, 0, digests, n);
+	}
+	
+	ntime = htobe32(swork->ntime + timer_elapsed(&swork->tv_received, NULL));
+	for (i = 0; i < n; ++i)
+	{
+		work = works[i];
+		
+		memcpy(&work->data[0], swork->header1, 36);
+		flip32(&work->data[36], merkle_root[i]);
+		*((uint32_t*)&work->data[68]) = ntime;
+		memcpy(&work->data[72], swork->diffbits, 4);
+		memset(&work->data[76], 0, 4);  // nonce
+		memcpy(&work->data[80], workpadding_bin, 48);
 
-	/* Store the stratum work diff to check it still matches the pool's
-	 * stratum diff when submitting shares */
-	work->sdiff = swork->diff;
+		/* Store the stratum work diff to check it still matches the pool's
+		 * stratum diff when submitting shares */
+		work->sdiff = swork->diff;
 
-	/* Copy parameters required for share submission */
-	work->job_id = maybe_strdup(swork->job_id);
-	work->nonce1 = maybe_strdup(swork->nonce1);
+		/* Copy parameters required for share submission */
+		work->job_id = refstr_ref(swork->job_id);
+		work->nonce1 = refstr_ref(swork->nonce1);
+	}
 	if (swork->data_lock_p)
 		cg_runlock(swork->data_lock_p);
 
-	if (opt_debug)
+	calc_midstates(works, n);
+
+	/* Mining threads generate --local-work here concurrently, so new ids
+	 * (and the count) need control_lock like make_work */
+	cg_wlock(&control_lock);
+	for (i = 0; i < n; ++i)
+		works[i]->id = total_work++;
+	local_work += n;
+	cg_wunlock(&control_lock);
+
+	for (i = 0; i < n; ++i)
 	{
-		char header[161];
-		char nonce2hex[(bytes_len(&work->nonce2) * 2) + 1];
-		bin2hex(header, work->data, 80);
-		bin2hex(nonce2hex, bytes_buf(&work->nonce2), bytes_len(&work->nonce2));
-		applog(LOG_DEBUG, "Generated stratum header %s", header);
-		applog(LOG_DEBUG, "Work job_id %s nonce2 %s", work->job_id, nonce2hex);
+		work = works[i];
+		
+		if (opt_debug)
+		{
+			char header[161];
+			char nonce2hex[(bytes_len(&work->nonce2) * 2) + 1];
+			bin2hex(header, work->data, 80);
+			bin2hex(nonce2hex, bytes_buf(&work->nonce2), bytes_len(&work->nonce2));
+			applog(LOG_DEBUG, "Generated stratum header %s", header);
+			applog(LOG_DEBUG, "Work job_id %s nonce2 %s", work->job_id, nonce2hex);
+		}
+
+		set_target(work->target, work->sdiff);
+
+		work->stratum = true;
+		work->blk.nonce = 0;
+		work->longpoll = false;
+		work->getwork_mode = GETWORK_MODE_STRATUM;
+		/* Nominally allow a driver to ntime roll 60 seconds */
+		work->drv_rolllimit = 60;
+		calc_diff(work, 0);
 	}
+}
+
+void gen_stratum_work2(struct work *work, struct stratum_work *swork)
+{
+	gen_stratum_works2(&work, 1, swork);
+}
+
+/* Block headers, as hex in block chain byte order, whose nonces are winners
+ * at their own targets: Bitcoin blocks 0-2 */
+const char * const test_block_headers[] = {
+	"01000000" "0000000000000000000000000000000000000000000000000000000000000000"
+	"3ba3edfd7a7b12b27ac72c3e67768f617fc81bc3888a51323a9fb8aa4b1e5e4a" "29ab5f49" "ffff001d" "1dac2b7c",
+	"01000000" "6fe28c0ab6f1b372c1a6a246ae63f74f931e8365e15a089c68d6190000000000"
+	"982051fd1e4ba744bbbe680e1fee14677ba1a3c3540bf7b1cdb606e857233e0e" "61bc6649" "ffff001d" "01e36299",
+	"01000000" "4860eb18bf1b1620e37e9490fc8a427514416fd75159ab86688e9a8300000000"
+	"d5fdcc541e25de1c7a5addedf24858b8bb665c9f36ef744ee42c316022c90f9b" "b0bc6649" "ffff001d" "08d2bd61",
+	NULL
+};
+
+/* Sets up work for a block header given as hex in block chain byte order,
+ * with the header's own target; its nonce, as scanhash functions see it, is
+ * then le32toh(*(uint32_t *)&work->data[76]) */
+void test_header_work(struct work * const work, const char * const hexheader)
+{
+	unsigned char header[80];
 
+	memset(work, 0, sizeof(*work));
+	if (!hex2bin(header, hexheader, sizeof(header)))
+		quithere(1, "Invalid test header: %s", hexheader);
+	swap32yes(work->data, header, 80 / 4);
+	memcpy(&work->data[80], workpadding_bin, 48);
 	calc_midstate(work);
+	real_block_target(work->target, work->data);
+}
 
-	set_target(work->target, work->sdiff);
+static
+void _test_gen_stratum_work(struct pool * const pool, const int merkles, const char * const expected)
+{
+	// Bitcoin block 1's coinbase, split up as a pool would send it
+	static const char * const coinbase1 = "01000000010000000000000000000000000000000000000000000000000000000000000000ffffffff0704";
+	static const char * const nonce1 = "ffff001d";
+	static const uint8_t nonce2[] = {0x01, 0x04};
+	static const char * const coinbase2 = "ffffffff0100f2052a0100000043410496b538e853519c726a2c91e61ec11600ae1390813a627c66fb8be7947be63c52da7589379515d4e0a604f8141781e62294721166bf621e73a82cbf2342c858eeac00000000";
+	static const char * const merkle_bin = "ca978112ca1bbdcafac231b39a23dc4da786eff8147c4e72b9807785afee48bb" "3e23e8160039594a33894f6564e1b1348bbd7a0088d42c4acb73eeaed59c009d";
+	struct stratum_work swork = {
+		.coinbase = BYTES_INIT,
+		.merkle_bin = BYTES_INIT,
+		.n2size = sizeof(nonce2),
+		.merkles = merkles,
+		.diff = 1,
+		.pool = pool,
+	};
+	struct work expect, *work = make_work();
+	const size_t cb1_len = strlen(coinbase1) / 2, cb2_len = strlen(coinbase2) / 2;
+	uint8_t *coinbase;
+	char hex[161];
+
+	test_header_work(&expect, expected);
+	memcpy(swork.header1, expect.data, 36);
+	memcpy(swork.diffbits, &expect.data[72], 4);
+	swork.ntime = be32toh(*(uint32_t *)&expect.data[68]);
+	cgtime(&swork.tv_received);
+
+	swork.nonce2_offset = cb1_len + (strlen(nonce1) / 2);
+	bytes_resize(&swork.coinbase, swork.nonce2_offset + sizeof(nonce2) + cb2_len);
+	coinbase = bytes_buf(&swork.coinbase);
+	hex2bin(coinbase, coinbase1, cb1_len);
+	hex2bin(&coinbase[cb1_len], nonce1, strlen(nonce1) / 2);
+	memset(&coinbase[swork.nonce2_offset], 0xee, sizeof(nonce2));
+	hex2bin(&coinbase[swork.nonce2_offset + sizeof(nonce2)], coinbase2, cb2_len);
+	bytes_resize(&swork.merkle_bin, 32 * merkles);
+	hex2bin(bytes_buf(&swork.merkle_bin), merkle_bin, 32 * merkles);
+
+	bytes_resize(&work->nonce2, sizeof(nonce2));
+	memcpy(bytes_buf(&work->nonce2), nonce2, sizeof(nonce2));
+	work->pool = pool;
+	gen_stratum_work2(work, &swork);
 
-	local_work++;
-	work->stratum = true;
-	work->blk.nonce = 0;
-	work->id = total_work++;
-	work->longpoll = false;
-	work->getwork_mode = GETWORK_MODE_STRATUM;
-	/* Nominally allow a driver to ntime roll 60 seconds */
-	work->drv_rolllimit = 60;
-	calc_diff(work, 0);
+	if (memcmp(work->data, expect.data, 80) || memcmp(work->midstate, expect.midstate, 32))
+	{
+		swap32yes(expect.data, work->data, 80 / 4);
+		bin2hex(hex, expect.data, 80);
+		applog(LOG_ERR, "%s: %d merkle branches gave header %s instead of %s", __func__, merkles, hex, expected);
+	}
+
+	free_work(work);
+	bytes_free(&swork.coinbase);
+	bytes_free(&swork.merkle_bin);
+}
+
+// Known answers for gen_stratum_work2; the headers have a zero nonce, as generated work does
+static
+void test_gen_stratum_work()
+{
+	struct pool * const pool = calloc(1, sizeof(*pool));
+
+	// Without any merkle branches, it's block 1 itself
+	_test_gen_stratum_work(pool, 0,
+		"01000000" "6fe28c0ab6f1b372c1a6a246ae63f74f931e8365e15a089c68d6190000000000"
+		"982051fd1e4ba744bbbe680e1fee14677ba1a3c3540bf7b1cdb606e857233e0e" "61bc6649" "ffff001d" "00000000");
+	// Branches SHA256("a") and SHA256("b")
+	_test_gen_stratum_work(pool, 2,
+		"01000000" "6fe28c0ab6f1b372c1a6a246ae63f74f931e8365e15a089c68d6190000000000"
+		"11ade25a53d992927b3d451a12de14035d8f1f8ddc4d5edd53e4d7d31272dffd" "61bc6649" "ffff001d" "00000000");
+	free(pool);
 }
 
 void request_work(struct thr_info *thr)
@@ -8881,6 +10108,98 @@ void request_work(struct thr_info *thr)
 	cgtime(&dev_stats->_get_start);
 }
 
+// Whether mining threads build their own work for the pool with --local-work
+static
+bool pool_local_work(const struct pool * const pool)
+{
+	// select_pool is only safe to use from the getwork scheduler
+	if (!opt_local_work || pool_strategy == POOL_LOADBALANCE || pool_strategy == POOL_BALANCE)
+		return false;
+	return pool->has_stratum && pool->stratum_active && pool->stratum_notify;
+}
+
+/* With --local-work, mining threads build their own stratum work from a
+ * private snapshot of the current job, so they never wait on the shared queue.
+ * Each thread gets its own slice of nonce2 space: the topmost bits hold the
+ * thread number plus one, leaving slice 0 for the shared nonce2 counter. */
+static
+struct work *get_local_stratum_work(struct thr_info * const thr)
+{
+	struct stratum_work *swork;
+	struct pool *pool;
+	struct work *work;
+	bool new_job = false;
+	int nonce2sz, slot_bits, free_bits;
+	uint64_t nonce2;
+	
+	pool = current_pool();
+	if (!pool_local_work(pool))
+		return NULL;
+	
+	if (unlikely(!thr->local_swork))
+		thr->local_swork = calloc(1, sizeof(*thr->local_swork));
+	swork = thr->local_swork;
+	
+	cg_rlock(&pool->data_lock);
+	if (thr->local_swork_pool != pool || timercmp(&swork->tv_received, &pool->swork.tv_received, !=) || swork->diff != pool->swork.diff)
+	{
+		if (thr->local_swork_pool)
+			stratum_work_clean(swork);
+		stratum_work_cpy(swork, &pool->swork);
+		thr->local_swork_pool = pool;
+		thr->local_nonce2 = 0;
+		new_job = true;
+	}
+	cg_runlock(&pool->data_lock);
+	
+	nonce2sz = (swork->n2size > (int)sizeof(nonce2)) ? (int)sizeof(nonce2) : swork->n2size;
+	for (slot_bits = 1; (1 << slot_bits) <= mining_threads; ++slot_bits)
+	{}
+	free_bits = (nonce2sz * 8) - slot_bits;
+	// Too little nonce2 space to split up (or this slice is used up)
+	if (free_bits < 16 || (thr->local_nonce2 >> free_bits))
+		return NULL;
+	nonce2 = ((uint64_t)(thr->id + 1) << free_bits) | thr->local_nonce2++;
+	
+	work = make_work();
+	bytes_resize(&work->nonce2, swork->n2size);
+	memset(bytes_buf(&work->nonce2), 0, swork->n2size);
+#ifdef WORDS_BIGENDIAN
+	// NOTE: On big endian, the most significant bits are stored at the end, so skip the LSBs
+	memcpy(bytes_buf(&work->nonce2), &((char*)&nonce2)[sizeof(nonce2) - nonce2sz], nonce2sz);
+#else
+	memcpy(bytes_buf(&work->nonce2), &nonce2, nonce2sz);
+#endif
+	work->pool = pool;
+	work->work_restart_id = swork->work_restart_id;
+	gen_stratum_work2(work, swork);
+	cgtime(&work->tv_staged);
+	
+	// Staging normally takes care of this, but local work is never staged
+	if (new_job)
+		test_work_current(work);
+	// Every mining thread can get here at once, unlike stage_work
+	mutex_lock(&pool->pool_lock);
+	pool->works++;
+	pool->last_work_time = time(NULL);
+	cgtime(&pool->tv_last_work_time);
+	mutex_unlock(&pool->pool_lock);
+	
+	return work;
+}
+
+// Frees the thread's --local-work job snapshot, when it exits
+void free_local_stratum_work(struct thr_info * const thr)
+{
+	if (!thr->local_swork)
+		return;
+	if (thr->local_swork_pool)
+		stratum_work_clean(thr->local_swork);
+	free(thr->local_swork);
+	thr->local_swork = NULL;
+	thr->local_swork_pool = NULL;
+}
+
 // FIXME: Make this non-blocking (and remove HACK above)
 struct work *get_work(struct thr_info *thr)
 {
@@ -8893,7 +10212,8 @@ struct work *get_work(struct thr_info *thr)
 
 	applog(LOG_DEBUG, "%"PRIpreprv": Popping work from get queue to get work", cgpu->proc_repr);
 	while (!work) {
-		work = hash_pop();
+		if (!(opt_local_work && (work = get_local_stratum_work(thr))))
+			work = hash_pop();
 		if (stale_work(work, false)) {
 			staged_full = false;  // It wasn't really full, since it was stale :(
 			discard_work(work);
@@ -8996,15 +10316,11 @@ void inc_hw_errors3(struct thr_info *thr, const struct work *work, const uint32_
 			       cgpu->proc_repr, (unsigned long)be32toh(*bad_nonce_p));
 	}
 	
-	mutex_lock(&stats_lock);
-	hw_errors++;
-	++cgpu->hw_errors;
+	mutex_lock(&thr->stats_shard.lock);
+	++thr->stats_shard.hw_errors;
 	if (bad_nonce_p)
-	{
-		total_bad_diff1 += nonce_diff;
-		cgpu->bad_diff1 += nonce_diff;
-	}
-	mutex_unlock(&stats_lock);
+		thr->stats_shard.bad_diff1 += nonce_diff;
+	mutex_unlock(&thr->stats_shard.lock);
 
 	if (thr->cgpu->drv->hw_error)
 		thr->cgpu->drv->hw_error(thr);
@@ -9036,7 +10352,7 @@ enum test_nonce2_result _test_nonce2(struct work *work, uint32_t nonce, bool che
 #ifdef USE_SCRYPT
 	if (opt_scrypt)
 		// NOTE: Depends on scrypt_test return matching enum values
-		return scrypt_test(work->data, work->target, nonce);
+		return scrypt_test(work->data, work->target, nonce, scrypt_work_n(work));
 #endif
 
 	return hashtest2(work, checktarget);
@@ -9048,44 +10364,62 @@ bool submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce)
 	return submit_noffset_nonce(thr, work, nonce, 0);
 }
 
-/* Allows drivers to submit work items where the driver has changed the ntime
- * value by noffset. Must be only used with a work protocol that does not ntime
- * roll itself intrinsically to generate work (eg stratum). We do not touch
- * the original work struct, but the copy of it only. */
-bool submit_noffset_nonce(struct thr_info *thr, struct work *work_in, uint32_t nonce,
-			  int noffset)
+// Fills in the nonce, and moves ntime on by noffset, in a (copied) work's data
+static
+void work_set_nonce(struct work * const work, const uint32_t nonce, const int noffset)
 {
-	struct work *work = make_work();
-	_copy_work(work, work_in, noffset);
-	
 	uint32_t *work_nonce = (uint32_t *)(work->data + 64 + 12);
+	
+	if (noffset)
+	{
+		uint32_t *work_ntime = (uint32_t *)(work->data + 68);
+		*work_ntime = htobe32(be32toh(*work_ntime) + noffset);
+	}
+	*work_nonce = htole32(nonce);
+}
+
+static
+enum test_nonce2_result _submit_noffset_nonce(struct thr_info * const thr, struct work * const work_in, const uint32_t nonce, const int noffset, const bool known_bad)
+{
+	/* Nonces are checked against a shallow copy on the stack; a real copy is
+	 * only allocated for shares that actually get submitted */
+	struct work _work = *work_in, *work = &_work;
+	
 	struct timeval tv_work_found;
 	enum test_nonce2_result res;
-	bool ret = true;
 
 	thread_reportout(thr);
 
 	cgtime(&tv_work_found);
-	*work_nonce = htole32(nonce);
+	work_set_nonce(work, nonce, noffset);
 	work->thr_id = thr->id;
 
 	/* Do one last check before attempting to submit the work */
 	/* Side effect: sets work->data for us */
-	res = test_nonce2(work, nonce);
+	if (known_bad)
+		res = TNR_BAD;
+	else
+		res = test_nonce2(work, nonce);
 	
 	if (unlikely(res == TNR_BAD))
 		{
 			inc_hw_errors(thr, work, nonce);
-			ret = false;
 			goto out;
 		}
 	
-	mutex_lock(&stats_lock);
-	total_diff1       += work->nonce_diff;
-	thr ->cgpu->diff1 += work->nonce_diff;
-	work->pool->diff1 += work->nonce_diff;
+	if (!work_in->nonce_seen)
+	{
+		work_in->nonce_seen = true;
+		// Stratum work has no getwork, so it counts from when it was generated
+		if (work->stratum)
+			share_latency(work, getwork_to_nonce, &work->tv_staged, &tv_work_found);
+		else
+		if (timer_isset(&work->tv_getwork))
+			share_latency(work, getwork_to_nonce, &work->tv_getwork, &tv_work_found);
+	}
+	
+	thr_stats_add_diff1(thr, work->pool, work->nonce_diff);
 	thr->cgpu->last_device_valid_work = time(NULL);
-	mutex_unlock(&stats_lock);
 	
 	if (noncelog_file)
 		noncelog(work);
@@ -9099,14 +10433,108 @@ bool submit_noffset_nonce(struct thr_info *thr, struct work *work_in, uint32_t n
 			goto out;
 	}
 	
+	work = make_work();
+	_copy_work(work, &_work, 0);
 	submit_work_async2(work, &tv_work_found);
-	work = NULL;  // Taken by submit_work_async2
 out:
-	if (work)
-		free_work(work);
 	thread_reportin(thr);
 
-	return ret;
+	return res;
+}
+
+/* Allows drivers to submit work items where the driver has changed the ntime
+ * value by noffset. Must be only used with a work protocol that does not ntime
+ * roll itself intrinsically to generate work (eg stratum). We do not touch
+ * the original work struct, but the copy of it only. */
+bool submit_noffset_nonce(struct thr_info *thr, struct work *work_in, uint32_t nonce,
+			  int noffset)
+{
+	return _submit_noffset_nonce(thr, work_in, nonce, noffset, false) != TNR_BAD;
+}
+
+/* Sets h7[i] to the last word of each nonce's SHA-256d, hashing them all
+ * together in one multi-lane pass; anything nonzero is a bad nonce. For
+ * scrypt, every h7 is zero so that each nonce gets its full check. */
+static
+void work_nonces_h7(const struct work_nonce * const wns, const int n, uint32_t * const h7)
+{
+	uint32_t midstates[n][8], tails[n][4];
+	const uint32_t *midstate_ps[n];
+	int i, j;
+	
+#ifdef USE_SCRYPT
+	if (opt_scrypt)
+	{
+		memset(h7, 0, n * sizeof(*h7));
+		return;
+	}
+#endif
+	
+	for (i = 0; i < n; ++i)
+	{
+		const struct work * const work = wns[i].work;
+		const uint32_t * const midstate = (const uint32_t *)work->midstate;
+		const uint32_t * const tail = (const uint32_t *)&work->data[64];
+		uint32_t ntime = tail[1];
+		
+		for (j = 0; j < 8; ++j)
+			midstates[i][j] = le32toh(midstate[j]);
+		midstate_ps[i] = midstates[i];
+		if (wns[i].noffset)
+			ntime = htobe32(be32toh(ntime) + wns[i].noffset);
+		tails[i][0] = le32toh(tail[0]);
+		tails[i][1] = le32toh(ntime);
+		tails[i][2] = le32toh(tail[2]);
+		tails[i][3] = wns[i].nonce;
+	}
+	sha256d_80_h7_multi(midstate_ps, (const uint32_t (*)[4])tails, h7, n);
+}
+
+/* Sets res for each of n nonces as test_nonce2 would (or _test_nonce2 with
+ * checktarget false), but weeds out the bad ones all at once first so only
+ * likely shares are hashed in full. The works are left untouched. */
+void test_nonces(struct work_nonce * const wns, const int n, const bool checktarget)
+{
+	int i;
+	
+	if (n <= 0)
+		return;
+	
+	uint32_t h7[n];
+	work_nonces_h7(wns, n, h7);
+	for (i = 0; i < n; ++i)
+	{
+		if (h7[i])
+		{
+			wns[i].res = TNR_BAD;
+			continue;
+		}
+		struct work work = *wns[i].work;
+		work_set_nonce(&work, wns[i].nonce, wns[i].noffset);
+		wns[i].res = _test_nonce2(&work, wns[i].nonce, checktarget);
+	}
+}
+
+/* Submits each of n nonces as submit_noffset_nonce does, setting its res,
+ * with the bad ones weeded out all at once first. Drivers that collect a
+ * batch of results (eg, one per chip) can use this to avoid hashing every
+ * nonce on its own. Returns the number that were not HW errors. */
+int submit_nonces(struct work_nonce * const wns, const int n)
+{
+	int i, valid = 0;
+	
+	if (n <= 0)
+		return 0;
+	
+	uint32_t h7[n];
+	work_nonces_h7(wns, n, h7);
+	for (i = 0; i < n; ++i)
+	{
+		wns[i].res = _submit_noffset_nonce(wns[i].thr, wns[i].work, wns[i].nonce, wns[i].noffset, h7[i]);
+		if (wns[i].res != TNR_BAD)
+			++valid;
+	}
+	return valid;
 }
 
 bool abandon_work(struct work *work, struct timeval *wdiff, uint64_t hashes)
@@ -9982,6 +11410,9 @@ static void *watchdog_thread(void __maybe_unused *userdata)
 
 #ifdef HAVE_CURSES
 		const int ts = total_staged();
+		// hashmeter only folds the mining threads' stats once per log interval
+		if (use_curses)
+			fold_thr_stats();
 		if (curses_active_locked()) {
 			change_logwinsize();
 			curses_print_status(ts);
@@ -10172,6 +11603,13 @@ void print_summary(void)
 	char xfer[17], bw[19];
 	int pool_secs;
 
+	// Mining threads may have been cancelled while holding hash_lock
+	if (!mutex_trylock(&hash_lock))
+	{
+		fold_thr_stats_locked();
+		mutex_unlock(&hash_lock);
+	}
+
 	timersub(&total_tv_end, &total_tv_start, &diff);
 	hours = diff.tv_sec / 3600;
 	mins = (diff.tv_sec % 3600) / 60;
@@ -10765,6 +12203,7 @@ void allocate_cgpu(struct cgpu_info *cgpu, unsigned int *kp)
 	// Setup thread structs before starting any of the threads, in case they try to interact
 	for (j = 0; j < threadobj; ++j, ++*kp) {
 		thr = get_thread(*kp);
+		mutex_init(&thr->stats_shard.lock);
 		thr->id = *kp;
 		thr->cgpu = cgpu;
 		thr->device_thread = j;
@@ -11603,6 +13042,7 @@ int main(int argc, char *argv[])
 			bytes_resize(&swork->coinbase, coinbase_sz);
 			memset(bytes_buf(&swork->coinbase), '\xff', coinbase_sz);
 			swork->nonce2_offset = 0;
+			swork->coinbase_prefix_valid = false;
 			
 			bytes_resize(&swork->merkle_bin, branchdatasz);
 			memset(bytes_buf(&swork->merkle_bin), '\xff', branchdatasz);
@@ -11623,7 +13063,25 @@ int main(int argc, char *argv[])
 		test_intrange();
 		test_decimal_width();
 		utf8_test();
+		test_latency_hist();
+		test_gen_stratum_work();
+#ifdef WANT_CPUMINE
+		test_cpu_algos();
+#endif
+#ifdef USE_SCRYPT
+		test_scrypt();
+#endif
+#ifdef USE_BITFURY
+		test_bitfury_nonces();
+#endif
+	}
+
+#ifdef WANT_CPUMINE
+	if (opt_bench_engines != CPU_BENCH_NONE) {
+		cpu_bench_engines();
+		exit(0);
 	}
+#endif
 
 #ifdef HAVE_CURSES
 	if (opt_realquiet || opt_display_devs)
@@ -11790,6 +13248,7 @@ int main(int argc, char *argv[])
 
 		pool->cgminer_stats.getwork_wait_min.tv_sec = MIN_SEC_UNSET;
 		pool->cgminer_pool_stats.getwork_wait_min.tv_sec = MIN_SEC_UNSET;
+		pool->cgminer_pool_stats.submit_latency_min.tv_sec = MIN_SEC_UNSET;
 
 		if (!pool->rpc_url)
 			quit(1, "No URI supplied for pool %u", i);
@@ -12029,7 +13488,9 @@ begin_bench:
 		cp = current_pool();
 
 		// Generally, each processor needs a new work, and all at once during work restarts
-		max_staged += mining_threads;
+		// With --local-work they build their own, so only a small reserve is kept for the fallback cases
+		if (!pool_local_work(cp))
+			max_staged += mining_threads;
 
 		mutex_lock(stgd_lock);
 		ts = __total_staged();
@@ -12066,9 +13527,21 @@ retry:
 				pool = altpool;
 				goto retry;
 			}
-			gen_stratum_work(pool, work);
-			applog(LOG_DEBUG, "Generated stratum work");
-			stage_work(work);
+			// Build as much of the shortfall as possible in one multi-buffer pass
+			struct work *works[STRATUM_WORK_BATCH];
+			int i, n = max_staged + 1 - ts;
+			if (n > STRATUM_WORK_BATCH)
+				n = STRATUM_WORK_BATCH;
+			else
+			if (n < 1)
+				n = 1;
+			works[0] = work;
+			for (i = 1; i < n; ++i)
+				works[i] = make_work();
+			gen_stratum_works(pool, works, n);
+			applog(LOG_DEBUG, "Generated %d stratum work(s)", n);
+			for (i = 0; i < n; ++i)
+				stage_work(works[i]);
 			continue;
 		}
 
@@ -40,6 +40,7 @@
 #include <utlist.h>
 
 #include "logging.h"
+#include "sha2.h"
 #include "util.h"
 
 #ifdef STDC_HEADERS
@@ -400,6 +401,13 @@ enum {
 	MSG_POOLPRIO	= 73,
 };
 
+// Latency distributions of shares between each stage
+struct share_latency_stats {
+	struct latency_hist getwork_to_nonce;
+	struct latency_hist found_to_sent;
+	struct latency_hist sent_to_ack;
+};
+
 struct cgminer_stats {
 	struct timeval start_tv;
 	
@@ -434,6 +442,10 @@ struct cgminer_pool_stats {
 	uint64_t times_received;
 	uint64_t bytes_received;
 	uint64_t net_bytes_received;
+	uint32_t submit_acks;
+	struct timeval submit_latency;
+	struct timeval submit_latency_max;
+	struct timeval submit_latency_min;
 };
 
 #define PRIprepr "-6s"
@@ -544,6 +556,7 @@ struct cgpu_info {
 	int dev_throttle_count;
 
 	struct cgminer_stats cgminer_stats;
+	struct share_latency_stats latency;
 
 	pthread_rwlock_t qlock;
 	struct work *queued_work;
@@ -571,6 +584,23 @@ struct thread_q {
 	pthread_cond_t		cond;
 };
 
+#define THR_STATS_POOLS  4
+
+/* Statistics accumulated by a mining thread until they are next folded into
+ * the device, pool and global totals, so it doesn't need stats_lock or
+ * hash_lock for every nonce or hashes_done */
+struct thr_stats_shard {
+	pthread_mutex_t lock;
+	double mhashes;
+	double diff1;
+	double bad_diff1;
+	int hw_errors;
+	struct {
+		struct pool *pool;
+		double diff1;
+	} pools[THR_STATS_POOLS];
+};
+
 enum thr_busy_state {
 	TBS_IDLE,
 	TBS_GETTING_RESULTS,
@@ -599,6 +629,7 @@ struct thr_info {
 	bool	pause;
 	time_t	getwork;
 	double	rolling;
+	struct thr_stats_shard stats_shard;
 
 	// Used by minerloop_async
 	struct work *prev_work;
@@ -625,6 +656,11 @@ struct thr_info {
 
 	bool	work_restart;
 	notifier_t work_restart_notifier;
+	
+	// Used by --local-work
+	struct stratum_work *local_swork;
+	struct pool *local_swork_pool;
+	uint64_t local_nonce2;
 };
 
 struct string_elist {
@@ -1144,6 +1180,11 @@ struct stratum_work {
 	size_t nonce2_offset;
 	int n2size;
 	
+	// SHA-256 state after hashing coinbase up to nonce2_offset
+	// Must be invalidated (by clearing coinbase_prefix_valid) whenever coinbase changes
+	bool coinbase_prefix_valid;
+	sha256_ctx coinbase_prefix_ctx;
+	
 	int merkles;
 	bytes_t merkle_bin;
 	
@@ -1221,6 +1262,11 @@ struct pool {
 	char *rpc_user, *rpc_pass;
 	char *rpc_proxy;
 
+#ifdef USE_SCRYPT
+	char *scrypt_n_str;
+	struct scrypt_n_step *scrypt_n_steps;
+#endif
+
 	pthread_mutex_t pool_lock;
 	cglock_t data_lock;
 
@@ -1244,6 +1290,7 @@ struct pool {
 
 	struct cgminer_stats cgminer_stats;
 	struct cgminer_pool_stats cgminer_pool_stats;
+	struct share_latency_stats latency;
 
 	/* Stratum variables */
 	char *stratum_url;
@@ -1252,6 +1299,9 @@ struct pool {
 	SOCKETTYPE sock;
 	char *sockbuf;
 	size_t sockbuf_size;
+	size_t sockbuf_start;
+	size_t sockbuf_end;
+	size_t sockbuf_scan;
 	char *sockaddr_url; /* stripped url used for sockaddr */
 	size_t n1_len;
 	uint32_t nonce2;
@@ -1267,6 +1317,14 @@ struct pool {
 	struct stratum_work swork;
 	pthread_t stratum_thread;
 	pthread_mutex_t stratum_lock;
+#ifdef USE_LIBEVENT
+	struct event *stratum_ev;
+	struct pool *stratum_ev_next;
+	bool stratum_ev_queued;
+	bool stratum_ev_add;
+	bool stratum_ev_lost;
+	bool stratum_reconnect;
+#endif
 	char *admin_msg;
 
 	pthread_mutex_t last_work_lock;
@@ -1301,6 +1359,7 @@ struct work {
 	struct timeval	tv_staged;
 
 	bool		mined;
+	bool		nonce_seen;
 	bool		clone;
 	bool		cloned;
 	int		rolltime;
@@ -1347,7 +1406,7 @@ struct work {
 	struct timeval	tv_work_found;
 	char		getwork_mode;
 
-	/* Used to queue shares in submit_waiting */
+	/* Used to queue staged work, and shares in submit_waiting */
 	struct work *prev;
 	struct work *next;
 };
@@ -1358,6 +1417,47 @@ extern void stratum_work_cpy(struct stratum_work *dst, const struct stratum_work
 extern void stratum_work_clean(struct stratum_work *);
 extern bool pool_has_usable_swork(const struct pool *);
 extern void gen_stratum_work2(struct work *, struct stratum_work *);
+extern const char * const test_block_headers[];
+extern void test_header_work(struct work *, const char *hexheader);
+extern void gen_stratum_works2(struct work **, int, struct stratum_work *);
+extern void fold_thr_stats(void);
+extern void get_queue_depths(int *staged, int *submitting);
+#ifdef USE_LIBEVENT
+extern void stratum_evloop_sock_changed(struct pool *);
+#endif
+
+enum api_event_type {
+	API_EVENT_SHARE    = 1 << 0,
+	API_EVENT_BLOCK    = 1 << 1,
+	API_EVENT_POOL     = 1 << 2,
+	API_EVENT_DEVICE   = 1 << 3,
+	API_EVENT_HASHRATE = 1 << 4,
+};
+
+// Events any API client has subscribed to
+extern volatile unsigned api_event_mask;
+
+static inline
+bool api_event_wanted(const enum api_event_type type)
+{
+	return api_event_mask & type;
+}
+
+extern void api_event_share(const struct work *, const struct cgpu_info *, bool accepted, const char *reason);
+extern void api_event_block(const struct pool *, const char *hash, double diff);
+extern void api_event_pool(const struct pool *);
+extern void api_event_device(const struct cgpu_info *, enum dev_reason);
+
+// Bumped whenever statistics the API reports change, so it knows when its
+// cached replies are out of date
+extern volatile unsigned api_stats_gen;
+
+static inline
+void api_stats_changed(void)
+{
+	__sync_add_and_fetch(&api_stats_gen, 1);
+}
+extern void api_event_hashrate(void);
 extern void inc_hw_errors3(struct thr_info *thr, const struct work *work, const uint32_t *bad_nonce_p, float nonce_diff);
 static inline
 void inc_hw_errors2(struct thr_info * const thr, const struct work * const work, const uint32_t *bad_nonce_p)
@@ -1382,6 +1482,16 @@ extern enum test_nonce2_result _test_nonce2(struct work *, uint32_t nonce, bool
 extern bool submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce);
 extern bool submit_noffset_nonce(struct thr_info *thr, struct work *work, uint32_t nonce,
 			  int noffset);
+// A nonce for test_nonces or submit_nonces, which set res
+struct work_nonce {
+	struct thr_info *thr;  // only used by submit_nonces
+	struct work *work;
+	uint32_t nonce;
+	int noffset;
+	enum test_nonce2_result res;
+};
+extern void test_nonces(struct work_nonce *, int n, bool checktarget);
+extern int submit_nonces(struct work_nonce *, int n);
 extern void __add_queued(struct cgpu_info *cgpu, struct work *work);
 extern struct work *get_queued(struct cgpu_info *cgpu);
 extern void add_queued(struct cgpu_info *cgpu, struct work *work);
@@ -32,6 +32,7 @@
 #include "findnonce.h"
 #include "logging.h"
 #include "ocl.h"
+#include "scrypt.h"
 
 /* Platform API */
 extern
@@ -586,7 +587,7 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize)
 	 * have otherwise created. The filename is:
 	 * kernelname + name +/- g(offset) + v + vectors + w + work_size + l + sizeof(long) + p + platform version + .bin
 	 * For scrypt the filename is:
-	 * kernelname + name + g + lg + lookup_gap + tc + thread_concurrency + w + work_size + l + sizeof(long) + p + platform version + .bin
+	 * kernelname + name + g + lg + lookup_gap + tc + thread_concurrency [+ n + N] + w + work_size + l + sizeof(long) + p + platform version + .bin
 	 */
 	char binaryfilename[255];
 	char filename[255];
@@ -693,6 +694,8 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize)
 
 #ifdef USE_SCRYPT
 	if (opt_scrypt) {
+		clState->scrypt_n = data->scrypt_n ?: SCRYPT_DEFAULT_N;
+
 		if (!data->opt_lg) {
 			applog(LOG_DEBUG, "GPU %d: selecting lookup gap of 2", gpu);
 			data->lookup_gap = 2;
@@ -702,7 +705,8 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize)
 		if (!data->opt_tc) {
 			unsigned int sixtyfours;
 
-			sixtyfours =  data->max_alloc / 131072 / 64 - 1;
+			sixtyfours =  data->max_alloc / (128 * clState->scrypt_n) / 64;
+			sixtyfours = (sixtyfours > 1) ? (sixtyfours - 1) : 1;
 			data->thread_concurrency = sixtyfours * 64;
 			if (data->shaders && data->thread_concurrency > data->shaders) {
 				data->thread_concurrency -= data->thread_concurrency % data->shaders;
@@ -746,6 +750,10 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize)
 #ifdef USE_SCRYPT
 		sprintf(numbuf, "lg%utc%u", data->lookup_gap, (unsigned int)data->thread_concurrency);
 		strcat(binaryfilename, numbuf);
+		if (clState->scrypt_n != SCRYPT_DEFAULT_N) {
+			sprintf(numbuf, "n%u", clState->scrypt_n);
+			strcat(binaryfilename, numbuf);
+		}
 #endif
 	} else {
 		sprintf(numbuf, "v%d", clState->vwidth);
@@ -823,8 +831,8 @@ build:
 
 #ifdef USE_SCRYPT
 	if (opt_scrypt)
-		sprintf(CompilerOptions, "-D LOOKUP_GAP=%d -D CONCURRENT_THREADS=%d -D WORKSIZE=%d",
-			data->lookup_gap, (unsigned int)data->thread_concurrency, (int)clState->wsize);
+		sprintf(CompilerOptions, "-D LOOKUP_GAP=%d -D CONCURRENT_THREADS=%d -D WORKSIZE=%d -D SCRYPT_N=%u",
+			data->lookup_gap, (unsigned int)data->thread_concurrency, (int)clState->wsize, clState->scrypt_n);
 	else
 #endif
 	{
@@ -1024,7 +1032,7 @@ built:
 
 #ifdef USE_SCRYPT
 	if (opt_scrypt) {
-		size_t ipt = (1024 / data->lookup_gap + (1024 % data->lookup_gap > 0));
+		size_t ipt = (clState->scrypt_n / data->lookup_gap + (clState->scrypt_n % data->lookup_gap > 0));
 		size_t bufsize = 128 * ipt * data->thread_concurrency;
 
 		/* Use the max alloc value which has been rounded to a power of
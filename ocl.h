@@ -19,6 +19,7 @@ typedef struct {
 	cl_mem CLbuffer0;
 	cl_mem padbuffer8;
 	size_t padbufsize;
+	unsigned int scrypt_n;
 	void * cldata;
 #endif
 	bool hasBitAlign;
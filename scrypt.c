@@ -35,6 +35,14 @@
 #include <stdint.h>
 #include <string.h>
 
+#include <pthread.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+
+#include "scrypt.h"
+#include "util.h"
+
 typedef struct SHA256Context {
 	uint32_t state[8];
 	uint32_t buf[16];
@@ -295,145 +303,320 @@ PBKDF2_SHA256_80_128_32(const uint32_t * passwd, const uint32_t * salt, uint32_t
 }
 
 
-/**
- * salsa20_8(B):
- * Apply the salsa20/8 core to the provided block.
+#define SCRYPT_NWAY_VW  1
+#define SCRYPT_NWAY_GROUPS  1
+#define SCRYPT_NWAY_CORE  scrypt_core_1way
+#include "scrypt_nway.h"
+
+#define SCRYPT_NWAY_VW  1
+#define SCRYPT_NWAY_GROUPS  2
+#define SCRYPT_NWAY_CORE  scrypt_core_2way
+#include "scrypt_nway.h"
+
+struct scrypt_core {
+	const char *name;
+	int ways;
+	void (*func)(uint32_t (*X)[32], void *V, unsigned int N);
+};
+
+static const struct scrypt_core scrypt_core_single = {"1-way", 1, scrypt_core_1way};
+
+/* Fastest first; the first one the CPU supports is used for mining */
+static const struct scrypt_core scrypt_cores[] = {
+#ifdef HAVE_AVX512F
+	{"8-way AVX-512", 8, scrypt_core_8way_avx512},
+#endif
+#ifdef HAVE_AVX2
+	{"4-way AVX2", 4, scrypt_core_4way_avx2},
+#endif
+#ifdef HAVE_NEON
+	{"3-way NEON", 3, scrypt_core_3way_neon},
+#endif
+	{"2-way", 2, scrypt_core_2way},
+};
+#define SCRYPT_MAX_WAYS  8
+
+static const struct scrypt_core *scrypt_core_multi;
+
+static
+bool scrypt_core_supported(const struct scrypt_core * const core)
+{
+#ifdef HAVE_AVX512F
+	if (core->func == scrypt_core_8way_avx512 && !__builtin_cpu_supports("avx512f"))
+		return false;
+#endif
+#ifdef HAVE_AVX2
+	if (core->func == scrypt_core_4way_avx2 && !__builtin_cpu_supports("avx2"))
+		return false;
+#endif
+#ifdef HAVE_NEON
+	if (core->func == scrypt_core_3way_neon && !neon_available())
+		return false;
+#endif
+	return true;
+}
+
+static
+void scrypt_core_select(void)
+{
+	const struct scrypt_core *core = &scrypt_cores[0];
+
+	while (!scrypt_core_supported(core))
+		++core;
+	applog(LOG_DEBUG, "Using %s scrypt core", core->name);
+	scrypt_core_multi = core;
+}
+
+/* V holds N copies of X for each hash */
+#define SCRYPT_SCRATCHPAD_SIZE(ways, N)  ((size_t)(ways) * (N) * 128)
+#define SCRYPT_HUGEPAGE_SIZE  0x200000
+
+/* cpu and memory intensive function to transform n (up to core->ways) 80
+   byte buffers into 32 byte outputs with scrypt(N, 1, 1); V is a scratchpad
+   of at least SCRYPT_SCRATCHPAD_SIZE(core->ways, N) bytes aligned to 64 bytes
  */
-static inline void
-salsa20_8(uint32_t B[16], const uint32_t Bx[16])
+static void scrypt_n_1_1_256_multi(const struct scrypt_core * const core, const unsigned int N, const uint32_t (*input)[20], const int n, void * const V, uint32_t (*ostate)[8])
 {
-	uint32_t x00,x01,x02,x03,x04,x05,x06,x07,x08,x09,x10,x11,x12,x13,x14,x15;
-	size_t i;
-
-	x00 = (B[ 0] ^= Bx[ 0]);
-	x01 = (B[ 1] ^= Bx[ 1]);
-	x02 = (B[ 2] ^= Bx[ 2]);
-	x03 = (B[ 3] ^= Bx[ 3]);
-	x04 = (B[ 4] ^= Bx[ 4]);
-	x05 = (B[ 5] ^= Bx[ 5]);
-	x06 = (B[ 6] ^= Bx[ 6]);
-	x07 = (B[ 7] ^= Bx[ 7]);
-	x08 = (B[ 8] ^= Bx[ 8]);
-	x09 = (B[ 9] ^= Bx[ 9]);
-	x10 = (B[10] ^= Bx[10]);
-	x11 = (B[11] ^= Bx[11]);
-	x12 = (B[12] ^= Bx[12]);
-	x13 = (B[13] ^= Bx[13]);
-	x14 = (B[14] ^= Bx[14]);
-	x15 = (B[15] ^= Bx[15]);
-	for (i = 0; i < 8; i += 2) {
-#define R(a,b) (((a) << (b)) | ((a) >> (32 - (b))))
-		/* Operate on columns. */
-		x04 ^= R(x00+x12, 7);	x09 ^= R(x05+x01, 7);	x14 ^= R(x10+x06, 7);	x03 ^= R(x15+x11, 7);
-		x08 ^= R(x04+x00, 9);	x13 ^= R(x09+x05, 9);	x02 ^= R(x14+x10, 9);	x07 ^= R(x03+x15, 9);
-		x12 ^= R(x08+x04,13);	x01 ^= R(x13+x09,13);	x06 ^= R(x02+x14,13);	x11 ^= R(x07+x03,13);
-		x00 ^= R(x12+x08,18);	x05 ^= R(x01+x13,18);	x10 ^= R(x06+x02,18);	x15 ^= R(x11+x07,18);
-
-		/* Operate on rows. */
-		x01 ^= R(x00+x03, 7);	x06 ^= R(x05+x04, 7);	x11 ^= R(x10+x09, 7);	x12 ^= R(x15+x14, 7);
-		x02 ^= R(x01+x00, 9);	x07 ^= R(x06+x05, 9);	x08 ^= R(x11+x10, 9);	x13 ^= R(x12+x15, 9);
-		x03 ^= R(x02+x01,13);	x04 ^= R(x07+x06,13);	x09 ^= R(x08+x11,13);	x14 ^= R(x13+x12,13);
-		x00 ^= R(x03+x02,18);	x05 ^= R(x04+x07,18);	x10 ^= R(x09+x08,18);	x15 ^= R(x14+x13,18);
-#undef R
+	uint32_t X[SCRYPT_MAX_WAYS][32];
+	int i;
+
+	/* Unused ways just repeat the last hash */
+	for (i = 0; i < core->ways; i++) {
+		if (i < n)
+			PBKDF2_SHA256_80_128(input[i], X[i]);
+		else
+			memcpy(X[i], X[n - 1], sizeof(X[i]));
 	}
-	B[ 0] += x00;
-	B[ 1] += x01;
-	B[ 2] += x02;
-	B[ 3] += x03;
-	B[ 4] += x04;
-	B[ 5] += x05;
-	B[ 6] += x06;
-	B[ 7] += x07;
-	B[ 8] += x08;
-	B[ 9] += x09;
-	B[10] += x10;
-	B[11] += x11;
-	B[12] += x12;
-	B[13] += x13;
-	B[14] += x14;
-	B[15] += x15;
+
+	core->func(X, V, N);
+
+	for (i = 0; i < n; i++)
+		PBKDF2_SHA256_80_128_32(input[i], X[i], ostate[i]);
 }
 
-/* cpu and memory intensive function to transform a 80 byte buffer into a 32 byte output
-   scratchpad size needs to be at least 63 + (128 * r * p) + (256 * r + 64) + (128 * r * N) bytes
- */
-static void scrypt_1024_1_1_256_sp(const uint32_t* input, char* scratchpad, uint32_t *ostate)
+/* Every thread doing scrypt keeps one scratchpad, big enough for the most ways
+ * and the largest N it has hashed so far, until it exits rather than
+ * allocating one for every hash. Threads that only verify hashes one at a
+ * time never grow theirs past one way. */
+struct scrypt_scratchpad {
+	void *mem;
+	size_t sz;
+	bool mmapped;
+	void *V;
+	size_t avail;
+};
+
+static pthread_key_t scrypt_scratchpad_key;
+static pthread_once_t scrypt_init_once = PTHREAD_ONCE_INIT;
+
+static
+void scrypt_scratchpad_release(struct scrypt_scratchpad * const sp)
 {
-	uint32_t * V;
-	uint32_t X[32];
-	uint32_t i;
-	uint32_t j;
-	uint32_t k;
-	uint64_t *p1, *p2;
+#ifdef MAP_ANONYMOUS
+	if (sp->mmapped)
+		munmap(sp->mem, sp->sz);
+	else
+#endif
+		free(sp->mem);
+}
 
-	p1 = (uint64_t *)X;
-	V = (uint32_t *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
+static
+void scrypt_scratchpad_free(void * const p)
+{
+	struct scrypt_scratchpad * const sp = p;
 
-	PBKDF2_SHA256_80_128(input, X);
+	scrypt_scratchpad_release(sp);
+	free(sp);
+}
 
-	for (i = 0; i < 1024; i += 2) {
-		memcpy(&V[i * 32], X, 128);
+static
+void scrypt_init(void)
+{
+	scrypt_core_select();
+	if (pthread_key_create(&scrypt_scratchpad_key, scrypt_scratchpad_free))
+		quithere(1, "pthread_key_create failed");
+}
 
-		salsa20_8(&X[0], &X[16]);
-		salsa20_8(&X[16], &X[0]);
+/* The core to hash several nonces at once with, chosen on first use */
+static
+const struct scrypt_core *scrypt_get_core_multi(void)
+{
+	pthread_once(&scrypt_init_once, scrypt_init);
+	return scrypt_core_multi;
+}
 
-		memcpy(&V[(i + 1) * 32], X, 128);
+#ifdef MAP_ANONYMOUS
+/* Tries to map the scratchpad onto huge pages: explicitly reserved ones if
+ * there are any, otherwise a 2 MiB aligned mapping the kernel can back with
+ * transparent huge pages */
+static
+bool scrypt_scratchpad_mmap(struct scrypt_scratchpad * const sp, size_t sz)
+{
+	uint8_t *p;
+	size_t off;
+
+	sz = (sz + SCRYPT_HUGEPAGE_SIZE - 1) & ~(size_t)(SCRYPT_HUGEPAGE_SIZE - 1);
+
+#ifdef MAP_HUGETLB
+	p = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (p != MAP_FAILED)
+		goto out;
+#endif
+
+	p = mmap(NULL, sz + SCRYPT_HUGEPAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return false;
+	off = (SCRYPT_HUGEPAGE_SIZE - ((uintptr_t)p & (SCRYPT_HUGEPAGE_SIZE - 1))) & (SCRYPT_HUGEPAGE_SIZE - 1);
+	if (off)
+		munmap(p, off);
+	munmap(&p[off + sz], SCRYPT_HUGEPAGE_SIZE - off);
+	p += off;
+#ifdef MADV_HUGEPAGE
+	madvise(p, sz, MADV_HUGEPAGE);
+#endif
+
+#ifdef MAP_HUGETLB
+out:
+#endif
+	sp->mem = sp->V = p;
+	sp->sz = sp->avail = sz;
+	sp->mmapped = true;
+	return true;
+}
+#endif
 
-		salsa20_8(&X[0], &X[16]);
-		salsa20_8(&X[16], &X[0]);
+/* Returns this thread's scratchpad, grown if need be to fit ways hashes of N */
+static
+void *scrypt_scratchpad(const int ways, const unsigned int N)
+{
+	struct scrypt_scratchpad *sp;
+	size_t sz;
+
+	pthread_once(&scrypt_init_once, scrypt_init);
+	sz = SCRYPT_SCRATCHPAD_SIZE(ways, N);
+	sp = pthread_getspecific(scrypt_scratchpad_key);
+	if (likely(sp && sp->avail >= sz))
+		return sp->V;
+
+	if (sp) {
+		applog(LOG_DEBUG, "Growing scrypt scratchpad for %d ways of N=%u", ways, N);
+		scrypt_scratchpad_release(sp);
+	} else {
+		sp = malloc(sizeof(*sp));
+		if (unlikely(!sp))
+			quithere(1, "Failed to malloc scratchpad");
+		if (pthread_setspecific(scrypt_scratchpad_key, sp))
+			quithere(1, "pthread_setspecific failed");
 	}
-	for (i = 0; i < 1024; i += 2) {
-		j = X[16] & 1023;
-		p2 = (uint64_t *)(&V[j * 32]);
-		for(k = 0; k < 16; k++)
-			p1[k] ^= p2[k];
-
-		salsa20_8(&X[0], &X[16]);
-		salsa20_8(&X[16], &X[0]);
-
-		j = X[16] & 1023;
-		p2 = (uint64_t *)(&V[j * 32]);
-		for(k = 0; k < 16; k++)
-			p1[k] ^= p2[k];
-
-		salsa20_8(&X[0], &X[16]);
-		salsa20_8(&X[16], &X[0]);
+#ifdef MAP_ANONYMOUS
+	if (!scrypt_scratchpad_mmap(sp, sz))
+#endif
+	{
+		sp->sz = sz + 63;
+		sp->mem = malloc(sp->sz);
+		if (unlikely(!sp->mem))
+			quithere(1, "Failed to malloc scratchpad");
+		sp->mmapped = false;
+		sp->V = (void *)(((uintptr_t)sp->mem + 63) & ~(uintptr_t)63);
+		sp->avail = sz;
 	}
 
-	PBKDF2_SHA256_80_128_32(input, X, ostate);
+	return sp->V;
 }
 
-/* 131583 rounded up to 4 byte alignment */
-#define SCRATCHBUF_SIZE	(131584)
+/* Parses a list of N values for a pool: a plain N applies to all work, and
+ * "ntime:N" entries (in ntime order) switch N from that block time onward,
+ * for coins whose N grows on a schedule. Work before the first entry's ntime
+ * uses SCRYPT_DEFAULT_N. On success, *out is replaced with the new list. */
+const char *scrypt_parse_n_steps(const char * const arg, struct scrypt_n_step ** const out)
+{
+	struct scrypt_n_step *steps = NULL, *tmp;
+	const char *p = arg;
+	char *end;
+	unsigned long ntime, N;
+	int count = 0;
+
+	while (true) {
+		ntime = 0;
+		N = strtoul(p, &end, 0);
+		if (end != p && *end == ':') {
+			ntime = N;
+			p = &end[1];
+			N = strtoul(p, &end, 0);
+		}
+		if (end == p || (*end && *end != ',') || ntime > UINT32_MAX) {
+			free(steps);
+			return "Invalid scrypt N list";
+		}
+		if (N < 2 || N > SCRYPT_MAX_N || (N & (N - 1))) {
+			free(steps);
+			return "scrypt N must be a power of 2 no larger than 1048576";
+		}
+		if (count && ntime <= steps[count - 1].ntime) {
+			free(steps);
+			return "scrypt N list must be in ntime order";
+		}
+
+		tmp = realloc(steps, sizeof(*steps) * (count + 2));
+		if (unlikely(!tmp))
+			quithere(1, "Failed to realloc scrypt N list");
+		steps = tmp;
+		steps[count].ntime = ntime;
+		steps[count].n = N;
+		++count;
+
+		if (!*end)
+			break;
+		p = &end[1];
+	}
+	steps[count].n = 0;
+
+	free(*out);
+	*out = steps;
+	return NULL;
+}
+
+/* The N to hash work with, per its pool's settings and block time */
+unsigned int scrypt_work_n(const struct work * const work)
+{
+	const struct scrypt_n_step *step;
+	unsigned int N = SCRYPT_DEFAULT_N;
+	uint32_t ntime;
+
+	if (!(work->pool && work->pool->scrypt_n_steps))
+		return N;
+
+	ntime = be32toh(*(const uint32_t *)&work->data[68]);
+	for (step = work->pool->scrypt_n_steps; step->n && step->ntime <= ntime; ++step)
+		N = step->n;
+	return N;
+}
 
 void scrypt_regenhash(struct work *work)
 {
-	uint32_t data[20];
-	char *scratchbuf;
+	const unsigned int N = scrypt_work_n(work);
+	uint32_t data[1][20];
 	uint32_t *nonce = (uint32_t *)(work->data + 76);
-	uint32_t *ohash = (uint32_t *)(work->hash);
+	uint32_t (*ohash)[8] = (uint32_t (*)[8])(work->hash);
 
-	be32enc_vect(data, (const uint32_t *)work->data, 19);
-	data[19] = htobe32(*nonce);
-	scratchbuf = alloca(SCRATCHBUF_SIZE);
-	scrypt_1024_1_1_256_sp(data, scratchbuf, ohash);
+	be32enc_vect(data[0], (const uint32_t *)work->data, 19);
+	data[0][19] = htobe32(*nonce);
+	scrypt_n_1_1_256_multi(&scrypt_core_single, N, data, 1, scrypt_scratchpad(1, N), ohash);
 	flip32(ohash, ohash);
 }
 
 static const uint32_t diff1targ = 0x0000ffff;
 
 /* Used externally as confirmation of correct OCL code */
-int scrypt_test(unsigned char *pdata, const unsigned char *ptarget, uint32_t nonce)
+int scrypt_test(unsigned char *pdata, const unsigned char *ptarget, uint32_t nonce, const unsigned int N)
 {
 	uint32_t tmp_hash7, Htarg = le32toh(((const uint32_t *)ptarget)[7]);
-	uint32_t data[20], ohash[8];
-	char *scratchbuf;
+	uint32_t data[1][20], ohash[1][8];
 
-	be32enc_vect(data, (const uint32_t *)pdata, 19);
-	data[19] = htobe32(nonce);
-	scratchbuf = alloca(SCRATCHBUF_SIZE);
-	scrypt_1024_1_1_256_sp(data, scratchbuf, ohash);
-	tmp_hash7 = be32toh(ohash[7]);
+	be32enc_vect(data[0], (const uint32_t *)pdata, 19);
+	data[0][19] = htobe32(nonce);
+	scrypt_n_1_1_256_multi(&scrypt_core_single, N, data, 1, scrypt_scratchpad(1, N), ohash);
+	tmp_hash7 = be32toh(ohash[0][7]);
 
 	applog(LOG_DEBUG, "htarget %08lx diff1 %08lx hash %08lx",
 				(long unsigned int)Htarg,
@@ -449,44 +632,111 @@ int scrypt_test(unsigned char *pdata, const unsigned char *ptarget, uint32_t non
 bool scanhash_scrypt(struct thr_info *thr, const unsigned char __maybe_unused *pmidstate,
 		     unsigned char *pdata, unsigned char __maybe_unused *phash1,
 		     unsigned char __maybe_unused *phash, const unsigned char *ptarget,
-		     uint32_t max_nonce, uint32_t *last_nonce, uint32_t n)
+		     uint32_t max_nonce, uint32_t *last_nonce, uint32_t n,
+		     const unsigned int N)
 {
 	uint32_t *nonce = (uint32_t *)(pdata + 76);
-	char *scratchbuf;
-	uint32_t data[20];
+	const struct scrypt_core * const core = scrypt_get_core_multi();
+	void * const V = scrypt_scratchpad(core->ways, N);
+	uint32_t data[SCRYPT_MAX_WAYS][20];
+	uint32_t ostate[SCRYPT_MAX_WAYS][8];
 	uint32_t tmp_hash7;
 	uint32_t Htarg = le32toh(((const uint32_t *)ptarget)[7]);
-	bool ret = false;
+	int i;
 
-	be32enc_vect(data, (const uint32_t *)pdata, 19);
-
-	scratchbuf = malloc(SCRATCHBUF_SIZE);
-	if (unlikely(!scratchbuf)) {
-		applog(LOG_ERR, "Failed to malloc scratchbuf in scanhash_scrypt");
-		return ret;
-	}
+	be32enc_vect(data[0], (const uint32_t *)pdata, 19);
+	for (i = 1; i < core->ways; i++)
+		memcpy(data[i], data[0], 19 * 4);
 
 	while(1) {
-		uint32_t ostate[8];
-
-		*nonce = ++n;
-		data[19] = htobe32(n);
-		scrypt_1024_1_1_256_sp(data, scratchbuf, ostate);
-		tmp_hash7 = be32toh(ostate[7]);
-
-		if (unlikely(tmp_hash7 <= Htarg)) {
-			((uint32_t *)pdata)[19] = htobe32(n);
-			*last_nonce = n;
-			ret = true;
-			break;
+		for (i = 0; i < core->ways; i++)
+			data[i][19] = htobe32(n + 1 + i);
+		scrypt_n_1_1_256_multi(core, N, data, core->ways, V, ostate);
+
+		for (i = 0; i < core->ways; i++) {
+			// Ways past max_nonce belong to the next scan
+			if (unlikely((uint64_t)n + 1 + i > max_nonce))
+				break;
+			tmp_hash7 = be32toh(ostate[i][7]);
+			if (unlikely(tmp_hash7 <= Htarg)) {
+				n += 1 + i;
+				((uint32_t *)pdata)[19] = htobe32(n);
+				*last_nonce = n;
+				return true;
+			}
 		}
 
-		if (unlikely((n >= max_nonce) || thr->work_restart)) {
-			*last_nonce = n;
-			break;
+		if (unlikely(((uint64_t)n + core->ways >= max_nonce) || thr->work_restart)) {
+			// Don't wrap around past max_nonce at the top of the range
+			*last_nonce = ((uint64_t)n + core->ways >= max_nonce) ? max_nonce : n + core->ways;
+			*nonce = *last_nonce;
+			return false;
 		}
+		n += core->ways;
 	}
+}
 
-	free(scratchbuf);;
-	return ret;
+/* Block headers, as hex in block chain byte order, whose nonces are winners
+ * at their own targets: Litecoin block 0 */
+const char * const test_scrypt_block_headers[] = {
+	"01000000" "0000000000000000000000000000000000000000000000000000000000000000"
+	"d9ced4ed1130f7b7faad9be25323ffafa33232a17c3edf6cfd97bee6bafbdd97" "b9aa8e4e" "f0ff0f1e" "cd513f7c",
+	NULL
+};
+
+/* Known answers for every scrypt core the CPU supports, at Litecoin's N and
+ * others: the winning nonce goes in the last way, and the other ways must
+ * match the 1-way core */
+void test_scrypt()
+{
+	static const struct {
+		unsigned int N;
+		const char *hash;
+	} tests[] = {
+		{1024, "001e67b013726fd7382e9acb69165b4b6316227fb3156b5b414ba6340c050000"},
+		{2048, "e938f7415d4e570a2d0ee5997caabafd0154a893d3a16325e9c0343129c6b9d5"},
+		{16, "e68b3ecfaec3bf8ce2a558902ab2d07c3c072d7302c9879efff6d57178cd279f"},
+	};
+	struct work work;
+	uint32_t data[SCRYPT_MAX_WAYS][20], ohash[SCRYPT_MAX_WAYS][8], expect[8];
+	uint32_t win;
+	void *V;
+	int i, j, k;
+
+	test_header_work(&work, test_scrypt_block_headers[0]);
+	win = le32toh(*(uint32_t *)&work.data[76]);
+	if (scrypt_test(work.data, work.target, win, SCRYPT_DEFAULT_N) != 1)
+		applog(LOG_ERR, "%s: scrypt_test did not accept nonce %08lx", __func__, (unsigned long)win);
+	if (scrypt_test(work.data, work.target, win + 1, SCRYPT_DEFAULT_N) == 1)
+		applog(LOG_ERR, "%s: scrypt_test accepted nonce %08lx", __func__, (unsigned long)win + 1);
+
+	for (i = 0; i < (int)ARRAY_SIZE(tests); ++i)
+	{
+		const unsigned int N = tests[i].N;
+		// The cores give the hash as big endian words
+		hex2bin((void *)expect, tests[i].hash, 32);
+		for (k = 0; k < 8; ++k)
+			expect[k] = be32toh(expect[k]);
+		for (j = 0; j < (int)ARRAY_SIZE(scrypt_cores); ++j)
+		{
+			const struct scrypt_core * const core = &scrypt_cores[j];
+			if (!scrypt_core_supported(core))
+				continue;
+			V = scrypt_scratchpad(core->ways, N);
+			for (k = 0; k < core->ways; ++k)
+			{
+				be32enc_vect(data[k], (const uint32_t *)work.data, 19);
+				data[k][19] = htobe32(win - (core->ways - 1) + k);
+			}
+			scrypt_n_1_1_256_multi(core, N, (const uint32_t (*)[20])data, core->ways, V, ohash);
+			if (memcmp(ohash[core->ways - 1], expect, 32))
+				applog(LOG_ERR, "%s: %s core gave the wrong hash with N=%u", __func__, core->name, N);
+			for (k = 0; k < core->ways - 1; ++k)
+			{
+				scrypt_n_1_1_256_multi(&scrypt_core_single, N, (const uint32_t (*)[20])&data[k], 1, V, &ohash[SCRYPT_MAX_WAYS - 1]);
+				if (memcmp(ohash[k], ohash[SCRYPT_MAX_WAYS - 1], 32))
+					applog(LOG_ERR, "%s: %s core way %d disagrees with the 1-way core with N=%u", __func__, core->name, k, N);
+			}
+		}
+	}
 }
@@ -5,15 +5,41 @@
 
 #include "miner.h"
 
+/* Litecoin's N; coins using other values are configured per pool */
+#define SCRYPT_DEFAULT_N  1024
+#define SCRYPT_MAX_N  0x100000
+
+/* A pool's N from a given ntime onward; lists end with n == 0 */
+struct scrypt_n_step {
+	uint32_t ntime;
+	unsigned int n;
+};
+
 #ifdef USE_SCRYPT
 extern int scrypt_test(unsigned char *pdata, const unsigned char *ptarget,
-			uint32_t nonce);
+			uint32_t nonce, unsigned int N);
 extern void scrypt_regenhash(struct work *work);
+extern const char *scrypt_parse_n_steps(const char *arg, struct scrypt_n_step **out);
+extern unsigned int scrypt_work_n(const struct work *work);
+extern const char * const test_scrypt_block_headers[];
+extern void test_scrypt();
+
+/* Wider ROMix cores, built separately with the instruction sets they need */
+#ifdef HAVE_AVX2
+extern void scrypt_core_4way_avx2(uint32_t (*X)[32], void *V, unsigned int N);
+#endif
+#ifdef HAVE_AVX512F
+extern void scrypt_core_8way_avx512(uint32_t (*X)[32], void *V, unsigned int N);
+#endif
+#ifdef HAVE_NEON
+extern void scrypt_core_3way_neon(uint32_t (*X)[32], void *V, unsigned int N);
+#endif
 
 #else /* USE_SCRYPT */
 static inline int scrypt_test(__maybe_unused unsigned char *pdata,
 			       __maybe_unused const unsigned char *ptarget,
-			       __maybe_unused uint32_t nonce)
+			       __maybe_unused uint32_t nonce,
+			       __maybe_unused unsigned int N)
 {
 	return 0;
 }
@@ -21,6 +47,11 @@ static inline int scrypt_test(__maybe_unused unsigned char *pdata,
 static inline void scrypt_regenhash(__maybe_unused struct work *work)
 {
 }
+
+static inline unsigned int scrypt_work_n(__maybe_unused const struct work *work)
+{
+	return SCRYPT_DEFAULT_N;
+}
 #endif /* USE_SCRYPT */
 
 #endif /* SCRYPT_H */
@@ -0,0 +1,17 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+// 4-way scrypt ROMix core: two hashes per 256-bit AVX2 vector, two vectors
+
+#include "config.h"
+
+#include "scrypt.h"
+
+#define SCRYPT_NWAY_VW  2
+#define SCRYPT_NWAY_GROUPS  2
+#define SCRYPT_NWAY_CORE  scrypt_core_4way_avx2
+#include "scrypt_nway.h"
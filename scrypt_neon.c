@@ -0,0 +1,17 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+// 3-way scrypt ROMix core: one hash per 128-bit NEON vector, three vectors
+
+#include "config.h"
+
+#include "scrypt.h"
+
+#define SCRYPT_NWAY_VW  1
+#define SCRYPT_NWAY_GROUPS  3
+#define SCRYPT_NWAY_CORE  scrypt_core_3way_neon
+#include "scrypt_nway.h"
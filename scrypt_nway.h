@@ -0,0 +1,158 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* N-way scrypt ROMix core (r=1, any power of 2 N), written with GCC vector extensions.
+ * Each hash keeps its salsa20/8 state as four 128-bit diagonals, so a vector
+ * of SCRYPT_NWAY_VW * 4 words holds SCRYPT_NWAY_VW hashes, and
+ * SCRYPT_NWAY_GROUPS such vectors are interleaved to keep the SIMD units
+ * busy. Each hash's copies of X are stored whole in V, so they are written
+ * in order and read back with plain vector loads. Include it after defining:
+ *   SCRYPT_NWAY_VW      hashes per vector (the SIMD width / 128 bits)
+ *   SCRYPT_NWAY_GROUPS  vectors interleaved (1-4)
+ *   SCRYPT_NWAY_CORE    name of the function to define:
+ *     void SCRYPT_NWAY_CORE(uint32_t (*X)[32], void *V, unsigned int N);
+ *   which runs SCRYPT_NWAY_VW * SCRYPT_NWAY_GROUPS hashes' X through ROMix
+ *   in place, using V as scratchpad (128 * N bytes per hash, 64-byte
+ *   aligned).
+ * It can be included more than once in the same file. */
+
+#include <stdint.h>
+#include <string.h>
+
+#define SCRYPT_NWAY_WAYS  (SCRYPT_NWAY_VW * SCRYPT_NWAY_GROUPS)
+#define SCRYPT_NWAY_PASTE2(a, b)  a ## _ ## b
+#define SCRYPT_NWAY_PASTE(a, b)  SCRYPT_NWAY_PASTE2(a, b)
+#define SCRYPT_NWAY_(name)  SCRYPT_NWAY_PASTE(SCRYPT_NWAY_CORE, name)
+
+typedef uint32_t SCRYPT_NWAY_(vec_t) __attribute__((vector_size(16 * SCRYPT_NWAY_VW)));
+typedef uint32_t SCRYPT_NWAY_(row_t) __attribute__((vector_size(16)));
+
+union SCRYPT_NWAY_(x) {
+	SCRYPT_NWAY_(vec_t) v;
+	SCRYPT_NWAY_(row_t) row[SCRYPT_NWAY_VW];
+	uint32_t u[SCRYPT_NWAY_VW][4];
+};
+
+#ifndef SCRYPT_NWAY_ROT4
+/* Shuffle masks rotating every hash's diagonal by k words */
+#define SCRYPT_NWAY_ROT4(k, b)  (b) + ((k) & 3), (b) + (((k) + 1) & 3), (b) + (((k) + 2) & 3), (b) + (((k) + 3) & 3)
+#define SCRYPT_NWAY_ROT_1(k)  { SCRYPT_NWAY_ROT4(k, 0) }
+#define SCRYPT_NWAY_ROT_2(k)  { SCRYPT_NWAY_ROT4(k, 0), SCRYPT_NWAY_ROT4(k, 4) }
+#define SCRYPT_NWAY_ROT_4(k)  { SCRYPT_NWAY_ROT4(k, 0), SCRYPT_NWAY_ROT4(k, 4), SCRYPT_NWAY_ROT4(k, 8), SCRYPT_NWAY_ROT4(k, 12) }
+
+/* Repeats a statement for each group g, with g a constant so nothing is left
+ * for the compiler to unroll */
+#define SCRYPT_NWAY_EACH_1(s)  do { { const int g = 0; s; } } while (0)
+#define SCRYPT_NWAY_EACH_2(s)  do { { const int g = 0; s; } { const int g = 1; s; } } while (0)
+#define SCRYPT_NWAY_EACH_3(s)  do { SCRYPT_NWAY_EACH_2(s); { const int g = 2; s; } } while (0)
+#define SCRYPT_NWAY_EACH_4(s)  do { SCRYPT_NWAY_EACH_3(s); { const int g = 3; s; } } while (0)
+
+#define SCRYPT_NWAY_R(a, b)  (((a) << (b)) | ((a) >> (32 - (b))))
+
+/* Word order within the diagonals: (0,5,10,15) (4,9,14,3) (8,13,2,7) (12,1,6,11) */
+static const uint8_t scrypt_nway_diag[16] = {0, 5, 10, 15, 4, 9, 14, 3, 8, 13, 2, 7, 12, 1, 6, 11};
+#endif
+
+#define SCRYPT_NWAY_ROTV  SCRYPT_NWAY_PASTE(SCRYPT_NWAY_ROT, SCRYPT_NWAY_VW)
+#define SCRYPT_NWAY_EACHG  SCRYPT_NWAY_PASTE(SCRYPT_NWAY_EACH, SCRYPT_NWAY_GROUPS)
+
+/* salsa20_8(X[b], X[bx]) for every hash */
+static inline __attribute__((always_inline))
+void SCRYPT_NWAY_(salsa20_8)(union SCRYPT_NWAY_(x) (* const X)[8], const int b, const int bx)
+{
+	static const SCRYPT_NWAY_(vec_t) rot1 = SCRYPT_NWAY_ROTV(1), rot2 = SCRYPT_NWAY_ROTV(2), rot3 = SCRYPT_NWAY_ROTV(3);
+	SCRYPT_NWAY_(vec_t) x0[SCRYPT_NWAY_GROUPS], x1[SCRYPT_NWAY_GROUPS], x2[SCRYPT_NWAY_GROUPS], x3[SCRYPT_NWAY_GROUPS];
+	int i;
+
+	SCRYPT_NWAY_EACHG(
+		x0[g] = (X[g][b + 0].v ^= X[g][bx + 0].v);
+		x1[g] = (X[g][b + 1].v ^= X[g][bx + 1].v);
+		x2[g] = (X[g][b + 2].v ^= X[g][bx + 2].v);
+		x3[g] = (X[g][b + 3].v ^= X[g][bx + 3].v);
+	);
+	for (i = 0; i < 8; i += 2) {
+		/* Operate on columns. */
+		SCRYPT_NWAY_EACHG(x1[g] ^= SCRYPT_NWAY_R(x0[g] + x3[g], 7));
+		SCRYPT_NWAY_EACHG(x2[g] ^= SCRYPT_NWAY_R(x1[g] + x0[g], 9));
+		SCRYPT_NWAY_EACHG(x3[g] ^= SCRYPT_NWAY_R(x2[g] + x1[g], 13));
+		SCRYPT_NWAY_EACHG(x0[g] ^= SCRYPT_NWAY_R(x3[g] + x2[g], 18));
+
+		/* Rotate the diagonals so the rows line up */
+		SCRYPT_NWAY_EACHG(
+			x1[g] = __builtin_shuffle(x1[g], rot3);
+			x2[g] = __builtin_shuffle(x2[g], rot2);
+			x3[g] = __builtin_shuffle(x3[g], rot1);
+		);
+
+		/* Operate on rows. */
+		SCRYPT_NWAY_EACHG(x3[g] ^= SCRYPT_NWAY_R(x0[g] + x1[g], 7));
+		SCRYPT_NWAY_EACHG(x2[g] ^= SCRYPT_NWAY_R(x3[g] + x0[g], 9));
+		SCRYPT_NWAY_EACHG(x1[g] ^= SCRYPT_NWAY_R(x2[g] + x3[g], 13));
+		SCRYPT_NWAY_EACHG(x0[g] ^= SCRYPT_NWAY_R(x1[g] + x2[g], 18));
+
+		SCRYPT_NWAY_EACHG(
+			x1[g] = __builtin_shuffle(x1[g], rot1);
+			x2[g] = __builtin_shuffle(x2[g], rot2);
+			x3[g] = __builtin_shuffle(x3[g], rot3);
+		);
+	}
+	SCRYPT_NWAY_EACHG(
+		X[g][b + 0].v += x0[g];
+		X[g][b + 1].v += x1[g];
+		X[g][b + 2].v += x2[g];
+		X[g][b + 3].v += x3[g];
+	);
+}
+
+void SCRYPT_NWAY_CORE(uint32_t (* const X)[32], void * const scratchpad, const unsigned int N)
+{
+	SCRYPT_NWAY_(row_t) * const V = scratchpad;
+	union SCRYPT_NWAY_(x) x[SCRYPT_NWAY_GROUPS][8];
+	uint32_t j[SCRYPT_NWAY_WAYS];
+	unsigned int i;
+	int k, w;
+
+	for (w = 0; w < SCRYPT_NWAY_WAYS; w++)
+		for (k = 0; k < 32; k++)
+			x[w / SCRYPT_NWAY_VW][k / 4].u[w % SCRYPT_NWAY_VW][k % 4] = X[w][(k & ~15) + scrypt_nway_diag[k & 15]];
+
+	for (i = 0; i < N; i++) {
+		memcpy(&V[i * 8 * SCRYPT_NWAY_WAYS], x, sizeof(x));
+
+		SCRYPT_NWAY_(salsa20_8)(x, 0, 4);
+		SCRYPT_NWAY_(salsa20_8)(x, 4, 0);
+	}
+	for (i = 0; i < N; i++) {
+		/* Row 0 of each hash's X[j], laid out as it was written above */
+		for (w = 0; w < SCRYPT_NWAY_WAYS; w++)
+			j[w] = (x[w / SCRYPT_NWAY_VW][4].u[w % SCRYPT_NWAY_VW][0] & (N - 1)) * 8 * SCRYPT_NWAY_WAYS
+			     + (w / SCRYPT_NWAY_VW) * 8 * SCRYPT_NWAY_VW + (w % SCRYPT_NWAY_VW);
+		for (k = 0; k < 8; k++) {
+			SCRYPT_NWAY_EACHG(
+				union SCRYPT_NWAY_(x) y;
+				for (w = 0; w < SCRYPT_NWAY_VW; w++)
+					y.row[w] = V[j[g * SCRYPT_NWAY_VW + w] + k * SCRYPT_NWAY_VW];
+				x[g][k].v ^= y.v;
+			);
+		}
+
+		SCRYPT_NWAY_(salsa20_8)(x, 0, 4);
+		SCRYPT_NWAY_(salsa20_8)(x, 4, 0);
+	}
+
+	for (w = 0; w < SCRYPT_NWAY_WAYS; w++)
+		for (k = 0; k < 32; k++)
+			X[w][(k & ~15) + scrypt_nway_diag[k & 15]] = x[w / SCRYPT_NWAY_VW][k / 4].u[w % SCRYPT_NWAY_VW][k % 4];
+}
+
+#undef SCRYPT_NWAY_EACHG
+#undef SCRYPT_NWAY_ROTV
+#undef SCRYPT_NWAY_
+#undef SCRYPT_NWAY_WAYS
+#undef SCRYPT_NWAY_CORE
+#undef SCRYPT_NWAY_GROUPS
+#undef SCRYPT_NWAY_VW
@@ -85,6 +85,19 @@ uint32_t sha256_k[64] =
 
 /* SHA-256 functions */
 
+/* True if sha256_transf hands blocks to the CPU's own SHA-256 instructions */
+static inline
+bool sha256_use_hw(void)
+{
+#if defined(HAVE_SHANI)
+    return sha256_shani_available();
+#elif defined(HAVE_ARMCE)
+    return sha256_armce_available();
+#else
+    return false;
+#endif
+}
+
 void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
                    unsigned int block_nb)
 {
@@ -96,6 +109,19 @@ void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
 
     int j;
 
+#ifdef HAVE_SHANI
+    if (sha256_use_hw()) {
+        sha256_shani_transf(ctx->h, message, block_nb);
+        return;
+    }
+#endif
+#ifdef HAVE_ARMCE
+    if (sha256_use_hw()) {
+        sha256_armce_transf(ctx->h, message, block_nb);
+        return;
+    }
+#endif
+
     for (i = 0; i < (int) block_nb; i++) {
         sub_block = message + (i << 6);
 
@@ -131,6 +157,271 @@ void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
     }
 }
 
+/* Lanes for the generic vector code: 128-bit vectors map onto SSE2,
+   NEON and AltiVec alike, and GCC makes scalar code of them elsewhere */
+#define SHA256_LANES 4
+
+typedef uint32_t sha256_lanes_t __attribute__((vector_size(SHA256_LANES * 4)));
+
+#define LANES_ROTR(x, n)  (((x) >> (n)) | ((x) << (32 - (n))))
+#define LANES_CH(x, y, z)  ((z) ^ ((x) & ((y) ^ (z))))
+#define LANES_MAJ(x, y, z)  (((x) & (y)) | ((z) & ((x) | (y))))
+#define LANES_F1(x)  (LANES_ROTR(x,  2) ^ LANES_ROTR(x, 13) ^ LANES_ROTR(x, 22))
+#define LANES_F2(x)  (LANES_ROTR(x,  6) ^ LANES_ROTR(x, 11) ^ LANES_ROTR(x, 25))
+#define LANES_F3(x)  (LANES_ROTR(x,  7) ^ LANES_ROTR(x, 18) ^ ((x) >>  3))
+#define LANES_F4(x)  (LANES_ROTR(x, 17) ^ LANES_ROTR(x, 19) ^ ((x) >> 10))
+
+/* One block for a state per lane; w[0..15] hold the message words and the
+   rest of w is used for the message schedule */
+static inline
+void sha256_transf_lanes(sha256_lanes_t * const h, sha256_lanes_t * const w)
+{
+    sha256_lanes_t wv[8], t1, t2;
+    int j;
+
+    for (j = 16; j < 64; j++)
+        w[j] = LANES_F4(w[j - 2]) + w[j - 7] + LANES_F3(w[j - 15]) + w[j - 16];
+
+    memcpy(wv, h, sizeof(wv));
+    for (j = 0; j < 64; j++) {
+        t1 = wv[7] + LANES_F2(wv[4]) + LANES_CH(wv[4], wv[5], wv[6]) + sha256_k[j] + w[j];
+        t2 = LANES_F1(wv[0]) + LANES_MAJ(wv[0], wv[1], wv[2]);
+        wv[7] = wv[6];
+        wv[6] = wv[5];
+        wv[5] = wv[4];
+        wv[4] = wv[3] + t1;
+        wv[3] = wv[2];
+        wv[2] = wv[1];
+        wv[1] = wv[0];
+        wv[0] = t1 + t2;
+    }
+
+    for (j = 0; j < 8; j++)
+        h[j] += wv[j];
+}
+
+#if defined(__SSE2__) || defined(__ARM_NEON)
+
+/* One block for each of 4 independent states, one state per lane */
+static
+void sha256_transf_4way(uint32_t (* const h)[8], const unsigned char * const * const blocks)
+{
+    union {
+        sha256_lanes_t v;
+        uint32_t u[SHA256_LANES];
+    } box;
+    sha256_lanes_t hv[8], w[64];
+    int i, j;
+
+    for (j = 0; j < 16; j++) {
+        for (i = 0; i < 4; i++)
+            PACK32(&blocks[i][j << 2], &box.u[i]);
+        w[j] = box.v;
+    }
+
+    for (j = 0; j < 8; j++) {
+        for (i = 0; i < 4; i++)
+            box.u[i] = h[i][j];
+        hv[j] = box.v;
+    }
+
+    sha256_transf_lanes(hv, w);
+
+    for (j = 0; j < 8; j++) {
+        box.v = hv[j];
+        for (i = 0; i < 4; i++)
+            h[i][j] = box.u[i];
+    }
+}
+
+#endif  /* __SSE2__ || __ARM_NEON */
+
+/* Processes one 64-byte block for each of n independent hash states */
+void sha256_transf_multi(uint32_t (*h)[8], const unsigned char * const *blocks,
+                         int n)
+{
+    sha256_ctx ctx;
+    int i;
+
+#if defined(__SSE2__) || defined(__ARM_NEON)
+    /* One lane at a time with SHA instructions still beats 4 vector lanes */
+    while (n > 1 && !sha256_use_hw()) {
+        const unsigned char *lane_blocks[4];
+        uint32_t lane_h[4][8];
+        const int lanes = (n < 4) ? n : 4;
+
+        /* Idle lanes just repeat the first one */
+        for (i = 0; i < 4; i++) {
+            const int l = (i < lanes) ? i : 0;
+            lane_blocks[i] = blocks[l];
+            memcpy(lane_h[i], h[l], sizeof(lane_h[i]));
+        }
+        sha256_transf_4way(lane_h, lane_blocks);
+        for (i = 0; i < lanes; i++)
+            memcpy(h[i], lane_h[i], sizeof(h[i]));
+
+        h += lanes;
+        blocks += lanes;
+        n -= lanes;
+    }
+#endif
+
+    for (i = 0; i < n; i++) {
+        memcpy(ctx.h, h[i], sizeof(ctx.h));
+        sha256_transf(&ctx, blocks[i], 1);
+        memcpy(h[i], ctx.h, sizeof(ctx.h));
+    }
+}
+
+static
+uint32_t sha256d_80_h7(const uint32_t *midstate, const uint32_t *tail)
+{
+    unsigned char block[SHA256_BLOCK_SIZE];
+    sha256_ctx ctx;
+    int j;
+
+    memcpy(ctx.h, midstate, sizeof(ctx.h));
+    memset(block, 0, sizeof(block));
+    for (j = 0; j < 4; j++)
+        UNPACK32(tail[j], &block[j << 2]);
+    block[16] = 0x80;
+    UNPACK32(80 << 3, &block[60]);
+    sha256_transf(&ctx, block, 1);
+
+    memset(block, 0, sizeof(block));
+    for (j = 0; j < 8; j++)
+        UNPACK32(ctx.h[j], &block[j << 2]);
+    block[32] = 0x80;
+    UNPACK32(32 << 3, &block[60]);
+    memcpy(ctx.h, sha256_h0, sizeof(ctx.h));
+    sha256_transf(&ctx, block, 1);
+
+    return ctx.h[7];
+}
+
+/* Sets h7[i] to the last word of SHA-256d(header) for n 80-byte headers,
+   each given as the midstate of its first 64 bytes and its last 16 bytes as
+   big endian words. Only a zero h7 can be a share, so this weeds out bad
+   nonces several at a time before anything else needs hashing in full. */
+void sha256d_80_h7_multi(const uint32_t * const *midstates,
+                         const uint32_t (*tails)[4], uint32_t *h7, int n)
+{
+    union {
+        sha256_lanes_t v;
+        uint32_t u[SHA256_LANES];
+    } box;
+    sha256_lanes_t h[8], w[64];
+    int i, j, l, lanes;
+
+    if (sha256_use_hw()) {
+        for (i = 0; i < n; i++)
+            h7[i] = sha256d_80_h7(midstates[i], tails[i]);
+        return;
+    }
+
+    for (i = 0; i < n; i += lanes) {
+        lanes = (n - i < SHA256_LANES) ? (n - i) : SHA256_LANES;
+
+        /* Idle lanes just repeat the first one */
+        for (j = 0; j < 8; j++) {
+            for (l = 0; l < SHA256_LANES; l++)
+                box.u[l] = midstates[i + ((l < lanes) ? l : 0)][j];
+            h[j] = box.v;
+        }
+        for (j = 0; j < 4; j++) {
+            for (l = 0; l < SHA256_LANES; l++)
+                box.u[l] = tails[i + ((l < lanes) ? l : 0)][j];
+            w[j] = box.v;
+        }
+        w[4] = (sha256_lanes_t){} + 0x80000000;
+        for (j = 5; j < 15; j++)
+            w[j] = (sha256_lanes_t){};
+        w[15] = (sha256_lanes_t){} + (80 << 3);
+        sha256_transf_lanes(h, w);
+
+        for (j = 0; j < 8; j++) {
+            w[j] = h[j];
+            h[j] = (sha256_lanes_t){} + sha256_h0[j];
+        }
+        w[8] = (sha256_lanes_t){} + 0x80000000;
+        for (j = 9; j < 15; j++)
+            w[j] = (sha256_lanes_t){};
+        w[15] = (sha256_lanes_t){} + (32 << 3);
+        sha256_transf_lanes(h, w);
+
+        box.v = h[7];
+        for (l = 0; l < lanes; l++)
+            h7[i + l] = box.u[l];
+    }
+}
+
+/* Copies the part of src, which sits at src_off in a message, that falls in
+ * the 64-byte block at off */
+static inline
+void sha256_multi_fill(unsigned char * const block, const unsigned int off,
+                       const unsigned char * const src,
+                       const unsigned int src_off, const unsigned int src_len)
+{
+    const unsigned int start = (src_off > off) ? src_off : off;
+    const unsigned int end = (src_off + src_len < off + SHA256_BLOCK_SIZE)
+                           ? (src_off + src_len) : (off + SHA256_BLOCK_SIZE);
+
+    if (start < end)
+        memcpy(&block[start - off], &src[start - src_off], end - start);
+}
+
+/* Computes digests[i] = SHA-256(base || messages[i] || tail) for n messages
+ * of the same length; base may be NULL to start from the initial state.
+ * Each padded block is put together as it is needed, so any length of
+ * message only needs one block per lane. */
+void sha256_multi(const sha256_ctx *base, const unsigned char * const *messages,
+                  unsigned int len, const unsigned char *tail,
+                  unsigned int tail_len, unsigned char * const *digests, int n)
+{
+    const unsigned int head_len = base ? base->len : 0;
+    const unsigned int msg_len = head_len + len + tail_len;
+    const unsigned int len_b = ((base ? base->tot_len : 0) + msg_len) << 3;
+    const unsigned int block_nb = (msg_len + 8) / SHA256_BLOCK_SIZE + 1;
+    unsigned char bufs[SHA256_MB_LANES][SHA256_BLOCK_SIZE];
+    const unsigned char *blocks[SHA256_MB_LANES];
+    uint32_t h[SHA256_MB_LANES][8];
+    unsigned int k, off;
+    int i, j, lanes;
+
+    for (j = 0; j < SHA256_MB_LANES; j++)
+        blocks[j] = bufs[j];
+
+    for (i = 0; i < n; i += lanes) {
+        lanes = (n - i < SHA256_MB_LANES) ? (n - i) : SHA256_MB_LANES;
+
+        for (j = 0; j < lanes; j++)
+            memcpy(h[j], base ? base->h : sha256_h0, sizeof(h[j]));
+
+        for (k = 0; k < block_nb; k++) {
+            off = k << 6;
+            for (j = 0; j < lanes; j++) {
+                unsigned char * const buf = bufs[j];
+
+                memset(buf, 0, SHA256_BLOCK_SIZE);
+                if (head_len)
+                    sha256_multi_fill(buf, off, base->block, 0, head_len);
+                sha256_multi_fill(buf, off, messages[i + j], head_len, len);
+                if (tail_len)
+                    sha256_multi_fill(buf, off, tail, head_len + len, tail_len);
+                if (msg_len >= off && msg_len < off + SHA256_BLOCK_SIZE)
+                    buf[msg_len - off] = 0x80;
+                if (k == block_nb - 1)
+                    UNPACK32(len_b, &buf[SHA256_BLOCK_SIZE - 4]);
+            }
+            sha256_transf_multi(h, blocks, lanes);
+        }
+
+        for (j = 0; j < lanes; j++)
+            for (k = 0; k < 8; k++)
+                UNPACK32(h[j][k], &digests[i + j][k << 2]);
+    }
+}
+
 void sha256(const unsigned char *message, unsigned int len, unsigned char *digest)
 {
     sha256_ctx ctx;
@@ -61,6 +61,10 @@ typedef struct {
     uint32_t h[8];
 } sha256_ctx;
 
+/* Number of independent messages hashed together by the multi-buffer API */
+#define SHA256_MB_LANES 4
+
+extern uint32_t sha256_h0[8];
 extern uint32_t sha256_k[64];
 
 void sha256_init(sha256_ctx * ctx);
@@ -70,4 +74,24 @@ void sha256_final(sha256_ctx *ctx, unsigned char *digest);
 void sha256(const unsigned char *message, unsigned int len,
             unsigned char *digest);
 
+#ifdef HAVE_SHANI
+extern bool sha256_shani_available(void);
+extern void sha256_shani_transf(uint32_t *h, const unsigned char *message,
+                                unsigned int block_nb);
+#endif
+
+#ifdef HAVE_ARMCE
+extern bool sha256_armce_available(void);
+extern void sha256_armce_transf(uint32_t *h, const unsigned char *message,
+                                unsigned int block_nb);
+#endif
+
+void sha256_transf_multi(uint32_t (*h)[8], const unsigned char * const *blocks,
+                         int n);
+void sha256_multi(const sha256_ctx *base, const unsigned char * const *messages,
+                  unsigned int len, const unsigned char *tail,
+                  unsigned int tail_len, unsigned char * const *digests, int n);
+void sha256d_80_h7_multi(const uint32_t * const *midstates,
+                         const uint32_t (*tails)[4], uint32_t *h7, int n);
+
 #endif /* !SHA2_H */
@@ -100,6 +100,9 @@ bool ScanHash_altivec_4way(struct thr_info*thr, const unsigned char *pmidstate,
 
         for (j = 0; j < NPAR; j++)
         {
+            // Lanes past max_nonce belong to the next scan
+            if (unlikely((uint64_t)nonce + j > max_nonce))
+                break;
             if (unlikely(thash[7][j] == 0))
             {
 		int i;
@@ -116,9 +119,9 @@ bool ScanHash_altivec_4way(struct thr_info*thr, const unsigned char *pmidstate,
             }
         }
 
-        if ((nonce >= max_nonce) || thr->work_restart)
+        if (((uint64_t)nonce + NPAR - 1 >= max_nonce) || thr->work_restart)
         {
-            *last_nonce = nonce;
+            *last_nonce = ((uint64_t)nonce + NPAR - 1 >= max_nonce) ? max_nonce : nonce + NPAR - 1;
             return false;
         }
 
@@ -0,0 +1,201 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+// SHA-256 using the ARMv8 cryptography extensions (sha256h and friends)
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <arm_neon.h>
+#ifdef __linux__
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#include "miner.h"
+#include "sha2.h"
+#include "util.h"
+
+#ifdef WANT_CPUMINE
+#include "driver-cpu.h"
+#endif
+
+bool sha256_armce_available(void)
+{
+	static int available = -1;
+
+	if (likely(available >= 0))
+		return available;
+
+	// The kernel reports SHA-2 in HWCAP on AArch64, but in HWCAP2 for 32-bit ARM
+#if defined(__linux__) && defined(__aarch64__)
+	available = (getauxval(AT_HWCAP) & HWCAP_SHA2) ? 1 : 0;
+#elif defined(__linux__)
+	available = (getauxval(AT_HWCAP2) & HWCAP2_SHA2) ? 1 : 0;
+#else
+	available = 0;
+#endif
+	return available;
+}
+
+/* Four rounds; ARMCE_MSG_RNDS4 first extends the message schedule by the
+ * four words they use. The state is kept as plain ABCD/EFGH vectors. */
+#define ARMCE_RNDS4(i)  do {  \
+	t = vaddq_u32(m[i], vld1q_u32(&sha256_k[(i) * 4]));  \
+	abcd = s0;  \
+	s0 = vsha256hq_u32(s0, s1, t);  \
+	s1 = vsha256h2q_u32(s1, abcd, t);  \
+} while (0)
+#define ARMCE_MSG_RNDS4(i)  do {  \
+	m[i] = vsha256su1q_u32(vsha256su0q_u32(m[(i) - 4], m[(i) - 3]), m[(i) - 2], m[(i) - 1]);  \
+	ARMCE_RNDS4(i);  \
+} while (0)
+
+/* All 64 rounds on one block; m[0..3] hold its 16 words on entry, and the
+ * rest of m is used for the message schedule */
+static inline __attribute__((always_inline))
+void sha256_armce_rounds(uint32x4_t * const state0, uint32x4_t * const state1, uint32x4_t * const m)
+{
+	uint32x4_t s0 = *state0, s1 = *state1, abcd, t;
+
+	ARMCE_RNDS4(0);
+	ARMCE_RNDS4(1);
+	ARMCE_RNDS4(2);
+	ARMCE_RNDS4(3);
+	ARMCE_MSG_RNDS4(4);
+	ARMCE_MSG_RNDS4(5);
+	ARMCE_MSG_RNDS4(6);
+	ARMCE_MSG_RNDS4(7);
+	ARMCE_MSG_RNDS4(8);
+	ARMCE_MSG_RNDS4(9);
+	ARMCE_MSG_RNDS4(10);
+	ARMCE_MSG_RNDS4(11);
+	ARMCE_MSG_RNDS4(12);
+	ARMCE_MSG_RNDS4(13);
+	ARMCE_MSG_RNDS4(14);
+	ARMCE_MSG_RNDS4(15);
+
+	*state0 = vaddq_u32(s0, *state0);
+	*state1 = vaddq_u32(s1, *state1);
+}
+
+/* Runs block_nb big endian 64-byte blocks through the hash state h; this is
+ * what sha2.c uses instead of its own transform when the CPU supports it */
+void sha256_armce_transf(uint32_t * const h, const unsigned char *message, unsigned int block_nb)
+{
+	uint32x4_t state0 = vld1q_u32(&h[0]), state1 = vld1q_u32(&h[4]), m[16];
+	int i;
+
+	for ( ; block_nb; --block_nb, message += 64)
+	{
+		for (i = 0; i < 4; ++i)
+			m[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(&message[i * 16])));
+		sha256_armce_rounds(&state0, &state1, m);
+	}
+	vst1q_u32(&h[0], state0);
+	vst1q_u32(&h[4], state1);
+}
+
+#ifdef WANT_ARMCE
+
+static const uint32_t armce_pad1[2][4] = {
+	{0x80000000, 0, 0, 0},
+	{0, 0, 0, 0x280},
+};
+static const uint32_t armce_pad2[2][4] = {
+	{0x80000000, 0, 0, 0},
+	{0, 0, 0, 0x100},
+};
+
+/* The midstate and data words are already in native order (see scanhash_c),
+ * so both hashes are fed to the rounds directly with no byte swapping. Two
+ * nonces are hashed at a time to hide the latency of sha256h. */
+bool scanhash_armce(struct thr_info * const thr, const unsigned char * const pmidstate,
+	unsigned char * const pdata,
+	__maybe_unused unsigned char * const phash1, unsigned char * const phash,
+	const unsigned char * const ptarget,
+	const uint32_t max_nonce, uint32_t * const last_nonce,
+	uint32_t n)
+{
+	const uint32_t * const In = (const uint32_t *)(pdata + 64);
+	uint32_t * const nonce_p = (uint32_t *)(pdata + 76);
+	const uint32_t block1_head[4] = {In[0], In[1], In[2], 0};
+	uint32x4_t mid0, mid1, init0, init1, block1[4], block2[2];
+	uint32x4_t s0[2], s1[2], m[2][16];
+	uint32_t h7;
+	int j;
+
+	mid0 = vld1q_u32((const uint32_t *)&pmidstate[0]);
+	mid1 = vld1q_u32((const uint32_t *)&pmidstate[16]);
+	init0 = vld1q_u32(&sha256_h0[0]);
+	init1 = vld1q_u32(&sha256_h0[4]);
+
+	// First hash: the rest of the header (with the nonce in word 3) and padding
+	block1[0] = vld1q_u32(block1_head);
+	block1[1] = vld1q_u32(armce_pad1[0]);
+	block1[2] = vdupq_n_u32(0);
+	block1[3] = vld1q_u32(armce_pad1[1]);
+	// Second hash: the first hash's state (filled in per nonce) and padding
+	block2[0] = vld1q_u32(armce_pad2[0]);
+	block2[1] = vld1q_u32(armce_pad2[1]);
+
+	while (true)
+	{
+		for (j = 0; j < 2; ++j)
+		{
+			m[j][0] = vsetq_lane_u32(n + j, block1[0], 3);
+			m[j][1] = block1[1];
+			m[j][2] = block1[2];
+			m[j][3] = block1[3];
+			s0[j] = mid0;
+			s1[j] = mid1;
+		}
+		sha256_armce_rounds(&s0[0], &s1[0], m[0]);
+		sha256_armce_rounds(&s0[1], &s1[1], m[1]);
+
+		for (j = 0; j < 2; ++j)
+		{
+			m[j][0] = s0[j];
+			m[j][1] = s1[j];
+			m[j][2] = block2[0];
+			m[j][3] = block2[1];
+			s0[j] = init0;
+			s1[j] = init1;
+		}
+		sha256_armce_rounds(&s0[0], &s1[0], m[0]);
+		sha256_armce_rounds(&s0[1], &s1[1], m[1]);
+
+		for (j = 0; j < 2; ++j)
+		{
+			h7 = vgetq_lane_u32(s1[j], 3);
+			if (likely(h7))
+				continue;
+			// With an odd range, the second nonce can be past max_nonce
+			if (unlikely((uint64_t)n + j > max_nonce))
+				break;
+			*nonce_p = n + j;
+			hash_data(phash, pdata);
+			if (hash_target_check_v(phash, ptarget))
+			{
+				*last_nonce = n + j;
+				return true;
+			}
+		}
+
+		if (((uint64_t)n + 1 >= max_nonce) || thr->work_restart)
+		{
+			*last_nonce = ((uint64_t)n + 1 >= max_nonce) ? max_nonce : n + 1;
+			return false;
+		}
+
+		n += 2;
+	}
+}
+
+#endif /* WANT_ARMCE */
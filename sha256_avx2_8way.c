@@ -0,0 +1,20 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+// 8-way 256-bit AVX2 SHA-256d
+
+#include "config.h"
+
+#include "driver-cpu.h"
+
+#ifdef WANT_AVX2_8WAY
+
+#define SHA256_NWAY_LANES  8
+#define SHA256_NWAY_SCANHASH  ScanHash_8WayAVX2
+#include "sha256_nway.h"
+
+#endif /* WANT_AVX2_8WAY */
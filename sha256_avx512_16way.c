@@ -0,0 +1,20 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+// 16-way 512-bit AVX-512 SHA-256d
+
+#include "config.h"
+
+#include "driver-cpu.h"
+
+#ifdef WANT_AVX512_16WAY
+
+#define SHA256_NWAY_LANES  16
+#define SHA256_NWAY_SCANHASH  ScanHash_16WayAVX512
+#include "sha256_nway.h"
+
+#endif /* WANT_AVX512_16WAY */
@@ -0,0 +1,20 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+// 4-way 128-bit NEON SHA-256d
+
+#include "config.h"
+
+#include "driver-cpu.h"
+
+#ifdef WANT_NEON_4WAY
+
+#define SHA256_NWAY_LANES  4
+#define SHA256_NWAY_SCANHASH  ScanHash_4WayNEON
+#include "sha256_nway.h"
+
+#endif /* WANT_NEON_4WAY */
@@ -0,0 +1,240 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* N-way SHA-256d scanhash, written with GCC vector extensions so the same
+ * code becomes AVX2, AVX-512 or any other SIMD instruction set depending on
+ * the flags it is built with. Include it after defining:
+ *   SHA256_NWAY_LANES     number of 32-bit lanes per vector
+ *   SHA256_NWAY_SCANHASH  name of the scanhash function to define
+ *
+ * Everything that doesn't depend on the nonce is computed once per call:
+ * the first three rounds of the first hash, most of its fourth round, and
+ * W16-W19 of its message schedule. The second hash stops after the part of
+ * round 60 that determines its final H7, since only a zero H7 is of any
+ * interest; candidates are then checked in full with hash_data. */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "miner.h"
+#include "util.h"
+
+typedef uint32_t sha256_nway_t __attribute__((vector_size(SHA256_NWAY_LANES * 4)));
+
+static const uint32_t sha256_nway_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const uint32_t sha256_nway_init[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+/* These work on both scalars and vectors */
+#define NWAY_ROTR(x, n)  (((x) >> (n)) | ((x) << (32 - (n))))
+#define NWAY_CH(x, y, z)  ((z) ^ ((x) & ((y) ^ (z))))
+#define NWAY_MAJ(x, y, z)  (((x) & (y)) | ((z) & ((x) | (y))))
+#define NWAY_S0(x)  (NWAY_ROTR(x,  2) ^ NWAY_ROTR(x, 13) ^ NWAY_ROTR(x, 22))
+#define NWAY_S1(x)  (NWAY_ROTR(x,  6) ^ NWAY_ROTR(x, 11) ^ NWAY_ROTR(x, 25))
+#define NWAY_s0(x)  (NWAY_ROTR(x,  7) ^ NWAY_ROTR(x, 18) ^ ((x) >>  3))
+#define NWAY_s1(x)  (NWAY_ROTR(x, 17) ^ NWAY_ROTR(x, 19) ^ ((x) >> 10))
+
+/* kw is the round constant plus the message word */
+#define NWAY_ROUND(a, b, c, d, e, f, g, h, kw)  do {  \
+	T1 = (h) + NWAY_S1(e) + NWAY_CH(e, f, g) + (kw);  \
+	(d) += T1;  \
+	(h) = T1 + NWAY_S0(a) + NWAY_MAJ(a, b, c);  \
+} while (0)
+
+#define NWAY_ROUNDS8(i, KW)  do {  \
+	NWAY_ROUND(a, b, c, d, e, f, g, h, KW((i) + 0));  \
+	NWAY_ROUND(h, a, b, c, d, e, f, g, KW((i) + 1));  \
+	NWAY_ROUND(g, h, a, b, c, d, e, f, KW((i) + 2));  \
+	NWAY_ROUND(f, g, h, a, b, c, d, e, KW((i) + 3));  \
+	NWAY_ROUND(e, f, g, h, a, b, c, d, KW((i) + 4));  \
+	NWAY_ROUND(d, e, f, g, h, a, b, c, KW((i) + 5));  \
+	NWAY_ROUND(c, d, e, f, g, h, a, b, KW((i) + 6));  \
+	NWAY_ROUND(b, c, d, e, f, g, h, a, KW((i) + 7));  \
+} while (0)
+
+#define NWAY_EXPAND(W, i)  \
+	(W[i] = NWAY_s1(W[(i) - 2]) + W[(i) - 7] + NWAY_s0(W[(i) - 15]) + W[(i) - 16])
+
+#define NWAY_KW_CONST(i)  (kw1[i])
+#define NWAY_KW_W(i)  (sha256_nway_k[i] + W[i])
+#define NWAY_KW_W2(i)  (sha256_nway_k[i] + W2[i])
+
+union sha256_nway_lanes {
+	sha256_nway_t v;
+	uint32_t u[SHA256_NWAY_LANES];
+};
+
+bool SHA256_NWAY_SCANHASH(struct thr_info * const thr, const unsigned char * const pmidstate,
+	unsigned char *pdata,
+	__maybe_unused unsigned char *phash1, unsigned char * const phash,
+	const unsigned char * const ptarget,
+	const uint32_t max_nonce, uint32_t * const last_nonce,
+	uint32_t n)
+{
+	const uint32_t * const midstate = (const uint32_t *)pmidstate;
+	const uint32_t * const In = (const uint32_t *)(pdata + 64);
+	uint32_t * const nonce_p = (uint32_t *)(pdata + 76);
+	uint32_t sa, sb, sc, sd, se, sf, sg, sh;
+	uint32_t kw1[16], pre_a, pre_e, pre_W18, pre_W19, kw2_0, pre_h2;
+	sha256_nway_t a, b, c, d, e, f, g, h, T1, nonce, W[64], W2[64];
+	union sha256_nway_lanes offsets, res;
+	int i, j;
+
+	/* First hash: rounds 0-2 only use the merkle root end, ntime and nbits */
+	sa = midstate[0]; sb = midstate[1]; sc = midstate[2]; sd = midstate[3];
+	se = midstate[4]; sf = midstate[5]; sg = midstate[6]; sh = midstate[7];
+	{
+		uint32_t T1;
+		NWAY_ROUND(sa, sb, sc, sd, se, sf, sg, sh, sha256_nway_k[0] + In[0]);
+		NWAY_ROUND(sh, sa, sb, sc, sd, se, sf, sg, sha256_nway_k[1] + In[1]);
+		NWAY_ROUND(sg, sh, sa, sb, sc, sd, se, sf, sha256_nway_k[2] + In[2]);
+		/* Round 3, up to where the nonce (W3) is added */
+		T1 = se + NWAY_S1(sb) + NWAY_CH(sb, sc, sd) + sha256_nway_k[3];
+		pre_a = sa + T1;
+		pre_e = T1 + NWAY_S0(sf) + NWAY_MAJ(sf, sg, sh);
+	}
+	for (i = 4; i < 16; ++i)
+		kw1[i] = sha256_nway_k[i] + In[i];
+
+	/* W16 and W17 are the same for every nonce, W18 and W19 nearly so */
+	for (i = 0; i < 16; ++i)
+		W[i] = (sha256_nway_t){} + In[i];
+	W[16] = (sha256_nway_t){} + (NWAY_s1(In[14]) + In[9] + NWAY_s0(In[1]) + In[0]);
+	W[17] = (sha256_nway_t){} + (NWAY_s1(In[15]) + In[10] + NWAY_s0(In[2]) + In[1]);
+	pre_W18 = NWAY_s1(W[16][0]) + In[11] + In[2];
+	pre_W19 = NWAY_s1(W[17][0]) + In[12] + NWAY_s0(In[4]);
+
+	/* The second hash's block is the first hash and fixed padding */
+	W2[8] = (sha256_nway_t){} + 0x80000000;
+	for (i = 9; i < 15; ++i)
+		W2[i] = (sha256_nway_t){};
+	W2[15] = (sha256_nway_t){} + 0x100;
+
+	/* Second hash: round 0 up to where its W0 is added */
+	kw2_0 = sha256_nway_init[7] + NWAY_S1(sha256_nway_init[4]) + NWAY_CH(sha256_nway_init[4], sha256_nway_init[5], sha256_nway_init[6]) + sha256_nway_k[0];
+	pre_h2 = kw2_0 + NWAY_S0(sha256_nway_init[0]) + NWAY_MAJ(sha256_nway_init[0], sha256_nway_init[1], sha256_nway_init[2]);
+
+	for (j = 0; j < SHA256_NWAY_LANES; ++j)
+		offsets.u[j] = j;
+
+	while (true)
+	{
+		nonce = offsets.v + n;
+
+		/* First hash, continuing from round 3 */
+		a = pre_a + nonce;
+		b = (sha256_nway_t){} + sb;
+		c = (sha256_nway_t){} + sc;
+		d = (sha256_nway_t){} + sd;
+		e = pre_e + nonce;
+		f = (sha256_nway_t){} + sf;
+		g = (sha256_nway_t){} + sg;
+		h = (sha256_nway_t){} + sh;
+		NWAY_ROUND(e, f, g, h, a, b, c, d, NWAY_KW_CONST(4));
+		NWAY_ROUND(d, e, f, g, h, a, b, c, NWAY_KW_CONST(5));
+		NWAY_ROUND(c, d, e, f, g, h, a, b, NWAY_KW_CONST(6));
+		NWAY_ROUND(b, c, d, e, f, g, h, a, NWAY_KW_CONST(7));
+		NWAY_ROUNDS8(8, NWAY_KW_CONST);
+
+		W[3] = nonce;
+		W[18] = pre_W18 + NWAY_s0(nonce);
+		W[19] = pre_W19 + nonce;
+		for (i = 20; i < 64; ++i)
+			NWAY_EXPAND(W, i);
+		NWAY_ROUNDS8(16, NWAY_KW_W);
+		NWAY_ROUNDS8(24, NWAY_KW_W);
+		NWAY_ROUNDS8(32, NWAY_KW_W);
+		NWAY_ROUNDS8(40, NWAY_KW_W);
+		NWAY_ROUNDS8(48, NWAY_KW_W);
+		NWAY_ROUNDS8(56, NWAY_KW_W);
+
+		/* Second hash */
+		W2[0] = a + midstate[0];
+		W2[1] = b + midstate[1];
+		W2[2] = c + midstate[2];
+		W2[3] = d + midstate[3];
+		W2[4] = e + midstate[4];
+		W2[5] = f + midstate[5];
+		W2[6] = g + midstate[6];
+		W2[7] = h + midstate[7];
+		for (i = 16; i < 61; ++i)
+			NWAY_EXPAND(W2, i);
+
+		a = (sha256_nway_t){} + sha256_nway_init[0];
+		b = (sha256_nway_t){} + sha256_nway_init[1];
+		c = (sha256_nway_t){} + sha256_nway_init[2];
+		d = (sha256_nway_init[3] + kw2_0) + W2[0];
+		e = (sha256_nway_t){} + sha256_nway_init[4];
+		f = (sha256_nway_t){} + sha256_nway_init[5];
+		g = (sha256_nway_t){} + sha256_nway_init[6];
+		h = pre_h2 + W2[0];
+		NWAY_ROUND(h, a, b, c, d, e, f, g, NWAY_KW_W2(1));
+		NWAY_ROUND(g, h, a, b, c, d, e, f, NWAY_KW_W2(2));
+		NWAY_ROUND(f, g, h, a, b, c, d, e, NWAY_KW_W2(3));
+		NWAY_ROUND(e, f, g, h, a, b, c, d, NWAY_KW_W2(4));
+		NWAY_ROUND(d, e, f, g, h, a, b, c, NWAY_KW_W2(5));
+		NWAY_ROUND(c, d, e, f, g, h, a, b, NWAY_KW_W2(6));
+		NWAY_ROUND(b, c, d, e, f, g, h, a, NWAY_KW_W2(7));
+		NWAY_ROUNDS8(8, NWAY_KW_W2);
+		NWAY_ROUNDS8(16, NWAY_KW_W2);
+		NWAY_ROUNDS8(24, NWAY_KW_W2);
+		NWAY_ROUNDS8(32, NWAY_KW_W2);
+		NWAY_ROUNDS8(40, NWAY_KW_W2);
+		NWAY_ROUNDS8(48, NWAY_KW_W2);
+		NWAY_ROUND(a, b, c, d, e, f, g, h, NWAY_KW_W2(56));
+		NWAY_ROUND(h, a, b, c, d, e, f, g, NWAY_KW_W2(57));
+		NWAY_ROUND(g, h, a, b, c, d, e, f, NWAY_KW_W2(58));
+		NWAY_ROUND(f, g, h, a, b, c, d, e, NWAY_KW_W2(59));
+		/* Only the new e of round 60 matters, since it ends up as H7 */
+		T1 = h + d + NWAY_S1(a) + NWAY_CH(a, b, c) + NWAY_KW_W2(60);
+		res.v = (sha256_nway_t)(T1 == (sha256_nway_t){} - sha256_nway_init[7]);
+
+		for (j = 0; j < SHA256_NWAY_LANES; ++j)
+		{
+			if (likely(!res.u[j]))
+				continue;
+			// The last batch can run past max_nonce, even wrapping around
+			if (unlikely((uint64_t)n + j > max_nonce))
+				break;
+			*nonce_p = n + j;
+			hash_data(phash, pdata);
+			if (hash_target_check_v(phash, ptarget))
+			{
+				*last_nonce = n + j;
+				return true;
+			}
+		}
+
+		if (((uint64_t)n + SHA256_NWAY_LANES - 1 >= max_nonce) || thr->work_restart)
+		{
+			*last_nonce = ((uint64_t)n + SHA256_NWAY_LANES - 1 >= max_nonce) ? max_nonce : n + SHA256_NWAY_LANES - 1;
+			return false;
+		}
+
+		n += SHA256_NWAY_LANES;
+	}
+}
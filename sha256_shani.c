@@ -0,0 +1,217 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+// SHA-256 using the x86 SHA extensions (sha256rnds2 and friends)
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#include "miner.h"
+#include "sha2.h"
+#include "util.h"
+
+#ifdef WANT_CPUMINE
+#include "driver-cpu.h"
+#endif
+
+bool sha256_shani_available(void)
+{
+	static int available = -1;
+	unsigned int eax, ebx, ecx, edx;
+
+	if (likely(available >= 0))
+		return available;
+
+	// SHA is CPUID leaf 7 EBX bit 29; sha256_shani_* also need SSE4.1 and SSSE3
+	if (__get_cpuid_max(0, NULL) < 7)
+		available = 0;
+	else
+	{
+		__cpuid_count(7, 0, eax, ebx, ecx, edx);
+		available = (ebx & (1 << 29)) ? 1 : 0;
+		__cpuid(1, eax, ebx, ecx, edx);
+		if (!(ecx & bit_SSE4_1) || !(ecx & bit_SSSE3))
+			available = 0;
+	}
+	return available;
+}
+
+/* Converts between the usual h[8] layout and the ABEF/CDGH register pair
+ * sha256rnds2 works on */
+#define SHANI_LOAD_STATE(state0, state1, h)  do {  \
+	const __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&(h)[0]), 0xb1);  \
+	const __m128i efgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&(h)[4]), 0x1b);  \
+	state0 = _mm_alignr_epi8(abcd, efgh, 8);  \
+	state1 = _mm_blend_epi16(efgh, abcd, 0xf0);  \
+} while (0)
+
+#define SHANI_STORE_STATE(h, state0, state1)  do {  \
+	const __m128i feba = _mm_shuffle_epi32(state0, 0x1b);  \
+	const __m128i dchg = _mm_shuffle_epi32(state1, 0xb1);  \
+	_mm_storeu_si128((__m128i *)&(h)[0], _mm_blend_epi16(feba, dchg, 0xf0));  \
+	_mm_storeu_si128((__m128i *)&(h)[4], _mm_alignr_epi8(dchg, feba, 8));  \
+} while (0)
+
+/* Four rounds; SHANI_MSG_RNDS4 first extends the message schedule by the
+ * four words they use */
+#define SHANI_RNDS4(i)  do {  \
+	t = _mm_add_epi32(m[i], _mm_loadu_si128((const __m128i *)&sha256_k[(i) * 4]));  \
+	s1 = _mm_sha256rnds2_epu32(s1, s0, t);  \
+	s0 = _mm_sha256rnds2_epu32(s0, s1, _mm_shuffle_epi32(t, 0x0e));  \
+} while (0)
+#define SHANI_MSG_RNDS4(i)  do {  \
+	t = _mm_sha256msg1_epu32(m[(i) - 4], m[(i) - 3]);  \
+	t = _mm_add_epi32(t, _mm_alignr_epi8(m[(i) - 1], m[(i) - 2], 4));  \
+	m[i] = _mm_sha256msg2_epu32(t, m[(i) - 1]);  \
+	SHANI_RNDS4(i);  \
+} while (0)
+
+/* All 64 rounds on one block; m[0..3] hold its 16 words on entry, and the
+ * rest of m is used for the message schedule */
+static inline __attribute__((always_inline))
+void sha256_shani_rounds(__m128i * const state0, __m128i * const state1, __m128i * const m)
+{
+	const __m128i abef = *state0, cdgh = *state1;
+	__m128i s0 = abef, s1 = cdgh, t;
+
+	SHANI_RNDS4(0);
+	SHANI_RNDS4(1);
+	SHANI_RNDS4(2);
+	SHANI_RNDS4(3);
+	SHANI_MSG_RNDS4(4);
+	SHANI_MSG_RNDS4(5);
+	SHANI_MSG_RNDS4(6);
+	SHANI_MSG_RNDS4(7);
+	SHANI_MSG_RNDS4(8);
+	SHANI_MSG_RNDS4(9);
+	SHANI_MSG_RNDS4(10);
+	SHANI_MSG_RNDS4(11);
+	SHANI_MSG_RNDS4(12);
+	SHANI_MSG_RNDS4(13);
+	SHANI_MSG_RNDS4(14);
+	SHANI_MSG_RNDS4(15);
+
+	*state0 = _mm_add_epi32(s0, abef);
+	*state1 = _mm_add_epi32(s1, cdgh);
+}
+
+/* Runs block_nb big endian 64-byte blocks through the hash state h; this is
+ * what sha2.c uses instead of its own transform when the CPU supports it */
+void sha256_shani_transf(uint32_t * const h, const unsigned char *message, unsigned int block_nb)
+{
+	const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i state0, state1, m[16];
+	int i;
+
+	SHANI_LOAD_STATE(state0, state1, h);
+	for ( ; block_nb; --block_nb, message += 64)
+	{
+		for (i = 0; i < 4; ++i)
+			m[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)&message[i * 16]), bswap);
+		sha256_shani_rounds(&state0, &state1, m);
+	}
+	SHANI_STORE_STATE(h, state0, state1);
+}
+
+#ifdef WANT_SHANI
+
+static const uint32_t sha256_shani_init[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+/* The midstate and data words are already in native order (see scanhash_c),
+ * so both hashes are fed to the rounds directly with no byte swapping. Two
+ * nonces are hashed at a time, since sha256rnds2 has a long latency and the
+ * second chain fills in the gaps. */
+bool scanhash_shani(struct thr_info * const thr, const unsigned char * const pmidstate,
+	unsigned char * const pdata,
+	__maybe_unused unsigned char * const phash1, unsigned char * const phash,
+	const unsigned char * const ptarget,
+	const uint32_t max_nonce, uint32_t * const last_nonce,
+	uint32_t n)
+{
+	const uint32_t * const In = (const uint32_t *)(pdata + 64);
+	uint32_t * const nonce_p = (uint32_t *)(pdata + 76);
+	__m128i mid0, mid1, init0, init1, block1[4], block2[4];
+	__m128i s0[2], s1[2], m[2][16];
+	uint32_t h1[2][8], h7;
+	int j;
+
+	SHANI_LOAD_STATE(mid0, mid1, (const uint32_t *)pmidstate);
+	SHANI_LOAD_STATE(init0, init1, sha256_shani_init);
+
+	// First hash: the rest of the header (with the nonce in word 3) and padding
+	block1[0] = _mm_setr_epi32(In[0], In[1], In[2], 0);
+	block1[1] = _mm_setr_epi32(0x80000000, 0, 0, 0);
+	block1[2] = _mm_setzero_si128();
+	block1[3] = _mm_setr_epi32(0, 0, 0, 0x280);
+	// Second hash: the first hash's state (filled in per nonce) and padding
+	block2[2] = _mm_setr_epi32(0x80000000, 0, 0, 0);
+	block2[3] = _mm_setr_epi32(0, 0, 0, 0x100);
+
+	while (true)
+	{
+		for (j = 0; j < 2; ++j)
+		{
+			m[j][0] = _mm_insert_epi32(block1[0], n + j, 3);
+			m[j][1] = block1[1];
+			m[j][2] = block1[2];
+			m[j][3] = block1[3];
+			s0[j] = mid0;
+			s1[j] = mid1;
+		}
+		sha256_shani_rounds(&s0[0], &s1[0], m[0]);
+		sha256_shani_rounds(&s0[1], &s1[1], m[1]);
+
+		for (j = 0; j < 2; ++j)
+		{
+			SHANI_STORE_STATE(h1[j], s0[j], s1[j]);
+			m[j][0] = _mm_loadu_si128((const __m128i *)&h1[j][0]);
+			m[j][1] = _mm_loadu_si128((const __m128i *)&h1[j][4]);
+			m[j][2] = block2[2];
+			m[j][3] = block2[3];
+			s0[j] = init0;
+			s1[j] = init1;
+		}
+		sha256_shani_rounds(&s0[0], &s1[0], m[0]);
+		sha256_shani_rounds(&s0[1], &s1[1], m[1]);
+
+		for (j = 0; j < 2; ++j)
+		{
+			// H7 is the low word of the final CDGH
+			h7 = _mm_cvtsi128_si32(s1[j]);
+			if (likely(h7))
+				continue;
+			// With an odd range, the second nonce can be past max_nonce
+			if (unlikely((uint64_t)n + j > max_nonce))
+				break;
+			*nonce_p = n + j;
+			hash_data(phash, pdata);
+			if (hash_target_check_v(phash, ptarget))
+			{
+				*last_nonce = n + j;
+				return true;
+			}
+		}
+
+		if (((uint64_t)n + 1 >= max_nonce) || thr->work_restart)
+		{
+			*last_nonce = ((uint64_t)n + 1 >= max_nonce) ? max_nonce : n + 1;
+			return false;
+		}
+
+		n += 2;
+	}
+}
+
+#endif /* WANT_SHANI */
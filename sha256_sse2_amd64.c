@@ -110,7 +110,8 @@ bool scanhash_sse2_64(struct thr_info*thr, const unsigned char *pmidstate,
 
 	/* If j = true, we found a hit...so check it */
 	/* Use the C version for a check... */
-	if (unlikely(j != 4)) {
+	/* Lanes past max_nonce belong to the next scan */
+	if (unlikely(j != 4 && (uint64_t)nonce + j <= max_nonce)) {
 		for (i = 0; i < 8; i++) {
 		    mi.m = m_4hash[i];
 		    *(uint32_t *)&(phash)[i*4] = mi.i[j];
@@ -118,15 +119,15 @@ bool scanhash_sse2_64(struct thr_info*thr, const unsigned char *pmidstate,
 
 		if (unlikely(hash32[7] == 0 && fulltest(phash, ptarget))) {
 		     nonce += j;
-		     *last_nonce = nonce + 1;
+		     *last_nonce = nonce;
 		     *nNonce_p = nonce;
 		     return true;
 		}
 	}
 
-        if (unlikely((nonce >= max_nonce) || thr->work_restart))
+        if (unlikely(((uint64_t)nonce + 3 >= max_nonce) || thr->work_restart))
         {
-			*last_nonce = nonce;
+			*last_nonce = ((uint64_t)nonce + 3 >= max_nonce) ? max_nonce : nonce + 3;
 			return false;
 	}
 
@@ -99,6 +99,9 @@ bool scanhash_sse2_32(struct thr_info*thr, const unsigned char *pmidstate,
 	CalcSha256_x86 (m_4hash, m_4hash1, sha256_32init);
 
 	for (j = 0; j < 4; j++) {
+	    // Lanes past max_nonce belong to the next scan
+	    if (unlikely((uint64_t)nonce + j > max_nonce))
+		break;
 	    if (unlikely(((uint32_t *)&(m_4hash[7]))[j] == 0)) {
 		/* We found a hit...so check it */
 		/* Use the C version for a check... */
@@ -116,8 +119,8 @@ bool scanhash_sse2_32(struct thr_info*thr, const unsigned char *pmidstate,
 	    }
 	}
 
-	if (unlikely((nonce >= max_nonce) || thr->work_restart)) {
-		*last_nonce = nonce;
+	if (unlikely(((uint64_t)nonce + 3 >= max_nonce) || thr->work_restart)) {
+		*last_nonce = ((uint64_t)nonce + 3 >= max_nonce) ? max_nonce : nonce + 3;
 		return false;
 	}
 
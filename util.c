@@ -33,12 +33,17 @@
 #if defined(__FreeBSD__) || defined(__OpenBSD__)
 # include <pthread_np.h>
 #endif
+#if defined(HAVE_NEON) && defined(__arm__) && defined(__linux__)
+# include <sys/auxv.h>
+# include <asm/hwcap.h>
+#endif
 #ifndef WIN32
 #include <fcntl.h>
 # ifdef __linux
 #  include <sys/prctl.h>
 # endif
 # include <sys/socket.h>
+# include <sys/uio.h>
 # include <netinet/in.h>
 # include <netinet/tcp.h>
 # include <netdb.h>
@@ -1557,35 +1562,64 @@ enum send_ret {
 	SEND_OK,
 	SEND_SELECTFAIL,
 	SEND_SENDFAIL,
-	SEND_INACTIVE
+	SEND_INACTIVE,
+	SEND_BLOCKED,
 };
 
-/* Send a single command across a socket, appending \n to it. This should all
- * be done under stratum lock except when first establishing the socket */
-static enum send_ret __stratum_send(struct pool *pool, char *s, ssize_t len)
+#ifdef WIN32
+typedef WSABUF stratum_iovec_t;
+#	define STRATUM_IOV_BASE(iov)  ((iov)->buf)
+#	define STRATUM_IOV_LEN(iov)  ((iov)->len)
+#else
+typedef struct iovec stratum_iovec_t;
+#	define STRATUM_IOV_BASE(iov)  ((iov)->iov_base)
+#	define STRATUM_IOV_LEN(iov)  ((iov)->iov_len)
+#endif
+
+static
+ssize_t stratum_sendv_once(SOCKETTYPE sock, stratum_iovec_t *iov, int iovcnt)
+{
+#ifdef WIN32
+	DWORD sent;
+	if (WSASend(sock, iov, iovcnt, &sent, 0, NULL, NULL))
+		return -1;
+	return sent;
+#else
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = iovcnt,
+	};
+#	ifdef __APPLE__
+	return sendmsg(sock, &msg, SO_NOSIGPIPE);
+#	else
+	return sendmsg(sock, &msg, MSG_NOSIGNAL);
+#	endif
+#endif
+}
+
+/* Send several commands across a socket at once, each followed by \n. This
+ * should all be done under stratum lock except when first establishing the
+ * socket. Unless wait is set, nothing is sent if the socket cannot take any
+ * data right now; once anything is sent, it waits for the rest. */
+static enum send_ret __stratum_sendv(struct pool *pool, const char * const *lines, const size_t *lens, int n, bool wait)
 {
 	SOCKETTYPE sock = pool->sock;
-	ssize_t ssent = 0;
+	stratum_iovec_t iovbuf[n * 2], *iov = iovbuf;
+	int iovcnt = n * 2;
+	ssize_t ssent = 0, len = 0;
 
-	strcat(s, "\n");
-	len++;
+	for (int i = 0; i < n; ++i) {
+		STRATUM_IOV_BASE(&iov[i * 2]) = (void *)lines[i];
+		STRATUM_IOV_LEN(&iov[i * 2]) = lens[i];
+		STRATUM_IOV_BASE(&iov[i * 2 + 1]) = "\n";
+		STRATUM_IOV_LEN(&iov[i * 2 + 1]) = 1;
+		len += lens[i] + 1;
+	}
 
 	while (len > 0 ) {
-		struct timeval timeout = {1, 0};
 		ssize_t sent;
-		fd_set wd;
 
-		FD_ZERO(&wd);
-		FD_SET(sock, &wd);
-		if (select(sock + 1, NULL, &wd, NULL, &timeout) < 1)
-			return SEND_SELECTFAIL;
-#ifdef __APPLE__
-		sent = send(pool->sock, s + ssent, len, SO_NOSIGPIPE);
-#elif WIN32
-		sent = send(pool->sock, s + ssent, len, 0);
-#else
-		sent = send(pool->sock, s + ssent, len, MSG_NOSIGNAL);
-#endif
+		sent = stratum_sendv_once(sock, iov, iovcnt);
 		if (sent < 0) {
 			if (!sock_blocks())
 				return SEND_SENDFAIL;
@@ -1593,31 +1627,53 @@ static enum send_ret __stratum_send(struct pool *pool, char *s, ssize_t len)
 		}
 		ssent += sent;
 		len -= sent;
+		if (!len)
+			break;
+
+		// Skip past whatever was sent
+		while ((size_t)sent >= STRATUM_IOV_LEN(iov)) {
+			sent -= STRATUM_IOV_LEN(iov);
+			++iov;
+			--iovcnt;
+		}
+		STRATUM_IOV_BASE(iov) = (char *)STRATUM_IOV_BASE(iov) + sent;
+		STRATUM_IOV_LEN(iov) -= sent;
+
+		if (!(ssent || wait))
+			return SEND_BLOCKED;
+
+		struct timeval timeout = {1, 0};
+		fd_set wd;
+
+		FD_ZERO(&wd);
+		FD_SET(sock, &wd);
+		if (select(sock + 1, NULL, &wd, NULL, &timeout) < 1)
+			return SEND_SELECTFAIL;
 	}
 
-	pool->cgminer_pool_stats.times_sent++;
+	pool->cgminer_pool_stats.times_sent += n;
 	pool->cgminer_pool_stats.bytes_sent += ssent;
 	total_bytes_sent += ssent;
 	pool->cgminer_pool_stats.net_bytes_sent += ssent;
 	return SEND_OK;
 }
 
-bool _stratum_send(struct pool *pool, char *s, ssize_t len, bool force)
+/* Send a single command across a socket, appending \n to it. This should all
+ * be done under stratum lock except when first establishing the socket */
+static enum send_ret __stratum_send(struct pool *pool, char *s, ssize_t len)
 {
-	enum send_ret ret = SEND_INACTIVE;
-
-	if (opt_protocol)
-		applog(LOG_DEBUG, "Pool %u: SEND: %s", pool->pool_no, s);
-
-	mutex_lock(&pool->stratum_lock);
-	if (pool->stratum_active || force)
-		ret = __stratum_send(pool, s, len);
-	mutex_unlock(&pool->stratum_lock);
+	const size_t slen = len;
+	return __stratum_sendv(pool, (const char **)&s, &slen, 1, true);
+}
 
+static
+void stratum_send_ret_log(struct pool * const pool, const enum send_ret ret)
+{
 	/* This is to avoid doing applog under stratum_lock */
 	switch (ret) {
 		default:
 		case SEND_OK:
+		case SEND_BLOCKED:
 			break;
 		case SEND_SELECTFAIL:
 			applog(LOG_DEBUG, "Write select failed on pool %d sock", pool->pool_no);
@@ -1631,6 +1687,48 @@ bool _stratum_send(struct pool *pool, char *s, ssize_t len, bool force)
 			applog(LOG_DEBUG, "Stratum send failed due to no pool stratum_active");
 			break;
 	}
+}
+
+/* Sends a batch of commands with as few system calls as possible. Returns n
+ * if they were all sent, 0 if the socket could not take any more data yet
+ * (nothing was sent), or -1 on failure */
+int stratum_send_lines(struct pool *pool, const char * const *lines, const size_t *lens, int n)
+{
+	enum send_ret ret = SEND_INACTIVE;
+
+	if (opt_protocol)
+		for (int i = 0; i < n; ++i)
+			applog(LOG_DEBUG, "Pool %u: SEND: %s", pool->pool_no, lines[i]);
+
+	mutex_lock(&pool->stratum_lock);
+	if (pool->stratum_active)
+		ret = __stratum_sendv(pool, lines, lens, n, false);
+	mutex_unlock(&pool->stratum_lock);
+
+	stratum_send_ret_log(pool, ret);
+	switch (ret) {
+		case SEND_OK:
+			return n;
+		case SEND_BLOCKED:
+			return 0;
+		default:
+			return -1;
+	}
+}
+
+bool _stratum_send(struct pool *pool, char *s, ssize_t len, bool force)
+{
+	enum send_ret ret = SEND_INACTIVE;
+
+	if (opt_protocol)
+		applog(LOG_DEBUG, "Pool %u: SEND: %s", pool->pool_no, s);
+
+	mutex_lock(&pool->stratum_lock);
+	if (pool->stratum_active || force)
+		ret = __stratum_send(pool, s, len);
+	mutex_unlock(&pool->stratum_lock);
+
+	stratum_send_ret_log(pool, ret);
 	return (ret == SEND_OK);
 }
 
@@ -1654,10 +1752,16 @@ static bool socket_full(struct pool *pool, int wait)
 	return false;
 }
 
+/* pool->sockbuf holds received stratum data from sockbuf_start up to
+ * sockbuf_end, always followed by a \0. Lines are consumed by advancing
+ * sockbuf_start, and the data is only moved back to the front of the buffer
+ * when more room is needed. No newline exists before sockbuf_scan, so each
+ * byte is only searched once however many reads a long line takes. */
+
 /* Check to see if Santa's been good to you */
 bool sock_full(struct pool *pool)
 {
-	if (strlen(pool->sockbuf))
+	if (pool->sockbuf_end > pool->sockbuf_start)
 		return true;
 
 	return (socket_full(pool, 0));
@@ -1665,7 +1769,9 @@ bool sock_full(struct pool *pool)
 
 static void clear_sockbuf(struct pool *pool)
 {
-	strcpy(pool->sockbuf, "");
+	pool->sockbuf_start = pool->sockbuf_end = pool->sockbuf_scan = 0;
+	if (pool->sockbuf)
+		pool->sockbuf[0] = '\0';
 }
 
 static void clear_sock(struct pool *pool)
@@ -1684,36 +1790,118 @@ static void clear_sock(struct pool *pool)
 	clear_sockbuf(pool);
 }
 
-/* Make sure the pool sockbuf is large enough to cope with any coinbase size
- * by reallocing it to a large enough size rounded up to a multiple of RBUFSIZE
- * and zeroing the new memory */
-static void recalloc_sock(struct pool *pool, size_t len)
+/* Make sure the pool sockbuf has room for len more bytes (plus the \0),
+ * first by reclaiming consumed space, then by growing it to a multiple of
+ * RBUFSIZE large enough to cope with any coinbase size */
+static void sockbuf_reserve(struct pool *pool, size_t len)
 {
-	size_t old, new;
+	size_t new;
 
-	old = strlen(pool->sockbuf);
-	new = old + len + 1;
-	if (new < pool->sockbuf_size)
+	if (pool->sockbuf_end + len + 1 <= pool->sockbuf_size)
 		return;
-	new = new + (RBUFSIZE - (new % RBUFSIZE));
-	// Avoid potentially recursive locking
-	// applog(LOG_DEBUG, "Recallocing pool sockbuf to %lu", (unsigned long)new);
+
+	if (pool->sockbuf_start) {
+		const size_t datalen = pool->sockbuf_end - pool->sockbuf_start;
+		memmove(pool->sockbuf, &pool->sockbuf[pool->sockbuf_start], datalen + 1);
+		pool->sockbuf_scan -= pool->sockbuf_start;
+		pool->sockbuf_end = datalen;
+		pool->sockbuf_start = 0;
+		if (pool->sockbuf_end + len + 1 <= pool->sockbuf_size)
+			return;
+	}
+
+	new = pool->sockbuf_size * 2;
+	if (new < pool->sockbuf_end + len + 1)
+		new = pool->sockbuf_end + len + 1;
+	new += RBUFSIZE - (new % RBUFSIZE);
+	// applog(LOG_DEBUG, "Reallocing pool sockbuf to %lu", (unsigned long)new);
 	pool->sockbuf = realloc(pool->sockbuf, new);
 	if (!pool->sockbuf)
 		quithere(1, "Failed to realloc pool sockbuf");
-	memset(pool->sockbuf + old, 0, new - old);
 	pool->sockbuf_size = new;
 }
 
-/* Peeks at a socket to find the first end of line and then reads just that
- * from the socket and returns that as a malloced char */
+static ssize_t sockbuf_recv(struct pool *pool)
+{
+	ssize_t n;
+
+	sockbuf_reserve(pool, RECVSIZE);
+	n = recv(pool->sock, &pool->sockbuf[pool->sockbuf_end], RECVSIZE, 0);
+	if (n > 0) {
+		pool->sockbuf_end += n;
+		pool->sockbuf[pool->sockbuf_end] = '\0';
+	}
+	return n;
+}
+
+/* Returns the next complete line already in the pool sockbuf as a malloced
+ * char, or NULL if there isn't one yet */
+char *recv_line_buffered(struct pool *pool)
+{
+	char *buf = pool->sockbuf, *nl, *sret;
+	size_t len;
+
+	if (unlikely(!buf))
+		return NULL;
+	while (true) {
+		nl = memchr(&buf[pool->sockbuf_scan], '\n', pool->sockbuf_end - pool->sockbuf_scan);
+		if (!nl) {
+			pool->sockbuf_scan = pool->sockbuf_end;
+			return NULL;
+		}
+		len = nl - &buf[pool->sockbuf_start];
+		if (len)
+			break;
+		// Skip blank lines
+		pool->sockbuf_start = pool->sockbuf_scan = pool->sockbuf_start + 1;
+	}
+
+	sret = malloc(len + 1);
+	if (unlikely(!sret))
+		quithere(1, "Failed to malloc line");
+	memcpy(sret, &buf[pool->sockbuf_start], len);
+	sret[len] = '\0';
+
+	pool->sockbuf_start = pool->sockbuf_scan = pool->sockbuf_start + len + 1;
+	if (pool->sockbuf_start == pool->sockbuf_end)
+		clear_sockbuf(pool);
+
+	pool->cgminer_pool_stats.times_received++;
+	pool->cgminer_pool_stats.bytes_received += len;
+	total_bytes_rcvd += len;
+	pool->cgminer_pool_stats.net_bytes_received += len;
+
+	if (opt_protocol)
+		applog(LOG_DEBUG, "Pool %u: RECV: %s", pool->pool_no, sret);
+	return sret;
+}
+
+/* Reads whatever is waiting on a readable socket into the pool sockbuf
+ * without waiting for more. Returns false if the connection has failed. */
+bool recv_available(struct pool *pool)
+{
+	ssize_t n = sockbuf_recv(pool);
+
+	if (!n) {
+		applog(LOG_DEBUG, "Socket closed in recv_available");
+		return false;
+	}
+	if (n < 0 && !sock_blocks()) {
+		applog(LOG_DEBUG, "Failed to recv sock in recv_available: %s", bfg_strerror(SOCKERR, BST_SOCKET));
+		return false;
+	}
+	return true;
+}
+
+/* Waits for a complete line from the socket and returns that as a malloced
+ * char */
 char *recv_line(struct pool *pool)
 {
-	char *tok, *sret = NULL;
-	ssize_t len, buflen;
+	char *sret;
 	int waited = 0;
 
-	if (!strstr(pool->sockbuf, "\n")) {
+	sret = recv_line_buffered(pool);
+	if (!sret) {
 		struct timeval rstart, now;
 
 		cgtime(&rstart);
@@ -1723,12 +1911,9 @@ char *recv_line(struct pool *pool)
 		}
 
 		do {
-			char s[RBUFSIZE];
-			size_t slen;
 			ssize_t n;
 
-			memset(s, 0, RBUFSIZE);
-			n = recv(pool->sock, s, RECVSIZE, 0);
+			n = sockbuf_recv(pool);
 			if (!n) {
 				applog(LOG_DEBUG, "Socket closed waiting in recv_line");
 				suspend_stratum(pool);
@@ -1737,7 +1922,7 @@ char *recv_line(struct pool *pool)
 			cgtime(&now);
 			waited = tdiff(&now, &rstart);
 			if (n < 0) {
-				//Save errno from being overweitten bei socket_ commands 
+				//Save errno from being overweitten bei socket_ commands
 				int socket_recv_errno;
 				socket_recv_errno = SOCKERR;
 				if (!sock_blocks() || !socket_full(pool, DEFAULT_SOCKWAIT - waited)) {
@@ -1745,40 +1930,16 @@ char *recv_line(struct pool *pool)
 					suspend_stratum(pool);
 					break;
 				}
-			} else {
-				slen = strlen(s);
-				recalloc_sock(pool, slen);
-				strcat(pool->sockbuf, s);
 			}
-		} while (waited < DEFAULT_SOCKWAIT && !strstr(pool->sockbuf, "\n"));
+		} while (waited < DEFAULT_SOCKWAIT && !(sret = recv_line_buffered(pool)));
 	}
 
-	buflen = strlen(pool->sockbuf);
-	tok = strtok(pool->sockbuf, "\n");
-	if (!tok) {
+	if (!sret)
 		applog(LOG_DEBUG, "Failed to parse a \\n terminated string in recv_line");
-		goto out;
-	}
-	sret = strdup(tok);
-	len = strlen(sret);
-
-	/* Copy what's left in the buffer after the \n, including the
-	 * terminating \0 */
-	if (buflen > len + 1)
-		memmove(pool->sockbuf, pool->sockbuf + len + 1, buflen - len + 1);
-	else
-		strcpy(pool->sockbuf, "");
-
-	pool->cgminer_pool_stats.times_received++;
-	pool->cgminer_pool_stats.bytes_received += len;
-	total_bytes_rcvd += len;
-	pool->cgminer_pool_stats.net_bytes_received += len;
 
 out:
 	if (!sret)
 		clear_sock(pool);
-	else if (opt_protocol)
-		applog(LOG_DEBUG, "Pool %u: RECV: %s", pool->pool_no, sret);
 	return sret;
 }
 
@@ -1899,13 +2060,13 @@ static bool parse_notify(struct pool *pool, json_t *val)
 	if (!prev_hash || !coinbase1 || !coinbase2 || !bbversion || !nbit || !ntime)
 		goto out;
 	
-	job_id = json_array_string(val, 0);
+	job_id = refstr_dup(__json_array_string(val, 0));
 	if (!job_id)
 		goto out;
 
 	cg_wlock(&pool->data_lock);
 	cgtime(&pool->swork.tv_received);
-	free(pool->swork.job_id);
+	refstr_unref(pool->swork.job_id);
 	pool->swork.job_id = job_id;
 	if (pool->swork.tr)
 	{
@@ -1931,6 +2092,7 @@ static bool parse_notify(struct pool *pool, json_t *val)
 	hex2bin(&coinbase[cb1_len], pool->swork.nonce1, pool->n1_len);
 	// NOTE: gap for nonce2, filled at work generation time
 	hex2bin(&coinbase[pool->swork.nonce2_offset + pool->swork.n2size], coinbase2, cb2_len);
+	pool->swork.coinbase_prefix_valid = false;
 	
 	bytes_resize(&pool->swork.merkle_bin, 32 * merkles);
 	for (i = 0; i < merkles; i++)
@@ -2019,8 +2181,14 @@ static bool parse_reconnect(struct pool *pool, json_t *val)
 
 	applog(LOG_NOTICE, "Reconnect requested from pool %d to %s", pool->pool_no, address);
 
+#ifdef USE_LIBEVENT
+	// Connecting blocks, so leave it to the pool's stratum thread rather
+	// than stall the event loop reading every other pool
+	pool->stratum_reconnect = true;
+#else
 	if (!restart_stratum(pool))
 		return false;
+#endif
 
 	return true;
 }
@@ -2230,8 +2398,7 @@ static bool setup_stratum_curl(struct pool *pool)
 	pool->stratum_curl = curl_easy_init();
 	if (unlikely(!pool->stratum_curl))
 		quithere(1, "Failed to curl_easy_init");
-	if (pool->sockbuf)
-		pool->sockbuf[0] = '\0';
+	clear_sockbuf(pool);
 
 	curl = pool->stratum_curl;
 
@@ -2339,6 +2506,9 @@ void suspend_stratum(struct pool *pool)
 	pool->stratum_curl = NULL;
 	pool->sock = INVSOCK;
 	mutex_unlock(&pool->stratum_lock);
+#ifdef USE_LIBEVENT
+	stratum_evloop_sock_changed(pool);
+#endif
 }
 
 bool initiate_stratum(struct pool *pool)
@@ -2442,9 +2612,10 @@ resend:
 	cg_wlock(&pool->data_lock);
 	free(pool->sessionid);
 	pool->sessionid = sessionid;
-	free(pool->swork.nonce1);
-	pool->swork.nonce1 = nonce1;
+	refstr_unref(pool->swork.nonce1);
+	pool->swork.nonce1 = refstr_dup(nonce1);
 	pool->n1_len = strlen(nonce1) / 2;
+	free(nonce1);
 	pool->swork.n2size = n2size;
 	pool->nonce2sz  = (n2size > sizeof(pool->nonce2)) ? sizeof(pool->nonce2) : n2size;
 #ifdef WORDS_BIGENDIAN
@@ -2517,6 +2688,10 @@ void dev_error_update(struct cgpu_info *dev, enum dev_reason reason)
 void dev_error(struct cgpu_info *dev, enum dev_reason reason)
 {
 	dev_error_update(dev, reason);
+	api_stats_changed();
+
+	if (api_event_wanted(API_EVENT_DEVICE))
+		api_event_device(dev, reason);
 
 	switch (reason) {
 		case REASON_THREAD_FAIL_INIT:
@@ -2961,6 +3136,43 @@ char *trimmed_strdup(const char *s)
 	return c;
 }
 
+struct refstr {
+	int refcount;
+	char s[];
+};
+
+static inline
+struct refstr *refstr_hdr(char * const s)
+{
+	return (struct refstr *)(s - offsetof(struct refstr, s));
+}
+
+char *refstr_dup(const char * const s)
+{
+	if (!s)
+		return NULL;
+	const size_t sz = strlen(s) + 1;
+	struct refstr * const rs = malloc(sizeof(*rs) + sz);
+	if (unlikely(!rs))
+		quit(1, "Failed to malloc in refstr_dup");
+	rs->refcount = 1;
+	memcpy(rs->s, s, sz);
+	return rs->s;
+}
+
+char *refstr_ref(char * const s)
+{
+	if (s)
+		__sync_add_and_fetch(&refstr_hdr(s)->refcount, 1);
+	return s;
+}
+
+void refstr_unref(char * const s)
+{
+	if (s && !__sync_sub_and_fetch(&refstr_hdr(s)->refcount, 1))
+		free(refstr_hdr(s));
+}
+
 
 void *cmd_thread(void *cmdp)
 {
@@ -2972,6 +3184,118 @@ void *cmd_thread(void *cmdp)
 	return NULL;
 }
 
+static
+int latency_hist_bucket(uint64_t us)
+{
+	int bits;
+
+	if (us < (1 << LATENCY_HIST_SUB_BITS))
+		return us;
+	bits = 63 - __builtin_clzll(us);
+	if (bits >= LATENCY_HIST_MAX_BITS)
+		return LATENCY_HIST_BUCKETS - 1;
+	return ((bits - LATENCY_HIST_SUB_BITS + 1) << LATENCY_HIST_SUB_BITS) | ((us >> (bits - LATENCY_HIST_SUB_BITS)) & ((1 << LATENCY_HIST_SUB_BITS) - 1));
+}
+
+// Returns the largest value counted in a bucket
+static
+uint64_t latency_hist_bucket_max(int bucket)
+{
+	int bits, sub;
+
+	if (bucket < (1 << LATENCY_HIST_SUB_BITS))
+		return bucket;
+	bits = (bucket >> LATENCY_HIST_SUB_BITS) + LATENCY_HIST_SUB_BITS - 1;
+	sub = bucket & ((1 << LATENCY_HIST_SUB_BITS) - 1);
+	return (((((uint64_t)1 << LATENCY_HIST_SUB_BITS) | sub) + 1) << (bits - LATENCY_HIST_SUB_BITS)) - 1;
+}
+
+void latency_hist_add(struct latency_hist * const hist, int64_t us)
+{
+	if (unlikely(us < 0))
+		us = 0;
+	++hist->buckets[latency_hist_bucket(us)];
+	++hist->count;
+	hist->total_us += us;
+	if ((uint64_t)us > hist->max_us)
+		hist->max_us = us;
+}
+
+void test_latency_hist()
+{
+	// The largest value with a bucket of its own, and beyond
+	static const uint64_t tests[] = {
+		((uint64_t)1 << LATENCY_HIST_MAX_BITS) - 1,
+		(uint64_t)1 << LATENCY_HIST_MAX_BITS,
+		((uint64_t)1 << (LATENCY_HIST_MAX_BITS + 1)) - 1,
+		INT64_MAX,
+	};
+	struct latency_hist hist;
+	int i, bucket;
+
+	memset(&hist, 0, sizeof(hist));
+	for (i = 0; i < sizeof(tests) / sizeof(*tests); ++i)
+	{
+		bucket = latency_hist_bucket(tests[i]);
+		if (bucket < 0 || bucket >= LATENCY_HIST_BUCKETS)
+			applog(LOG_ERR, "%s: %"PRIu64"us went to bucket %d of %d",
+			       __func__, tests[i], bucket, (int)LATENCY_HIST_BUCKETS);
+		else
+		if (i && bucket != LATENCY_HIST_BUCKETS - 1)
+			applog(LOG_ERR, "%s: %"PRIu64"us went to bucket %d instead of the last",
+			       __func__, tests[i], bucket);
+		else
+			latency_hist_add(&hist, tests[i]);
+	}
+	if (latency_hist_bucket_max(latency_hist_bucket(tests[0])) != tests[0])
+		applog(LOG_ERR, "%s: largest bucket ends at %"PRIu64"us instead of %"PRIu64"us",
+		       __func__, latency_hist_bucket_max(latency_hist_bucket(tests[0])), tests[0]);
+	if (hist.count == sizeof(tests) / sizeof(*tests) && latency_hist_percentile(&hist, 100) != INT64_MAX)
+		applog(LOG_ERR, "%s: 100th percentile is %"PRIu64"us instead of the maximum",
+		       __func__, latency_hist_percentile(&hist, 100));
+}
+
+uint64_t latency_hist_percentile(const struct latency_hist * const hist, const double pct)
+{
+	uint64_t want, seen = 0;
+	int i;
+
+	if (!hist->count)
+		return 0;
+	want = hist->count * pct / 100;
+	if (want >= hist->count)
+		want = hist->count - 1;
+	for (i = 0; i < LATENCY_HIST_BUCKETS; ++i) {
+		seen += hist->buckets[i];
+		if (seen > want)
+			break;
+	}
+	// The last bucket also counts everything too large for the others
+	if (i >= LATENCY_HIST_BUCKETS - 1)
+		return hist->max_us;
+	const uint64_t rv = latency_hist_bucket_max(i);
+	return (rv < hist->max_us) ? rv : hist->max_us;
+}
+
+// Returns a malloced "upper_us:count,..." list of the non-empty buckets
+char *latency_hist_buckets_str(const struct latency_hist * const hist)
+{
+	char *s = malloc((LATENCY_HIST_BUCKETS * 26) + 1), *p = s;
+	int i;
+
+	if (unlikely(!s))
+		quithere(1, "Failed to malloc");
+	*p = '\0';
+	for (i = 0; i < LATENCY_HIST_BUCKETS; ++i) {
+		if (!hist->buckets[i])
+			continue;
+		p += sprintf(p, "%s%llu:%lu", (p == s) ? "" : ",",
+		             (unsigned long long)latency_hist_bucket_max(i),
+		             (unsigned long)hist->buckets[i]);
+	}
+	return s;
+}
+
 void run_cmd(const char *cmd)
 {
 	if (!cmd)
@@ -3106,3 +3430,17 @@ uint16_t crc16(const void *p, size_t sz, uint16_t crc)
 		crc = crc16_floating(s[i], crc);
 	return crc;
 }
+
+#ifdef HAVE_NEON
+bool neon_available(void)
+{
+#if defined(__arm__) && defined(__linux__)
+	return getauxval(AT_HWCAP) & HWCAP_NEON;
+#elif defined(__arm__)
+	return false;
+#else
+	// NEON (Advanced SIMD) is part of the AArch64 baseline
+	return true;
+#endif
+}
+#endif
@@ -159,8 +159,11 @@ double us_tdiff(struct timeval *end, struct timeval *start);
 double tdiff(struct timeval *end, struct timeval *start);
 bool _stratum_send(struct pool *pool, char *s, ssize_t len, bool force);
 #define stratum_send(pool, s, len)  _stratum_send(pool, s, len, false)
+extern int stratum_send_lines(struct pool *, const char * const *lines, const size_t *lens, int n);
 bool sock_full(struct pool *pool);
 char *recv_line(struct pool *pool);
+char *recv_line_buffered(struct pool *pool);
+bool recv_available(struct pool *pool);
 bool parse_method(struct pool *pool, char *s);
 bool extract_sockaddr(char *url, char **sockaddr_url, char **sockaddr_port);
 bool auth_stratum(struct pool *pool);
@@ -433,6 +436,31 @@ bool timer_passed(const struct timeval *tvp_timer, const struct timeval *tvp_now
 	return timercmp(tvp_timer, _tvp_now, <);
 }
 
+/* Log-linear latency histogram: each power of two microseconds is split into
+ * (1 << LATENCY_HIST_SUB_BITS) buckets, so values are kept to within 12.5%
+ * from 1us up to about 12 days */
+#define LATENCY_HIST_SUB_BITS  3
+#define LATENCY_HIST_MAX_BITS  40
+#define LATENCY_HIST_BUCKETS  ((LATENCY_HIST_MAX_BITS - LATENCY_HIST_SUB_BITS + 1) << LATENCY_HIST_SUB_BITS)
+
+struct latency_hist {
+	uint64_t count;
+	uint64_t total_us;
+	uint64_t max_us;
+	uint32_t buckets[LATENCY_HIST_BUCKETS];
+};
+
+extern void latency_hist_add(struct latency_hist *, int64_t us);
+extern uint64_t latency_hist_percentile(const struct latency_hist *, double pct);
+extern char *latency_hist_buckets_str(const struct latency_hist *);
+extern void test_latency_hist();
+
+static inline
+void latency_hist_add_tv(struct latency_hist * const hist, const struct timeval * const tvp_start, const struct timeval * const tvp_end)
+{
+	latency_hist_add(hist, timer_elapsed_us(tvp_start, tvp_end));
+}
+
 #if defined(WIN32) && !defined(HAVE_POOR_GETTIMEOFDAY)
 #define HAVE_POOR_GETTIMEOFDAY
 #endif
@@ -509,6 +537,11 @@ void maybe_strdup_if_null(const char **p, const char *s)
 
 extern char *trimmed_strdup(const char *);
 
+// Reference counted strings, readable as any other char*, but never free()d directly
+extern char *refstr_dup(const char *);
+extern char *refstr_ref(char *);
+extern void refstr_unref(char *);
+
 
 extern void run_cmd(const char *cmd);
 
@@ -521,4 +554,8 @@ extern uint16_t crc16(const void *, size_t, uint16_t init);
 #define crc16ffff(  DATA, SZ)  crc16(DATA, SZ, 0xffff)
 #define crc16xmodem(DATA, SZ)  crc16(DATA, SZ, 0)
 
+#ifdef HAVE_NEON
+extern bool neon_available(void);
+#endif
+
 #endif /* __UTIL_H__ */